@@ -0,0 +1,442 @@
+// Arduino.h - host double of the Arduino core for the munet host benchmark
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <cctype>
+#include <chrono>
+#include <functional>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define LED_BUILTIN 2
+#define PROGMEM
+#define F(x) x
+
+/*! Simulated clock: if enabled, `micros()` and `millis()` only advance with hostAdvanceClock() */
+inline bool &hostSimulatedClock() {
+    static bool simulated = false;
+    return simulated;
+}
+
+inline uint64_t &hostClock() {
+    static uint64_t us = 0;
+    return us;
+}
+
+inline void hostAdvanceClock(unsigned long us) {
+    hostClock() += us;
+}
+
+inline unsigned long micros() {
+    if (hostSimulatedClock()) {
+        return (unsigned long)hostClock();
+    }
+    static auto start = std::chrono::steady_clock::now();
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+inline void delay(unsigned long) {
+}
+
+inline void yield() {
+}
+
+inline void pinMode(uint8_t, uint8_t) {
+}
+
+inline void digitalWrite(uint8_t, uint8_t) {
+}
+
+inline long random(long howbig) {
+    return howbig ? rand() % howbig : 0;
+}
+
+inline long random(long howsmall, long howbig) {
+    return howsmall < howbig ? howsmall + random(howbig - howsmall) : howsmall;
+}
+
+inline char *ltoa(long val, char *buf, int) {
+    sprintf(buf, "%ld", val);
+    return buf;
+}
+
+/*! Arduino compatible String, backed by std::string
+
+std::string uses a short string optimization of 15 characters, the ESP8266 and ESP32 cores use
+11 characters. Allocation counts of very short strings are therefore lower than on the target.
+*/
+class String {
+    std::string s;
+
+  public:
+    String() {
+    }
+    String(const char *c) : s(c ? c : "") {
+    }
+    String(const std::string &c) : s(c) {
+    }
+    explicit String(char c) : s(1, c) {
+    }
+    explicit String(int v) : s(std::to_string(v)) {
+    }
+    explicit String(unsigned int v) : s(std::to_string(v)) {
+    }
+    explicit String(long v) : s(std::to_string(v)) {
+    }
+    explicit String(unsigned long v) : s(std::to_string(v)) {
+    }
+    explicit String(double v, unsigned char decimals = 2) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.*f", decimals, v);
+        s = buf;
+    }
+
+    const char *c_str() const {
+        return s.c_str();
+    }
+    unsigned int length() const {
+        return s.length();
+    }
+    bool reserve(unsigned int n) {
+        s.reserve(n);
+        return true;
+    }
+
+    bool concat(const String &o) {
+        s += o.s;
+        return true;
+    }
+    bool concat(const char *o) {
+        s += o ? o : "";
+        return true;
+    }
+    bool concat(const char *o, unsigned int n) {
+        s.append(o, n);
+        return true;
+    }
+    bool concat(char c) {
+        s += c;
+        return true;
+    }
+    String &operator+=(const String &o) {
+        s += o.s;
+        return *this;
+    }
+    String &operator+=(const char *o) {
+        s += o ? o : "";
+        return *this;
+    }
+    String &operator+=(char c) {
+        s += c;
+        return *this;
+    }
+
+    friend String operator+(const String &a, const String &b) {
+        return a.s + b.s;
+    }
+    friend String operator+(const String &a, const char *b) {
+        return a.s + (b ? b : "");
+    }
+    friend String operator+(const char *a, const String &b) {
+        return (a ? a : "") + b.s;
+    }
+    friend String operator+(const String &a, char b) {
+        return a.s + b;
+    }
+
+    bool operator==(const String &o) const {
+        return s == o.s;
+    }
+    bool operator==(const char *o) const {
+        return s == (o ? o : "");
+    }
+    bool operator!=(const String &o) const {
+        return s != o.s;
+    }
+    bool operator!=(const char *o) const {
+        return !(*this == o);
+    }
+    bool operator<(const String &o) const {
+        return s < o.s;
+    }
+    bool equals(const String &o) const {
+        return s == o.s;
+    }
+    bool equalsIgnoreCase(const String &o) const {
+        if (s.length() != o.s.length()) {
+            return false;
+        }
+        for (size_t i = 0; i < s.length(); i++) {
+            if (tolower(s[i]) != tolower(o.s[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    char charAt(unsigned int i) const {
+        return i < s.length() ? s[i] : 0;
+    }
+    char operator[](unsigned int i) const {
+        return charAt(i);
+    }
+    char &operator[](unsigned int i) {
+        return s[i];
+    }
+    void setCharAt(unsigned int i, char c) {
+        if (i < s.length()) {
+            s[i] = c;
+        }
+    }
+
+    int indexOf(char c, unsigned int from = 0) const {
+        size_t pos = s.find(c, from);
+        return pos == std::string::npos ? -1 : (int)pos;
+    }
+    int indexOf(const String &o, unsigned int from = 0) const {
+        size_t pos = s.find(o.s, from);
+        return pos == std::string::npos ? -1 : (int)pos;
+    }
+    int lastIndexOf(char c) const {
+        size_t pos = s.rfind(c);
+        return pos == std::string::npos ? -1 : (int)pos;
+    }
+    bool startsWith(const String &o, unsigned int offset = 0) const {
+        return offset <= s.length() && s.compare(offset, o.s.length(), o.s) == 0;
+    }
+    bool endsWith(const String &o) const {
+        return s.length() >= o.s.length() &&
+               s.compare(s.length() - o.s.length(), o.s.length(), o.s) == 0;
+    }
+    String substring(unsigned int from) const {
+        return from < s.length() ? String(s.substr(from)) : String();
+    }
+    String substring(unsigned int from, unsigned int to) const {
+        if (from > to) {
+            std::swap(from, to);
+        }
+        return from < s.length() ? String(s.substr(from, to - from)) : String();
+    }
+
+    void toLowerCase() {
+        for (auto &c : s) {
+            c = tolower(c);
+        }
+    }
+    void toUpperCase() {
+        for (auto &c : s) {
+            c = toupper(c);
+        }
+    }
+    void trim() {
+        size_t first = s.find_first_not_of(" \t\r\n");
+        size_t last = s.find_last_not_of(" \t\r\n");
+        s = first == std::string::npos ? "" : s.substr(first, last - first + 1);
+    }
+    void replace(const String &from, const String &to) {
+        if (from.s.empty()) {
+            return;
+        }
+        for (size_t pos = s.find(from.s); pos != std::string::npos;
+             pos = s.find(from.s, pos + to.s.length())) {
+            s.replace(pos, from.s.length(), to.s);
+        }
+    }
+    void replace(char from, char to) {
+        for (auto &c : s) {
+            if (c == from) {
+                c = to;
+            }
+        }
+    }
+    void remove(unsigned int index) {
+        if (index < s.length()) {
+            s.erase(index);
+        }
+    }
+    void remove(unsigned int index, unsigned int count) {
+        if (index < s.length()) {
+            s.erase(index, count);
+        }
+    }
+    long toInt() const {
+        return atol(s.c_str());
+    }
+    float toFloat() const {
+        return atof(s.c_str());
+    }
+};
+
+class Print {
+  public:
+    virtual ~Print() {
+    }
+    virtual size_t write(uint8_t c) {
+        return write(&c, 1);
+    }
+    virtual size_t write(const uint8_t *buf, size_t size) {
+        return size;
+    }
+    size_t write(const char *buf, size_t size) {
+        return write((const uint8_t *)buf, size);
+    }
+    virtual int availableForWrite() {
+        return 0;
+    }
+    virtual void flush() {
+    }
+    size_t print(const String &s) {
+        return write((const uint8_t *)s.c_str(), s.length());
+    }
+    size_t println(const String &s) {
+        return print(s) + write('\n');
+    }
+};
+
+class Stream : public Print {
+  protected:
+    unsigned long timeout = 1000;
+
+  public:
+    virtual int available() {
+        return 0;
+    }
+    virtual int read() {
+        return -1;
+    }
+    virtual int peek() {
+        return -1;
+    }
+    virtual size_t readBytes(char *buf, size_t length) {
+        return 0;
+    }
+    size_t readBytes(uint8_t *buf, size_t length) {
+        return readBytes((char *)buf, length);
+    }
+    void setTimeout(unsigned long ms) {
+        timeout = ms;
+    }
+};
+
+/*! Serial port double: two instances connected with `connect()` form a loopback link
+
+Written bytes are appended to the receive buffer of the peer without any transmission delay.
+`availableForWrite()` reports the free space in the receive buffer of the peer.
+*/
+class HardwareSerial : public Stream {
+    enum { RX_BUFFER = 4096 };
+    uint8_t rxBuf[RX_BUFFER];
+    size_t rxHead = 0;
+    size_t rxUsed = 0;
+    HardwareSerial *pPeer = nullptr;
+
+  public:
+    unsigned long bytesWritten = 0;
+
+    void connect(HardwareSerial &peer) {
+        pPeer = &peer;
+        peer.pPeer = this;
+    }
+    void begin(unsigned long) {
+    }
+    void end() {
+    }
+    explicit operator bool() {
+        return true;
+    }
+    size_t setRxBufferSize(size_t size) {
+        return size;
+    }
+
+    int availableForWrite() override {
+        return pPeer ? (int)(RX_BUFFER - pPeer->rxUsed) : (int)RX_BUFFER;
+    }
+    size_t write(const uint8_t *buf, size_t size) override {
+        if (pPeer == nullptr) {
+            bytesWritten += size;
+            return size;
+        }
+        size_t n = 0;
+        while (n < size && pPeer->rxUsed < RX_BUFFER) {
+            pPeer->rxBuf[(pPeer->rxHead + pPeer->rxUsed++) % RX_BUFFER] = buf[n++];
+        }
+        bytesWritten += n;
+        return n;
+    }
+    using Print::write;
+
+    int available() override {
+        return (int)rxUsed;
+    }
+    int read() override {
+        if (rxUsed == 0) {
+            return -1;
+        }
+        uint8_t c = rxBuf[rxHead];
+        rxHead = (rxHead + 1) % RX_BUFFER;
+        --rxUsed;
+        return c;
+    }
+    int peek() override {
+        return rxUsed ? rxBuf[rxHead] : -1;
+    }
+    size_t readBytes(char *buf, size_t length) override {
+        size_t n = 0;
+        while (n < length && rxUsed) {
+            buf[n++] = (char)read();
+        }
+        return n;
+    }
+};
+
+class IPAddress {
+    uint8_t addr[4] = {0, 0, 0, 0};
+
+  public:
+    IPAddress() {
+    }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : addr{a, b, c, d} {
+    }
+    uint8_t operator[](int i) const {
+        return addr[i];
+    }
+    String toString() const {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+        return buf;
+    }
+};
+
+class EspClass {
+  public:
+    uint32_t getFreeHeap() {
+        return 40000;
+    }
+    uint32_t getMaxFreeBlockSize() {
+        return 32000;
+    }
+    uint32_t getChipId() {
+        return 0x123456;
+    }
+    void restart() {
+    }
+};
+
+// not used by every program: no -Wunused-variable warning
+static EspClass ESP __attribute__((unused));
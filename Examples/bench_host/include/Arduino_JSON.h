@@ -0,0 +1,50 @@
+// Arduino_JSON.h - host double of Arduino_JSON for the munet host benchmark
+#pragma once
+
+#include "Arduino.h"
+
+/*! JSON value that discards everything assigned to it
+
+JSON is only used for configuration and state messages of munet, not in the measured paths.
+*/
+class JSONVar {
+  public:
+    JSONVar() {
+    }
+    template <typename T> JSONVar(const T &) {
+    }
+    template <typename T> JSONVar &operator=(const T &) {
+        return *this;
+    }
+    template <typename T> JSONVar operator[](const T &) const {
+        return JSONVar();
+    }
+    operator const char *() const {
+        return nullptr;
+    }
+    explicit operator long() const {
+        return 0;
+    }
+    explicit operator bool() const {
+        return false;
+    }
+    int length() const {
+        return -1;
+    }
+};
+
+class JSONClass {
+  public:
+    JSONVar parse(const String &) {
+        return JSONVar();
+    }
+    String stringify(const JSONVar &) {
+        return "{}";
+    }
+    String typeof_(const JSONVar &) {
+        return "undefined";
+    }
+};
+
+static JSONClass JSON;
+#define typeof typeof_
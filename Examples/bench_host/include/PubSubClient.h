@@ -0,0 +1,97 @@
+// PubSubClient.h - host double of PubSubClient for the munet host benchmark
+#pragma once
+
+#include "Arduino.h"
+#include "WiFiClient.h"
+
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 1024
+#endif
+
+/*! MQTT client that is connected while `online` is set
+
+Published messages are counted and passed to `onPublish`, if set. `inject()` delivers a message to
+the callback as if it was received from the server.
+*/
+class PubSubClient {
+  public:
+    typedef std::function<void(char *, uint8_t *, unsigned int)> T_CALLBACK;
+    typedef std::function<void(const char *, const char *)> T_PUBLISH_HOOK;
+
+  private:
+    T_CALLBACK callback;
+    char topicBuf[MQTT_MAX_PACKET_SIZE];
+    uint8_t payloadBuf[MQTT_MAX_PACKET_SIZE];
+
+  public:
+    unsigned long published = 0;
+    unsigned long publishedBytes = 0;
+    bool online = true;
+    T_PUBLISH_HOOK onPublish;
+
+    PubSubClient() {
+    }
+    PubSubClient(Client &) {
+    }
+
+    static PubSubClient *&active() {
+        // the client that registered the last callback
+        static PubSubClient *pClient = nullptr;
+        return pClient;
+    }
+
+    PubSubClient &setClient(Client &) {
+        return *this;
+    }
+    PubSubClient &setServer(const char *, uint16_t) {
+        return *this;
+    }
+    PubSubClient &setCallback(T_CALLBACK cb) {
+        callback = cb;
+        active() = this;
+        return *this;
+    }
+    bool connect(const char *id, const char *user, const char *pass, const char *willTopic,
+                 uint8_t willQos, bool willRetain, const char *willMessage,
+                 bool cleanSession = true) {
+        return online;
+    }
+    void disconnect() {
+    }
+    bool connected() {
+        return online;
+    }
+    bool loop() {
+        return true;
+    }
+    bool subscribe(const char *, uint8_t qos = 0) {
+        return true;
+    }
+    bool unsubscribe(const char *) {
+        return true;
+    }
+    bool publish(const char *topic, const char *payload, bool retained = false) {
+        if (!online) {
+            return false;
+        }
+        if (onPublish) {
+            onPublish(topic, payload);
+        }
+        ++published;
+        publishedBytes += strlen(topic) + strlen(payload);
+        return true;
+    }
+
+    bool inject(const char *topic, const char *payload) {
+        // like the real client: the topic is terminated, the payload is not
+        size_t tlen = strlen(topic);
+        size_t plen = strlen(payload);
+        if (!callback || tlen + 1 > sizeof(topicBuf) || plen > sizeof(payloadBuf)) {
+            return false;
+        }
+        memcpy(topicBuf, topic, tlen + 1);
+        memcpy(payloadBuf, payload, plen);
+        callback(topicBuf, payloadBuf, plen);
+        return true;
+    }
+};
@@ -0,0 +1,30 @@
+// WiFiClient.h - host double of WiFiClient for the munet host benchmark
+#pragma once
+
+#include "Arduino.h"
+
+class Client : public Stream {
+  public:
+    virtual int connect(const char *host, uint16_t port) {
+        return 1;
+    }
+    virtual uint8_t connected() {
+        return 1;
+    }
+    virtual void stop() {
+    }
+};
+
+class WiFiClient : public Client {};
+
+class WiFiClass {
+  public:
+    String hostname() {
+        return "benchhost";
+    }
+    String macAddress() {
+        return "00:00:00:00:00:00";
+    }
+};
+
+static WiFiClass WiFi __attribute__((unused));
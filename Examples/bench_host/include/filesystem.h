@@ -0,0 +1,111 @@
+// filesystem.h - host double of the flash file system for the munet host benchmark
+#pragma once
+
+#include "Arduino.h"
+
+#include <map>
+#include <memory>
+#include <string>
+
+namespace fs {
+
+/*! File of the in-memory file system
+
+All handles of a file share its content, writes always append like the file modes "a" and "w" of
+LittleFS.
+*/
+class File {
+    std::shared_ptr<std::string> data;
+    size_t pos = 0;
+
+  public:
+    File() {
+    }
+    File(std::shared_ptr<std::string> data) : data(data) {
+    }
+    explicit operator bool() const {
+        return data != nullptr;
+    }
+    size_t size() {
+        return data ? data->size() : 0;
+    }
+    size_t position() {
+        return pos;
+    }
+    bool seek(uint32_t p) {
+        if (!data || p > data->size()) {
+            return false;
+        }
+        pos = p;
+        return true;
+    }
+    size_t read(uint8_t *buf, size_t size) {
+        size_t n = 0;
+        while (data && n < size && pos < data->size()) {
+            buf[n++] = (*data)[pos++];
+        }
+        return n;
+    }
+    size_t write(const uint8_t *buf, size_t size) {
+        if (!data) {
+            return 0;
+        }
+        data->append((const char *)buf, size);
+        return size;
+    }
+    void close() {
+        data.reset();
+        pos = 0;
+    }
+};
+
+/*! In-memory file system: the content survives all objects using it, like the flash */
+class FS {
+  public:
+    std::map<std::string, std::shared_ptr<std::string>> files;
+
+    bool begin() {
+        return true;
+    }
+    bool exists(const String &name) {
+        return files.count(name.c_str()) != 0;
+    }
+    File open(const String &name, const char *mode) {
+        auto it = files.find(name.c_str());
+        if (mode[0] == 'r') {
+            return it == files.end() ? File() : File(it->second);
+        }
+        if (mode[0] == 'w' || it == files.end()) {
+            files[name.c_str()] = std::make_shared<std::string>();
+        }
+        return File(files[name.c_str()]);
+    }
+    bool remove(const String &name) {
+        return files.erase(name.c_str()) != 0;
+    }
+    bool rename(const String &from, const String &to) {
+        auto it = files.find(from.c_str());
+        if (it == files.end()) {
+            return false;
+        }
+        std::shared_ptr<std::string> data = it->second;
+        files.erase(it);
+        files[to.c_str()] = data;
+        return true;
+    }
+    size_t fileSize(const String &name) {
+        auto it = files.find(name.c_str());
+        return it == files.end() ? 0 : it->second->size();
+    }
+    void truncate(const String &name, size_t size) {
+        // simulates a power loss while the file was written
+        auto it = files.find(name.c_str());
+        if (it != files.end() && size < it->second->size()) {
+            it->second->resize(size);
+        }
+    }
+};
+
+}  // namespace fs
+
+static fs::FS LittleFS;
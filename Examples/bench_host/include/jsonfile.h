@@ -0,0 +1,73 @@
+// jsonfile.h - host double of ustd::jsonfile for the munet host benchmark
+#pragma once
+
+#include "ustd_array.h"
+#include "Arduino_JSON.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ustd {
+
+/*! Configuration without files: every option has its default value
+
+Options can be set for all instances with `set()` and `setArray()`, e.g. by a test. Values are
+returned unchecked as given.
+*/
+class jsonfile {
+    static std::map<std::string, String> &values() {
+        static std::map<std::string, String> v;
+        return v;
+    }
+    static std::map<std::string, std::vector<String>> &arrays() {
+        static std::map<std::string, std::vector<String>> a;
+        return a;
+    }
+
+  public:
+    static void set(const String &key, const String &value) {
+        values()[key.c_str()] = value;
+    }
+    static void setArray(const String &key, const std::vector<String> &value) {
+        arrays()[key.c_str()] = value;
+    }
+    static void clear() {
+        values().clear();
+        arrays().clear();
+    }
+
+    String readString(String key, String defVal = "") {
+        auto it = values().find(key.c_str());
+        return it == values().end() ? defVal : it->second;
+    }
+    String readString(String key, long minLen, String defVal = "") {
+        return readString(key, defVal);
+    }
+    long readLong(String key, long defVal = 0) {
+        auto it = values().find(key.c_str());
+        return it == values().end() ? defVal : it->second.toInt();
+    }
+    long readLong(String key, long minVal, long maxVal, long defVal) {
+        return readLong(key, defVal);
+    }
+    bool readBool(String key, bool defVal = false) {
+        auto it = values().find(key.c_str());
+        return it == values().end() ? defVal : it->second == "true";
+    }
+    bool readStringArray(String key, ustd::array<String> &value) {
+        auto it = arrays().find(key.c_str());
+        if (it == arrays().end()) {
+            return false;
+        }
+        for (String entry : it->second) {
+            value.add(entry);
+        }
+        return true;
+    }
+    bool readJsonVarArray(String key, ustd::array<JSONVar> &value) {
+        return false;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,153 @@
+// scheduler.h - host double of the muwerk scheduler for the munet host benchmark
+#pragma once
+
+#include "ustd_platform.h"
+#include "ustd_array.h"
+
+namespace ustd {
+
+typedef std::function<void()> T_TASK;
+typedef std::function<void(String topic, String msg, String originator)> T_SUBS;
+
+/*! Scheduler with the pub/sub semantics of muwerk
+
+Published messages are queued and delivered by `loop()` to all matching subscriptions. Task
+periods are ignored: every `loop()` runs all tasks once, so that the benchmark measures the
+work per message and not the configured periods. The message queue reuses its string buffers.
+*/
+class Scheduler {
+    typedef struct {
+        T_TASK task;
+        bool active;
+    } T_TASKENTRY;
+    typedef struct {
+        String topic;
+        T_SUBS subs;
+        bool active;
+    } T_SUBSENTRY;
+    typedef struct {
+        String topic;
+        String msg;
+        String originator;
+    } T_MSG;
+
+    ustd::array<T_TASKENTRY> tasks;
+    ustd::array<T_SUBSENTRY> subscriptions;
+    T_MSG *queue;
+    unsigned int queueSize;
+    unsigned int queueHead = 0;
+    unsigned int queueCount = 0;
+    unsigned long startMillis;
+
+  public:
+    unsigned long dropped = 0;
+
+    Scheduler(int nTaskListSize = 2, int nSubscriptionListSize = 2, int nQueueSize = 256)
+        : tasks(nTaskListSize), subscriptions(nSubscriptionListSize), queueSize(nQueueSize) {
+        queue = new T_MSG[queueSize];
+        startMillis = millis();
+    }
+
+    ~Scheduler() {
+        delete[] queue;
+    }
+
+    int add(T_TASK task, String name, unsigned long minMicroSecs = 0, int priority = 0) {
+        T_TASKENTRY entry = {task, true};
+        return tasks.add(entry);
+    }
+
+    bool remove(int taskID) {
+        if (taskID < 0 || taskID >= (int)tasks.length()) {
+            return false;
+        }
+        tasks[taskID].active = false;
+        return true;
+    }
+
+    bool reschedule(int taskID, unsigned long minMicroSecs) {
+        return taskID >= 0 && taskID < (int)tasks.length();
+    }
+
+    int subscribe(int taskID, String topic, T_SUBS subs, String originator = "") {
+        T_SUBSENTRY entry = {topic, subs, true};
+        return subscriptions.add(entry);
+    }
+
+    bool unsubscribe(int subscriptionHandle) {
+        if (subscriptionHandle < 0 || subscriptionHandle >= (int)subscriptions.length()) {
+            return false;
+        }
+        subscriptions[subscriptionHandle].active = false;
+        return true;
+    }
+
+    bool publish(String topic, String msg = "", String originator = "") {
+        if (queueCount == queueSize) {
+            ++dropped;
+            return false;
+        }
+        T_MSG &slot = queue[(queueHead + queueCount++) % queueSize];
+        slot.topic = topic;
+        slot.msg = msg;
+        slot.originator = originator;
+        return true;
+    }
+
+    unsigned long getUptime() {
+        return (millis() - startMillis) / 1000;
+    }
+
+    void loop() {
+        // messages published during delivery are delivered in the next loop
+        for (unsigned int n = queueCount; n; n--) {
+            T_MSG &msg = queue[queueHead];
+            for (unsigned int i = 0; i < subscriptions.length(); i++) {
+                T_SUBSENTRY &entry = subscriptions[i];
+                if (entry.active && mqttmatch(msg.topic, entry.topic)) {
+                    entry.subs(msg.topic, msg.msg, msg.originator);
+                }
+            }
+            queueHead = (queueHead + 1) % queueSize;
+            --queueCount;
+        }
+        for (unsigned int i = 0; i < tasks.length(); i++) {
+            if (tasks[i].active) {
+                tasks[i].task();
+            }
+        }
+    }
+
+    unsigned int pending() {
+        return queueCount;
+    }
+
+    static bool mqttmatch(const String &pubstr, const String &substr) {
+        const char *pub = pubstr.c_str();
+        const char *sub = substr.c_str();
+        while (true) {
+            if (*sub == '#') {
+                return true;
+            }
+            size_t pubLen = strcspn(pub, "/");
+            size_t subLen = strcspn(sub, "/");
+            bool plus = subLen == 1 && *sub == '+';
+            if (!plus && (pubLen != subLen || strncmp(pub, sub, pubLen) != 0)) {
+                return false;
+            }
+            pub += pubLen;
+            sub += subLen;
+            if (*pub == 0) {
+                // `a/#` also matches `a`
+                return *sub == 0 || strcmp(sub, "/#") == 0;
+            }
+            if (*sub == 0) {
+                return false;
+            }
+            ++pub;
+            ++sub;
+        }
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,165 @@
+// simserial.h - simulated serial line for the munet serial link bench
+#pragma once
+
+#include "Arduino.h"
+
+#include <deque>
+
+/*! Serial port double with baud rate, latency and transmission errors
+
+Two instances connected with `connect()` form a serial line. Time is taken from `micros()`, the
+bench uses the simulated clock of the host doubles. A written byte occupies the line for 10 bit
+times (8N1) and arrives at the peer `latency` micro seconds after it left the line. The transmit
+FIFO holds `txFifo` bytes, the receive buffer is unlimited.
+
+Errors are injected on the line: every byte is lost with the probability `byteLoss` and gets a
+single flipped bit with the probability `bitFlip`. `dropNext()` loses the next bytes written,
+`inject()` places raw bytes in the receive buffer of the peer.
+*/
+class SimSerial : public HardwareSerial {
+    typedef struct {
+        uint64_t due;  // time the byte is readable by the receiver
+        uint8_t data;
+    } T_BYTE;
+
+    std::deque<T_BYTE> rx;
+    SimSerial *pPeer = nullptr;
+    // ns: the byte time of fast baud rates is not a whole number of micro seconds
+    uint64_t lineFree = 0;  // time the line has sent all bytes of the transmit FIFO
+    unsigned int dropCount = 0;
+    uint32_t rnd = 2463534242u;
+
+  public:
+    unsigned long baudRate = 115200;  //!< 0: no transmission delay
+    unsigned long latency = 0;        //!< micro seconds from the line to the receiver
+    double byteLoss = 0;              //!< probability of a lost byte
+    double bitFlip = 0;               //!< probability of a flipped bit in a byte
+    unsigned int txFifo = 128;        //!< size of the transmit FIFO
+
+    unsigned long bytesSent = 0;
+    unsigned long bytesLost = 0;
+    unsigned long bytesFlipped = 0;
+
+    void connect(SimSerial &peer) {
+        pPeer = &peer;
+        peer.pPeer = this;
+    }
+
+    void seed(uint32_t value) {
+        rnd = value ? value : 1;
+    }
+
+    void dropNext(unsigned int count) {
+        dropCount += count;
+    }
+
+    void inject(const uint8_t *buf, size_t size) {
+        // behind the bytes that are already on their way
+        uint64_t due = micros();
+        if (!pPeer->rx.empty() && pPeer->rx.back().due > due) {
+            due = pPeer->rx.back().due;
+        }
+        for (size_t i = 0; i < size; i++) {
+            pPeer->receive(due, buf[i]);
+        }
+    }
+
+    unsigned long getLineSpeed() {
+        // bytes per second
+        return baudRate / 10;
+    }
+
+    unsigned long txBacklog() {
+        // bytes written but not yet sent on the line
+        uint64_t now = (uint64_t)micros() * 1000;
+        if (baudRate == 0 || lineFree <= now) {
+            return 0;
+        }
+        return (unsigned long)((lineFree - now) * getLineSpeed() / 1000000000);
+    }
+
+    int availableForWrite() override {
+        unsigned long backlog = txBacklog();
+        return backlog >= txFifo ? 0 : (int)(txFifo - backlog);
+    }
+
+    size_t write(const uint8_t *buf, size_t size) override {
+        size_t space = availableForWrite();
+        size_t n = size < space ? size : space;
+        uint64_t now = (uint64_t)micros() * 1000;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t start = lineFree > now ? lineFree : now;
+            lineFree = baudRate ? start + 10000000000ULL / baudRate : start;
+            transmit((lineFree + 999) / 1000 + latency, buf[i]);
+        }
+        return n;
+    }
+    using Print::write;
+
+    int available() override {
+        uint64_t now = micros();
+        int count = 0;
+        for (auto &b : rx) {
+            if (b.due > now) {
+                break;
+            }
+            ++count;
+        }
+        return count;
+    }
+
+    int read() override {
+        if (rx.empty() || rx.front().due > micros()) {
+            return -1;
+        }
+        uint8_t data = rx.front().data;
+        rx.pop_front();
+        return data;
+    }
+
+    int peek() override {
+        return rx.empty() || rx.front().due > micros() ? -1 : rx.front().data;
+    }
+
+    size_t readBytes(char *buf, size_t length) override {
+        size_t n = 0;
+        int c;
+        while (n < length && (c = read()) != -1) {
+            buf[n++] = (char)c;
+        }
+        return n;
+    }
+
+  private:
+    double nextRandom() {
+        // xorshift32: deterministic errors for reproducible results
+        rnd ^= rnd << 13;
+        rnd ^= rnd >> 17;
+        rnd ^= rnd << 5;
+        return rnd / 4294967296.0;
+    }
+
+    void transmit(uint64_t due, uint8_t data) {
+        ++bytesSent;
+        if (dropCount) {
+            --dropCount;
+            ++bytesLost;
+            return;
+        }
+        if (byteLoss > 0 && nextRandom() < byteLoss) {
+            ++bytesLost;
+            return;
+        }
+        if (bitFlip > 0 && nextRandom() < bitFlip) {
+            data ^= 1 << (rnd % 8);
+            ++bytesFlipped;
+        }
+        if (pPeer) {
+            pPeer->receive(due, data);
+        }
+    }
+
+    void receive(uint64_t due, uint8_t data) {
+        rx.push_back({due, data});
+    }
+};
@@ -0,0 +1,29 @@
+// timeout.h - host double of ustd::timeout for the munet host benchmark
+#pragma once
+
+#include "ustd_platform.h"
+
+namespace ustd {
+
+class timeout {
+  public:
+    unsigned long time;
+    unsigned long start;
+
+    timeout(unsigned long ms = 0) : time(ms), start(millis()) {
+    }
+    void operator=(unsigned long ms) {
+        time = ms;
+    }
+    bool test() {
+        return timeDiff(start, millis()) > time;
+    }
+    void reset() {
+        start = millis();
+    }
+    operator unsigned long() const {
+        return time;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,91 @@
+// ustd_array.h - host double of ustd::array for the munet host benchmark
+#pragma once
+
+#include "ustd_platform.h"
+
+namespace ustd {
+
+/*! Growing array with the interface and the allocation pattern of ustd::array */
+template <typename T> class array {
+    T *arr = nullptr;
+    unsigned int startSize;
+    unsigned int maxSize;
+    unsigned int incSize;
+    unsigned int allocSize = 0;
+    unsigned int size = 0;
+    T bad;
+
+  public:
+    array(unsigned int startSize = 16, unsigned int maxSize = 256, unsigned int incSize = 16,
+          bool shrink = true)
+        : startSize(startSize), maxSize(maxSize), incSize(incSize) {
+    }
+
+    ~array() {
+        delete[] arr;
+    }
+
+    T &operator[](unsigned int i) {
+        return i < size ? arr[i] : bad;
+    }
+
+    int add(T &ent) {
+        if (size >= allocSize && !resize(allocSize ? allocSize + incSize : startSize)) {
+            return -1;
+        }
+        arr[size] = ent;
+        return size++;
+    }
+
+    bool erase(unsigned int index) {
+        if (index >= size) {
+            return false;
+        }
+        for (unsigned int i = index; i + 1 < size; i++) {
+            arr[i] = arr[i + 1];
+        }
+        --size;
+        return true;
+    }
+
+    void erase() {
+        delete[] arr;
+        arr = nullptr;
+        allocSize = 0;
+        size = 0;
+    }
+
+    bool isEmpty() {
+        return size == 0;
+    }
+
+    unsigned int length() {
+        return size;
+    }
+
+    unsigned int alloclen() {
+        return allocSize;
+    }
+
+    bool resize(unsigned int newSize) {
+        if (newSize > maxSize && maxSize) {
+            newSize = maxSize;
+        }
+        if (newSize <= allocSize) {
+            return false;
+        }
+        T *pNew = new T[newSize];
+        for (unsigned int i = 0; i < size; i++) {
+            pNew[i] = arr[i];
+        }
+        delete[] arr;
+        arr = pNew;
+        allocSize = newSize;
+        return true;
+    }
+
+  private:
+    array(const array &);
+};
+
+}  // namespace ustd
@@ -0,0 +1,54 @@
+// ustd_map.h - host double of ustd::map for the munet host benchmark
+#pragma once
+
+#include "ustd_array.h"
+
+namespace ustd {
+
+template <typename K, typename V> class map {
+  public:
+    ustd::array<K> keys;
+    ustd::array<V> values;
+
+    map(unsigned int startSize = 16, unsigned int maxSize = 256, unsigned int incSize = 16,
+        bool shrink = true)
+        : keys(startSize, maxSize, incSize, shrink), values(startSize, maxSize, incSize, shrink) {
+    }
+
+    int find(K key) {
+        for (unsigned int i = 0; i < keys.length(); i++) {
+            if (keys[i] == key) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int add(K key, V value) {
+        int i = find(key);
+        if (i != -1) {
+            values[i] = value;
+            return i;
+        }
+        if (keys.add(key) == -1) {
+            return -1;
+        }
+        return values.add(value);
+    }
+
+    bool erase(K key) {
+        int i = find(key);
+        return i != -1 && keys.erase(i) && values.erase(i);
+    }
+
+    unsigned int length() {
+        return keys.length();
+    }
+
+    V &operator[](K key) {
+        int i = find(key);
+        return values[i == -1 ? values.length() : i];
+    }
+};
+
+}  // namespace ustd
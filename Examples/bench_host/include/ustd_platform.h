@@ -0,0 +1,18 @@
+// ustd_platform.h - host double of the ustd platform header for the munet host benchmark
+#pragma once
+
+#include "Arduino.h"
+// like on the ESP platforms, the WiFi interface is always available
+#include "WiFiClient.h"
+
+#if !defined(__UNIXOID__)
+#error "The munet host benchmark requires the platform define __UNIXOID__"
+#endif
+
+#define DBG(...)
+#define DBG2(...)
+#define DBG3(...)
+
+inline unsigned long timeDiff(unsigned long first, unsigned long second) {
+    return second - first;  // wraps correctly for unsigned values
+}
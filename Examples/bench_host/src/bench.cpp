@@ -0,0 +1,253 @@
+// munet host benchmark
+//
+// Measures the routing hot paths of Mqtt and MuSerial on a Linux host. WiFi, the MQTT client and
+// the serial ports are replaced by the doubles in ../include. Every result is printed as one JSON
+// object per line:
+//
+// {"bench":"mqtt_route","blocks":32,"payload":128,"msgs":20000,"delivered":20000,
+//  "seconds":0.0612,"msgsPerSec":326797,"allocsPerMsg":2.00,"bytesPerMsg":290.1}
+//
+// Usage: bench [messages per run]
+
+#include "scheduler.h"
+#include "jsonfile.h"
+#include "netstate.h"
+#include "mqtt.h"
+#include "muserial.h"
+
+#include <chrono>
+#include <cstdio>
+
+// allocation counting: the global allocation functions of glibc are replaced, operator new
+// allocates through malloc()
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocCount = 0;
+static unsigned long long allocBytes = 0;
+
+void *malloc(size_t size) {
+    ++allocCount;
+    allocBytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    ++allocCount;
+    allocBytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    ++allocCount;
+    allocBytes += size;
+    return __libc_realloc(ptr, size);
+}
+}
+
+namespace {
+
+const unsigned int TOPICS = 16;       // number of distinct topics of a run
+const unsigned int BATCH = 8;         // messages published per scheduler loop
+const unsigned int blockCounts[] = {0, 8, 32, 128};
+const unsigned int payloadLengths[] = {16, 128, 512};
+
+class Measurement {
+    std::chrono::steady_clock::time_point start;
+    unsigned long startAllocs;
+    unsigned long long startBytes;
+
+  public:
+    Measurement()
+        : start(std::chrono::steady_clock::now()), startAllocs(allocCount),
+          startBytes(allocBytes) {
+    }
+
+    void report(const char *bench, unsigned int blocks, unsigned int payload, unsigned long msgs,
+                unsigned long delivered) {
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        unsigned long allocs = allocCount - startAllocs;
+        unsigned long long bytes = allocBytes - startBytes;
+        printf("{\"bench\":\"%s\",\"blocks\":%u,\"payload\":%u,\"msgs\":%lu,\"delivered\":%lu,"
+               "\"seconds\":%.4f,\"msgsPerSec\":%.0f,\"allocsPerMsg\":%.2f,"
+               "\"bytesPerMsg\":%.1f}\n",
+               bench, blocks, payload, msgs, delivered, seconds,
+               seconds > 0 ? msgs / seconds : 0.0, msgs ? (double)allocs / msgs : 0.0,
+               msgs ? (double)bytes / msgs : 0.0);
+        fflush(stdout);
+    }
+};
+
+String makePayload(unsigned int len) {
+    String payload;
+    payload.reserve(len);
+    for (unsigned int i = 0; i < len; i++) {
+        payload += (char)('a' + i % 26);
+    }
+    return payload;
+}
+
+void makeTopics(String *topics, const char *prefix) {
+    for (unsigned int i = 0; i < TOPICS; i++) {
+        topics[i] = prefix + String(i) + "/value";
+    }
+}
+
+String blockFilter(unsigned int i) {
+    // half of the filters share the first level of the routed topics
+    return i % 2 ? "bench/node" + String(i) + "/+" : "block" + String(i) + "/#";
+}
+
+void connectMqtt(ustd::Scheduler &sched) {
+    String msg = "{\"state\":\"connected\",\"hostname\":\"benchhost\"}";
+    ustd::NetState::update(msg, "connected", "benchhost", "00:00:00:00:00:00", "127.0.0.1");
+    sched.publish("net/network", msg);
+    for (int i = 0; i < 4; i++) {
+        sched.loop();
+    }
+}
+
+void runBaseline(unsigned long msgs, unsigned int payloadLen) {
+    // cost of the scheduler double alone, to be subtracted from the other results
+    ustd::Scheduler sched;
+    unsigned long delivered = 0;
+    int tID = sched.add([]() {}, "bench");
+    sched.subscribe(tID, "#", [&](String topic, String msg, String originator) { ++delivered; });
+    String topics[TOPICS];
+    makeTopics(topics, "bench/sensor");
+    String payload = makePayload(payloadLen);
+
+    Measurement m;
+    for (unsigned long i = 0; i < msgs; i++) {
+        sched.publish(topics[i % TOPICS], payload);
+        if (i % BATCH == BATCH - 1) {
+            sched.loop();
+        }
+    }
+    sched.loop();
+    m.report("sched_baseline", 0, payloadLen, msgs, delivered);
+}
+
+void runMqttRoute(unsigned long msgs, unsigned int blocks, unsigned int payloadLen) {
+    // local messages routed by Mqtt::subsMsg() to the external server
+    ustd::Scheduler sched;
+    ustd::Mqtt mqtt;
+    mqtt.begin(&sched, "bench.local", 1883, false, "bench");
+    connectMqtt(sched);
+    for (unsigned int i = 0; i < blocks; i++) {
+        mqtt.outgoingBlockSet(blockFilter(i));
+    }
+    PubSubClient *pClient = PubSubClient::active();
+    String topics[TOPICS];
+    makeTopics(topics, "bench/sensor");
+    String payload = makePayload(payloadLen);
+    unsigned long start = pClient->published;
+
+    Measurement m;
+    for (unsigned long i = 0; i < msgs; i++) {
+        sched.publish(topics[i % TOPICS], payload);
+        if (i % BATCH == BATCH - 1) {
+            sched.loop();
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        sched.loop();
+    }
+    m.report("mqtt_route", blocks, payloadLen, msgs, pClient->published - start);
+}
+
+void runMqttReceive(unsigned long msgs, unsigned int blocks, unsigned int payloadLen) {
+    // messages received from the external server by Mqtt::mqttReceive()
+    ustd::Scheduler sched;
+    ustd::Mqtt mqtt;
+    mqtt.begin(&sched, "bench.local", 1883, false, "bench");
+    connectMqtt(sched);
+    for (unsigned int i = 0; i < blocks; i++) {
+        mqtt.incomingBlockSet("bench/" + blockFilter(i));
+    }
+    unsigned long delivered = 0;
+    int tID = sched.add([]() {}, "bench");
+    sched.subscribe(tID, "sensor/#", [&](String topic, String msg, String originator) {
+        ++delivered;
+    });
+    PubSubClient *pClient = PubSubClient::active();
+    String topics[TOPICS];
+    makeTopics(topics, "bench/sensor/");
+    String payload = makePayload(payloadLen);
+
+    Measurement m;
+    for (unsigned long i = 0; i < msgs; i++) {
+        pClient->inject(topics[i % TOPICS].c_str(), payload.c_str());
+        if (i % BATCH == BATCH - 1) {
+            sched.loop();
+        }
+    }
+    sched.loop();
+    m.report("mqtt_receive", blocks, payloadLen, msgs, delivered);
+}
+
+void runMuSerial(unsigned long msgs, unsigned int blocks, unsigned int payloadLen) {
+    // messages sent by MuSerial::sendOut() on node A and parsed by node B
+    HardwareSerial serialA;
+    HardwareSerial serialB;
+    serialA.connect(serialB);
+    ustd::Scheduler schedA;
+    ustd::Scheduler schedB;
+    ustd::MuSerial linkA("nodeA", &serialA);
+    ustd::MuSerial linkB("nodeB", &serialB);
+    linkA.statsInterval = 0;
+    linkB.statsInterval = 0;
+    linkA.begin(&schedA);
+    linkB.begin(&schedB);
+    for (unsigned int i = 0; i < blocks; i++) {
+        linkA.outgoingBlockSet(blockFilter(i));
+    }
+    unsigned long delivered = 0;
+    bool connected = false;
+    int tID = schedB.add([]() {}, "bench");
+    schedB.subscribe(tID, "bench/#", [&](String topic, String msg, String originator) {
+        ++delivered;
+    });
+    schedB.subscribe(tID, "nodeB/link/nodeA", [&](String topic, String msg, String originator) {
+        connected = msg == "connected";
+    });
+    for (int i = 0; i < 100 && !connected; i++) {
+        schedA.loop();
+        schedB.loop();
+    }
+    String topics[TOPICS];
+    makeTopics(topics, "bench/sensor");
+    String payload = makePayload(payloadLen);
+
+    Measurement m;
+    for (unsigned long i = 0; i < msgs; i++) {
+        schedA.publish(topics[i % TOPICS], payload);
+        schedA.loop();
+        schedB.loop();
+    }
+    for (int i = 0; i < 16; i++) {
+        schedA.loop();
+        schedB.loop();
+    }
+    m.report(connected ? "muserial" : "muserial_nolink", blocks, payloadLen, msgs, delivered);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    unsigned long msgs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+    for (unsigned int payload : payloadLengths) {
+        runBaseline(msgs, payload);
+    }
+    for (unsigned int blocks : blockCounts) {
+        for (unsigned int payload : payloadLengths) {
+            runMqttRoute(msgs, blocks, payload);
+            runMqttReceive(msgs, blocks, payload);
+            runMuSerial(msgs, blocks, payload);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,320 @@
+// munet outbox test
+//
+// Runs ustd::Outbox and the outbox path of Mqtt against the in-memory file system of
+// ../include/filesystem.h on a simulated clock: batched writes, replay after a restart, compaction,
+// truncated logs, read errors while compacting, confirmation by the echoed marker and messages
+// that can never be published.
+// Prints one line per failed check and exits with 1 if any check failed.
+//
+// Usage: outboxtest
+
+#include "scheduler.h"
+#include "jsonfile.h"
+#include "netstate.h"
+#include "mqtt.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+unsigned int checks = 0;
+unsigned int failures = 0;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        ++checks;                                                         \
+        if (!(cond)) {                                                    \
+            ++failures;                                                   \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                 \
+    } while (0)
+
+/*! Collects the messages published by an Outbox */
+class Collector {
+  public:
+    std::vector<String> msgs;
+    bool accept = true;
+
+    ustd::Outbox::T_PUBLISH publisher() {
+        return [this](const String &topic, const String &msg) {
+            if (!accept) {
+                return false;
+            }
+            msgs.push_back(topic + "|" + msg);
+            return true;
+        };
+    }
+
+    unsigned int drain(ustd::Outbox &outbox) {
+        unsigned int count = 0;
+        for (unsigned int n; (n = outbox.publish(publisher(), 3)) != 0;) {
+            count += n;
+        }
+        return count;
+    }
+};
+
+void appendMessages(ustd::Outbox &outbox, const char *prefix, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        outbox.append("alarm/" + String(prefix), String(i));
+    }
+}
+
+void testBatching() {
+    // messages confirmed before a flush never touch the flash
+    LittleFS.files.clear();
+    Collector c;
+    ustd::Outbox outbox("/t.obx", 1024, 4, 1000);
+    outbox.begin();
+    appendMessages(outbox, "a", 3);
+    CHECK(c.drain(outbox) == 3);
+    outbox.confirm(outbox.getSent());
+    hostAdvanceClock(2000000);
+    outbox.loop();
+    CHECK(!LittleFS.exists("/t.obx"));
+    CHECK(outbox.statBytesWritten == 0);
+    CHECK(outbox.pending() == 0);
+
+    // a full batch is written, the rest after the flush interval
+    appendMessages(outbox, "b", 6);
+    CHECK(LittleFS.fileSize("/t.obx") == 4 * (9 + 7 + 1));
+    outbox.loop();
+    CHECK(LittleFS.fileSize("/t.obx") == 4 * (9 + 7 + 1));
+    hostAdvanceClock(2000000);
+    outbox.loop();
+    CHECK(LittleFS.fileSize("/t.obx") == 6 * (9 + 7 + 1));
+    CHECK(outbox.pending() == 6);
+
+    // confirming everything removes the log
+    CHECK(c.drain(outbox) == 6);
+    outbox.confirm(outbox.getSent());
+    outbox.flush();
+    CHECK(!LittleFS.exists("/t.obx"));
+    CHECK(outbox.pending() == 0);
+}
+
+void testReplay() {
+    // unconfirmed messages survive a restart, in their original order
+    LittleFS.files.clear();
+    Collector c;
+    {
+        ustd::Outbox outbox("/t.obx", 1024, 4, 1000);
+        outbox.begin();
+        appendMessages(outbox, "a", 8);
+        // the first five are confirmed, but the confirmation is lost with the restart
+        c.drain(outbox);
+        outbox.confirm(5);
+        outbox.flush();
+    }
+    ustd::Outbox outbox("/t.obx", 1024, 4, 1000);
+    outbox.begin();
+    CHECK(outbox.pending() == 3);
+    c.msgs.clear();
+    CHECK(c.drain(outbox) == 3);
+    CHECK(c.msgs.size() == 3 && c.msgs[0] == "alarm/a|5" && c.msgs[2] == "alarm/a|7");
+
+    // a failed publish is tried again, rewind() publishes all unconfirmed messages again
+    appendMessages(outbox, "b", 2);
+    c.accept = false;
+    CHECK(outbox.publish(c.publisher(), 10) == 0);
+    c.accept = true;
+    c.msgs.clear();
+    CHECK(c.drain(outbox) == 2);
+    outbox.rewind();
+    c.msgs.clear();
+    CHECK(c.drain(outbox) == 5);
+    CHECK(c.msgs.size() == 5 && c.msgs[0] == "alarm/a|5" && c.msgs[4] == "alarm/b|1");
+}
+
+void testCompaction() {
+    // a full log is compacted to its unconfirmed messages, further messages are dropped
+    LittleFS.files.clear();
+    Collector c;
+    ustd::Outbox outbox("/t.obx", 200, 2, 1000);
+    outbox.begin();
+    appendMessages(outbox, "a", 40);
+    CHECK(LittleFS.fileSize("/t.obx") <= 200);
+    CHECK(outbox.statCompactions > 0);
+    CHECK(outbox.statDropped > 0);
+    unsigned int kept = c.drain(outbox);
+    CHECK(kept + outbox.statDropped == 40);
+    CHECK(c.msgs.size() && c.msgs[0] == "alarm/a|0");
+
+    // after a confirmation, compaction makes room again
+    outbox.confirm(outbox.getSent());
+    unsigned long dropped = outbox.statDropped;
+    appendMessages(outbox, "b", 8);
+    CHECK(outbox.statDropped == dropped);
+    c.msgs.clear();
+    CHECK(c.drain(outbox) == 8);
+    CHECK(c.msgs.size() == 8 && c.msgs[0] == "alarm/b|0");
+}
+
+void testTruncatedLog() {
+    // a record that was only partially written is discarded, appending continues behind the
+    // valid records
+    LittleFS.files.clear();
+    {
+        ustd::Outbox outbox("/t.obx", 1024, 4, 1000);
+        outbox.begin();
+        appendMessages(outbox, "a", 4);
+    }
+    LittleFS.truncate("/t.obx", LittleFS.fileSize("/t.obx") - 3);
+    Collector c;
+    {
+        ustd::Outbox outbox("/t.obx", 1024, 4, 1000);
+        outbox.begin();
+        CHECK(outbox.pending() == 3);
+        // compacted: a confirmation record followed by the valid messages
+        CHECK(LittleFS.fileSize("/t.obx") == 5 + 3 * (9 + 7 + 1));
+        appendMessages(outbox, "b", 4);
+    }
+    ustd::Outbox outbox("/t.obx", 1024, 4, 1000);
+    outbox.begin();
+    CHECK(outbox.pending() == 7);
+    CHECK(c.drain(outbox) == 7);
+    CHECK(c.msgs.size() == 7 && c.msgs[3] == "alarm/b|0");
+}
+
+void testCompactionReadError() {
+    // a log that cannot be read completely is not replaced by a partial copy
+    LittleFS.files.clear();
+    ustd::Outbox outbox("/t.obx", 80, 2, 1000);
+    outbox.begin();
+    appendMessages(outbox, "a", 4);
+    LittleFS.truncate("/t.obx", LittleFS.fileSize("/t.obx") - 3);
+    std::string log = *LittleFS.files["/t.obx"];
+    appendMessages(outbox, "b", 2);
+    CHECK(outbox.statCompactions == 1);
+    CHECK(!LittleFS.exists("/t.obx.tmp"));
+    CHECK(LittleFS.files["/t.obx"]->compare(0, log.size(), log) == 0);
+}
+
+/*! Mqtt gateway with an outbox for `alarm/#`, connected to the PubSubClient double */
+class Gateway {
+  public:
+    ustd::Scheduler sched;
+    ustd::Mqtt mqtt;
+    PubSubClient *pClient;
+    std::vector<String> alarms;
+    String marker;
+
+    Gateway() {
+        ustd::jsonfile::setArray("mqtt/outbox/topics", {"alarm/#"});
+        mqtt.begin(&sched, "test.local", 1883, false, "test");
+        String msg = "{\"state\":\"connected\",\"hostname\":\"testhost\"}";
+        ustd::NetState::update(msg, "connected", "testhost", "00:00:00:00:00:00", "127.0.0.1");
+        sched.publish("net/network", msg);
+        run(4);
+        pClient = PubSubClient::active();
+        pClient->onPublish = [this](const char *topic, const char *payload) {
+            if (strcmp(topic, "test/mqtt/outbox") == 0) {
+                marker = payload;
+            } else if (strncmp(topic, "omu/test/alarm/", 15) == 0) {
+                alarms.push_back(payload);
+            }
+        };
+    }
+
+    ~Gateway() {
+        ustd::jsonfile::clear();
+    }
+
+    void run(unsigned int loops) {
+        for (unsigned int i = 0; i < loops; i++) {
+            sched.loop();
+            hostAdvanceClock(10000);
+        }
+    }
+
+    void echoMarker() {
+        // the server delivers the marker back to the subscribed client topic
+        if (marker.length()) {
+            pClient->inject("test/mqtt/outbox", marker.c_str());
+            marker = "";
+        }
+        run(2);
+    }
+};
+
+void testMqttConfirmation() {
+    LittleFS.files.clear();
+    Gateway g;
+    for (int i = 0; i < 4; i++) {
+        g.sched.publish("alarm/door", String(i));
+    }
+    g.run(4);
+    CHECK(g.alarms.size() == 4);
+    CHECK(g.marker.length() > 0);
+    g.echoMarker();
+
+    // the confirmed messages are not published again after a reconnect
+    g.pClient->online = false;
+    g.run(2);
+    g.pClient->online = true;
+    hostAdvanceClock(120000000);
+    g.run(4);
+    CHECK(g.alarms.size() == 4);
+}
+
+void testMqttReconnect() {
+    // messages published while disconnected and unconfirmed messages are published again
+    LittleFS.files.clear();
+    Gateway g;
+    g.sched.publish("alarm/door", "0");
+    g.run(4);
+    CHECK(g.alarms.size() == 1);
+    g.pClient->online = false;
+    g.sched.publish("alarm/door", "1");
+    g.run(4);
+    CHECK(g.alarms.size() == 1);
+    g.pClient->online = true;
+    hostAdvanceClock(120000000);
+    g.run(4);
+    CHECK(g.alarms.size() == 3 && g.alarms[1] == "0" && g.alarms[2] == "1");
+    g.echoMarker();
+    g.sched.publish("alarm/door", "2");
+    g.run(4);
+    CHECK(g.alarms.size() == 4 && g.alarms[3] == "2");
+}
+
+void testMqttUnpublishable() {
+    // a message that can never be published is dropped instead of blocking the outbox
+    LittleFS.files.clear();
+    Gateway g;
+    String longTopic = "alarm/";
+    for (int i = 0; i < 200; i++) {
+        longTopic += 'x';
+    }
+    g.sched.publish(longTopic, "lost");
+    g.sched.publish("alarm/door", "0");
+    g.run(4);
+    CHECK(g.alarms.size() == 1 && g.alarms[0] == "0");
+    g.echoMarker();
+    g.sched.publish("alarm/door", "1");
+    g.run(4);
+    CHECK(g.alarms.size() == 2 && g.alarms[1] == "1");
+    g.echoMarker();
+
+    // nothing is left: the flushed log is removed
+    hostAdvanceClock(10000000);
+    g.run(2);
+    CHECK(!LittleFS.exists("/mqtt-default.obx"));
+}
+
+}  // namespace
+
+int main() {
+    hostSimulatedClock() = true;
+    testBatching();
+    testReplay();
+    testCompaction();
+    testTruncatedLog();
+    testCompactionReadError();
+    testMqttConfirmation();
+    testMqttReconnect();
+    testMqttUnpublishable();
+    printf("outboxtest: %u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+// munet serial link bench
+//
+// Connects two MuSerial nodes over a simulated serial line (see ../include/simserial.h) and
+// measures the link protocol on a simulated clock: sustained throughput at different baud rates,
+// frame loss with byte loss and bit flips, and the time needed to resynchronize after partial
+// frames. Every result is printed as one JSON object per line.
+//
+// Usage: serialbench [simulated seconds per run]
+
+#include "scheduler.h"
+#include "muserial.h"
+#include "simserial.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+const unsigned long TICK = 1000;  // simulated micro seconds per scheduler loop
+
+typedef struct {
+    const char *bench;
+    unsigned long baudRate;
+    unsigned long latency;  // micro seconds
+    double byteLoss;
+    double bitFlip;
+    bool compact;
+    bool ack;
+    unsigned int payload;
+    unsigned int topics;  // number of topics, published in turn
+    double load;          // offered load relative to the line speed
+} T_CONFIG;
+
+/*! Two MuSerial nodes A and B, A sends messages to B */
+class LinkBench {
+    SimSerial serialA;
+    SimSerial serialB;
+    ustd::Scheduler schedA;
+    ustd::Scheduler schedB;
+    ustd::MuSerial linkA;
+    ustd::MuSerial linkB;
+    std::vector<String> topics;
+    String payload;
+    double offerRate;  // messages per tick
+    double offerBudget = 0;
+    unsigned long startBytes = 0;
+    unsigned long windowDelivered = 0;
+    unsigned long windowBytes = 0;
+    uint64_t startTime = 0;
+    double seconds = 0;
+
+  public:
+    bool connected = false;
+    unsigned long offered = 0;
+    unsigned long delivered = 0;
+    unsigned long duplicates = 0;
+    std::vector<bool> seen;
+    uint64_t lastDelivery = 0;
+    unsigned long resyncSeq = 0;  // first message offered after a fault
+    uint64_t resyncStart = 0;
+    uint64_t resyncTime = 0;
+    String statsA;
+    String statsB;
+
+    LinkBench(const T_CONFIG &c)
+        : linkA("nodeA", &serialA, c.baudRate), linkB("nodeB", &serialB, c.baudRate) {
+        serialA.connect(serialB);
+        for (SimSerial *p : {&serialA, &serialB}) {
+            p->baudRate = c.baudRate;
+            p->latency = c.latency;
+            p->byteLoss = c.byteLoss;
+            p->bitFlip = c.bitFlip;
+        }
+        serialB.seed(4711);
+        for (ustd::MuSerial *p : {&linkA, &linkB}) {
+            p->compactMode = c.compact;
+            p->ackMode = c.ack;
+            p->statsInterval = 0;
+        }
+        for (unsigned int i = 0; i < c.topics; i++) {
+            topics.push_back("bench/sensor" + String(i) + "/value");
+        }
+        for (unsigned int i = 0; i < c.payload; i++) {
+            payload += (char)('a' + i % 26);
+        }
+        // estimated frame: header, topic, payload and footer
+        double frameLen = 8 + topics[0].length() + 1 + c.payload + 1 + 4;
+        offerRate = c.load * serialA.getLineSpeed() / frameLen * TICK / 1000000.0;
+
+        linkA.begin(&schedA);
+        linkB.begin(&schedB);
+        int tID = schedB.add([]() {}, "bench");
+        schedB.subscribe(tID, "bench/#", [this](String topic, String msg, String originator) {
+            this->receive(msg);
+        });
+        schedB.subscribe(tID, "nodeB/link/nodeA/stats",
+                         [this](String topic, String msg, String originator) { statsB = msg; });
+        tID = schedA.add([]() {}, "bench");
+        schedA.subscribe(tID, "nodeA/link/nodeB", [this](String topic, String msg,
+                                                          String originator) {
+            connected = msg == "connected";
+        });
+        schedA.subscribe(tID, "nodeA/link/nodeB/stats",
+                         [this](String topic, String msg, String originator) { statsA = msg; });
+    }
+
+    bool waitConnected(unsigned long maxTicks) {
+        for (unsigned long i = 0; i < maxTicks && !connected; i++) {
+            tick(false);
+        }
+        startBytes = serialA.bytesSent - serialA.txBacklog();
+        startTime = hostClock();
+        return connected;
+    }
+
+    void tick(bool offer) {
+        if (offer) {
+            for (offerBudget += offerRate; offerBudget >= 1; offerBudget -= 1) {
+                // the sequence number identifies lost and duplicated messages
+                String msg = String(offered) + ":" + payload;
+                schedA.publish(topics[offered % topics.size()], msg);
+                ++offered;
+            }
+        }
+        schedA.loop();
+        schedB.loop();
+        hostAdvanceClock(TICK);
+    }
+
+    void run(double seconds, bool offer = true) {
+        for (unsigned long n = (unsigned long)(seconds * 1000000 / TICK); n; n--) {
+            tick(offer);
+        }
+    }
+
+    void fault() {
+        // the resync time is measured until the first message offered from now on arrives
+        resyncSeq = offered;
+        resyncStart = hostClock();
+        resyncTime = 0;
+    }
+
+    void silence(double seconds) {
+        // node A is stalled and does not even send pings, node B keeps running
+        for (unsigned long n = (unsigned long)(seconds * 1000000 / TICK); n; n--) {
+            schedB.loop();
+            hostAdvanceClock(TICK);
+        }
+    }
+
+    void snapshot() {
+        // end of the measured window, the queues are drained afterwards
+        windowDelivered = delivered;
+        // bytes still in the transmit FIFO have not used the line within the window
+        windowBytes = serialA.bytesSent - serialA.txBacklog() - startBytes;
+        seconds = (hostClock() - startTime) / 1000000.0;
+    }
+
+    void dropNext(unsigned int count) {
+        serialA.dropNext(count);
+    }
+
+    void injectPartialFrame() {
+        // a VER 1 header announcing a 200 byte payload, followed by 10 bytes only
+        uint8_t frame[18] = {0x01, 0x01, 0x00, 0x01, 0x00, 200, 0x02, 0x00};
+        memset(frame + 8, 'x', 10);
+        serialA.inject(frame, sizeof(frame));
+    }
+
+    void collectStats() {
+        schedA.publish("nodeA/link/stats/get");
+        schedB.publish("nodeB/link/stats/get");
+        for (int i = 0; i < 3; i++) {
+            tick(false);
+        }
+    }
+
+    void report(const T_CONFIG &c) {
+        unsigned long lost = offered - delivered;
+        printf("{\"bench\":\"%s\",\"baud\":%lu,\"latencyUs\":%lu,\"byteLoss\":%g,\"bitFlip\":%g,"
+               "\"compact\":%s,\"ack\":%s,\"payload\":%u,\"topics\":%u,\"load\":%.2f,"
+               "\"connected\":%s,\"seconds\":%.1f,\"offered\":%lu,\"delivered\":%lu,"
+               "\"lost\":%lu,\"duplicates\":%lu,\"msgsPerSec\":%.1f,\"frameLoss\":%.5f,"
+               "\"payloadBytesPerSec\":%.0f,\"lineUtilization\":%.3f,\"topicIdHits\":%lu",
+               c.bench, c.baudRate, c.latency, c.byteLoss, c.bitFlip, c.compact ? "true" : "false",
+               c.ack ? "true" : "false", c.payload, c.topics, c.load, connected ? "true" : "false",
+               seconds, offered, delivered, lost, duplicates, windowDelivered / seconds,
+               offered ? (double)lost / offered : 0.0, windowDelivered * c.payload / seconds,
+               (double)windowBytes / serialA.getLineSpeed() / seconds,
+               statValue(statsA, "\"hits\":"));
+        if (resyncStart) {
+            printf(",\"resyncMs\":%.1f",
+                   resyncTime ? (resyncTime - resyncStart) / 1000.0 : -1.0);
+        }
+        printf(",\"statsA\":%s,\"statsB\":%s}\n", statsA.length() ? statsA.c_str() : "null",
+               statsB.length() ? statsB.c_str() : "null");
+        fflush(stdout);
+    }
+
+  private:
+    static unsigned long statValue(const String &stats, const char *field) {
+        // the host has no JSON parser: the value of a field that is unique in link/stats
+        const char *p = strstr(stats.c_str(), field);
+        return p ? strtoul(p + strlen(field), nullptr, 10) : 0;
+    }
+
+    void receive(const String &msg) {
+        unsigned long seq = strtoul(msg.c_str(), nullptr, 10);
+        if (seq >= seen.size()) {
+            seen.resize(seq + 1024, false);
+        }
+        if (seen[seq]) {
+            ++duplicates;
+            return;
+        }
+        seen[seq] = true;
+        ++delivered;
+        lastDelivery = hostClock();
+        if (resyncStart && !resyncTime && seq >= resyncSeq) {
+            resyncTime = hostClock();
+        }
+    }
+};
+
+void runThroughput(const T_CONFIG &c, double seconds) {
+    LinkBench b(c);
+    b.waitConnected(10000);
+    b.run(seconds);
+    b.snapshot();
+    b.run(1, false);  // drain the queues
+    b.collectStats();
+    b.report(c);
+}
+
+void runResync(const T_CONFIG &c, double seconds, const char *fault) {
+    LinkBench b(c);
+    b.waitConnected(10000);
+    b.run(seconds / 2);
+    if (strcmp(fault, "byte_drop") == 0) {
+        // a few bytes of the frame that is currently written are lost
+        b.fault();
+        b.dropNext(8);
+        b.run(seconds / 2);
+    } else if (strcmp(fault, "partial_frame") == 0) {
+        // a partial frame is followed by regular traffic: SYNC recovery by the frame check
+        b.fault();
+        b.injectPartialFrame();
+        b.run(seconds / 2);
+    } else {
+        // a partial frame is followed by silence: recovery by the read timeout
+        b.silence(0.1);
+        b.injectPartialFrame();
+        b.silence(7);
+        b.fault();
+        b.run(seconds / 2);
+    }
+    b.snapshot();
+    b.run(1, false);
+    b.collectStats();
+    b.report(c);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+    hostSimulatedClock() = true;
+
+    // sustained throughput: the offered load exceeds the line speed. The topics range from a few
+    // to more than the topic ids of compact mode (compactMaxTopics, 32).
+    const unsigned long bauds[] = {9600, 115200, 921600};
+    const unsigned long latencies[] = {0, 10000};
+    const unsigned int payloads[] = {16, 128};
+    const unsigned int topicCounts[] = {4, 16, 64};
+    for (unsigned long baud : bauds) {
+        for (unsigned long latency : latencies) {
+            for (unsigned int payload : payloads) {
+                for (unsigned int topics : topicCounts) {
+                    for (int mode = 0; mode < 4; mode++) {
+                        T_CONFIG c = {"throughput",    baud,    latency, 0,   0, (mode & 1) != 0,
+                                      (mode & 2) != 0, payload, topics,  1.5};
+                        runThroughput(c, seconds);
+                    }
+                }
+            }
+        }
+    }
+
+    // frame loss: half of the line speed is used, bytes are lost or corrupted
+    const double byteLosses[] = {0, 0.0001, 0.001, 0, 0};
+    const double bitFlips[] = {0, 0, 0, 0.0001, 0.001};
+    for (unsigned int i = 0; i < sizeof(byteLosses) / sizeof(byteLosses[0]); i++) {
+        for (int ack = 0; ack < 2; ack++) {
+            T_CONFIG c = {"errors", 115200,   0,  byteLosses[i], bitFlips[i],
+                          true,     ack != 0, 64, 16,            0.5};
+            runThroughput(c, seconds);
+        }
+    }
+
+    // resynchronization after partial frames
+    const char *faults[] = {"byte_drop", "partial_frame", "partial_idle"};
+    for (const char *fault : faults) {
+        for (int ack = 0; ack < 2; ack++) {
+            T_CONFIG c = {fault, 115200, 0, 0, 0, true, ack != 0, 64, 16, 0.5};
+            runResync(c, seconds, fault);
+        }
+    }
+    return 0;
+}
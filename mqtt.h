@@ -17,6 +17,10 @@
 #include "timeout.h"
 
 #include "munet.h"
+#include "topictree.h"
+#include "powerprofile.h"
+#include "netstate.h"
+#include "outbox.h"
 
 namespace ustd {
 
@@ -57,6 +61,63 @@ Additionally, arbitrary topics can be subscribed to via `addSubscription()`. Top
 via `addSubscription()` are transparently forwarded. Nothing is stripped, and it is user's
 responsibility to prevent loops.
 
+### Outbound queue:
+
+Messages to the external server are not published from within the scheduler's subscription
+callback, but are placed into a bounded outbound queue that is drained by the gateway task. A slow
+broker or network therefore does not stall the publishing muwerk tasks, and messages published
+while the connection is down are delivered after reconnecting. If the queue is full, the message
+is handled according to the drop policy configured for its topic: `dropOldest` (default),
+`dropNewest` or `coalesce` (replace the content of an already queued message with the same topic).
+
+### Connection management:
+
+PubSubClient has no non-blocking connect: every connection attempt blocks the cooperative
+scheduler until the server answers or the attempt fails. The attempts are therefore limited by a
+short connect timeout (`connectTimeout` in `/mqtt.json`), only one attempt is made per gateway
+loop and failover to the next server waits `reconnect/minDelay`, so that several unreachable
+servers do not block the scheduler back to back. After a failed attempt or a lost
+connection, the next attempt is delayed using exponential backoff with random jitter between
+`reconnect/minDelay` and `reconnect/maxDelay`, so that many devices do not reconnect at the same
+moment after a broker restart. Note that PubSubClient waits up to `MQTT_SOCKET_TIMEOUT` seconds
+for the server's answer once the TCP connection is established; define a smaller value as build
+flag if needed.
+
+### Multiple brokers:
+
+Instead of a single `host`, `/mqtt.json` can define a list of `brokers`. Brokers with the same
+`connection` name form one connection and are tried in the order of the list: the gateway
+connects to the first reachable broker and falls back to the next one if a broker is down. While
+connected to a broker of lower priority, the gateway periodically (`failback`) tries to return to
+the first broker. Every connection has its own MQTT client and its own outbound queue, so several
+connections can be active at the same time. Topic `routes` send matching messages to a specific
+connection, e.g. high-rate telemetry to a local edge broker, while all other messages use the
+connection of the first broker. That way high-volume traffic does not delay the control traffic.
+
+### Persistent sessions and outbox:
+
+With `persistentSession` the gateway connects without clean session and subscribes with QoS 1, so
+the server keeps the subscriptions and queues messages for the device while it is offline. The
+subscriptions are then only renewed after a failover, a restart or a change of the subscription
+list, not after every reconnect.
+
+Messages of the topics listed in `outbox/topics` are not placed into the outbound queue, but into
+an outbox (see `ustd::Outbox`) that is backed by a log file on the flash file system. These
+messages are kept until the server has confirmed them and are published again after a lost
+connection or a restart. PubSubClient publishes with QoS 0 only: the confirmation is done by a
+marker message on `<clientName>/mqtt/outbox` that the gateway receives back from the server, so
+this requires the connection to subscribe. The result is an at-least-once delivery comparable to
+QoS 1, duplicates are possible. Connections with `subscribe: false` have no outbox: messages of
+outbox topics routed to them go through the outbound queue without delivery guarantee.
+
+### Last-value coalescing:
+
+For high-rate topics (e.g. sensors publishing at 10 Hz) a forwarding interval can be configured in
+`/mqtt.json` per topic wildcard. The first message of a topic is forwarded immediately; messages
+that arrive before the interval has elapsed only replace the pending value, which is forwarded as
+soon as the interval is over. This is done individually for every concrete topic matching the
+wildcard.
+
 ## Sample MQTT Integration
 
 \code{cpp}
@@ -82,16 +143,9 @@ class Mqtt {
     Scheduler *pSched;
     int tID;
 
-    // mqtt client
-    WiFiClient wifiClient;
-    PubSubClient mqttClient;
-
     // active configuration
-    String mqttServer;
-    uint16_t mqttServerPort;
-    String mqttUsername;
-    String mqttPassword;
     bool mqttRetained;
+    bool persistentSession;
     String clientName;
     String domainToken;
     String outDomainToken;
@@ -107,15 +161,152 @@ class Mqtt {
     ustd::array<String> subsList;
     ustd::array<String> outgoingBlockList;
     ustd::array<String> incomingBlockList;
+    // precompiled topic filters of the tables above
+    ustd::TopicTree subsTree;
+    ustd::TopicTree outgoingBlockTree;
+    ustd::TopicTree incomingBlockTree;
+
+    // dispatch table of the control topics below `mqtt/`
+    enum Command {
+        CMD_STATE_GET,
+        CMD_STATS_GET,
+        CMD_HEAP_GET,
+        CMD_CONFIG_GET,
+        CMD_CONNECTIONS_GET,
+        CMD_OUTGOINGBLOCK_SET,
+        CMD_OUTGOINGBLOCK_REMOVE,
+        CMD_INCOMINGBLOCK_SET,
+        CMD_INCOMINGBLOCK_REMOVE
+    };
+    ustd::TopicTree commandTree;
 
     // runtime control - state management
     bool isOn = false;
     bool netUp = false;
     bool bMqInit = false;
     bool bWarned = false;
-    bool bCheckConnection = false;
-    bool mqttConnected = false;
-    ustd::timeout mqttTickerTimeout = 5000L;
+    // runtime control - connection management
+    unsigned long reconnectMinDelay = 2000;
+    unsigned long reconnectMaxDelay = 60000;
+    unsigned long connectTimeout = 2000;  // ms a connection attempt can block the scheduler
+    unsigned long failbackInterval = 300;
+    bool connectAttempted = false;  // a connection attempt was made in the current loop
+    // runtime control - power profile
+    PowerProfile::Profile powerProfile = PowerProfile::PERFORMANCE;
+
+    // receive path - preallocated buffer for terminating incoming payloads
+    char *rxBuffer = nullptr;
+    unsigned int rxBufferSize = 0;
+
+    // outbound topic rewriting - preallocated buffer starting with "<outDomainPrefix>/"
+    char *topicBuffer = nullptr;
+    unsigned int topicPrefixLength = 0;
+    unsigned int maxTopicLength = 128;
+
+    // outbound queue
+    enum QueuePolicy { DROPOLDEST,
+                       DROPNEWEST,
+                       COALESCE };
+    typedef struct t_outmsg {
+        String topic;
+        String msg;
+    } T_OUTMSG;
+    unsigned int outQueueLength = 32;
+    unsigned int outQueueMaxPerTick = 8;
+    QueuePolicy outQueuePolicy = DROPOLDEST;
+    ustd::TopicTree outQueuePolicies;
+
+    // broker connections
+    typedef struct t_server {
+        String host;
+        uint16_t port;
+        String username;
+        String password;
+    } T_SERVER;
+    typedef struct t_connection {
+        String name;
+        ustd::array<T_SERVER> servers;  // in order of priority
+        unsigned int current = 0;       // index of the server in use or tried next
+        bool subscribe = true;          // receive messages via this connection
+        int sessionServer = -1;         // server holding a persistent session of this connection
+        unsigned int sessionSubscriptions = 0;  // entries of subsList subscribed in that session
+        WiFiClient wifiClient;
+        PubSubClient mqttClient;
+        bool connected = false;
+        bool checkConnection = false;  // connect in the next loop without waiting
+        ustd::timeout reconnectTimeout = 2000L;
+        unsigned int reconnectAttempts = 0;
+        ustd::timeout failbackTimeout = 300000L;
+        // outbound queue of this connection
+        T_OUTMSG *outQueue = nullptr;
+        unsigned int outQueueSize = 0;
+        unsigned int outQueueHead = 0;
+        unsigned int outQueueCount = 0;
+        // messages delivered at least once
+        ustd::Outbox *pOutbox = nullptr;
+        // statistics
+        unsigned int statQueuePeak = 0;
+        unsigned long statQueueDropped = 0;
+        unsigned long statMsgsOut = 0;
+        unsigned long statConnects = 0;
+        unsigned long statFailovers = 0;
+    } T_CONNECTION;
+    // the first connection receives all messages that do not match a route
+    ustd::array<T_CONNECTION *> connections;
+    ustd::TopicTree routeTree;  // topic filter -> index in connections
+
+    // at-least-once delivery
+    ustd::array<String> outboxList;
+    ustd::TopicTree outboxTree;
+    unsigned long outboxMaxSize = 16384;
+    unsigned int outboxBatch = 8;
+    unsigned long outboxFlushInterval = 5000;
+    String outboxAckTopic;  // "<clientName>/mqtt/outbox", marker for confirmations
+    String outboxNonce;     // identifies the markers of this boot
+
+    // last-value coalescing of high-rate topics
+    typedef struct t_coalesced {
+        String topic;
+        String msg;
+        unsigned long interval;
+        unsigned long lastSent;
+        bool pending;
+    } T_COALESCED;
+    ustd::TopicTree coalesceRules;
+    ustd::array<unsigned long> coalesceIntervals;
+    ustd::array<T_COALESCED> coalesceList;
+    unsigned int coalesceMaxTopics = 64;
+
+    // statistics
+    unsigned long statsInterval = 60;
+    ustd::timeout statsTimeout = 60000L;
+    unsigned long statQueueCoalesced = 0;
+    unsigned long statCoalesceSuppressed = 0;
+    unsigned long statTopicTooLong = 0;
+    unsigned long statMsgsIn = 0;
+    unsigned long statBytesIn = 0;
+    unsigned long statBlockedIn = 0;
+    unsigned long statMsgsOut = 0;
+    unsigned long statBytesOut = 0;
+    unsigned long statBlockedOut = 0;
+    unsigned long statPublishFailed = 0;
+    unsigned long statPacketTooLarge = 0;
+    unsigned long statConnects = 0;
+    unsigned long statConnectFailures = 0;
+    unsigned long statConnectDuration = 0;
+    typedef struct t_timing {
+        unsigned long min;
+        unsigned long max;
+        unsigned long count;
+        uint64_t total;
+    } T_TIMING;
+    T_TIMING timingLoop = {0, 0, 0, 0};
+    T_TIMING timingRoute = {0, 0, 0, 0};
+
+    // heap monitoring
+    ustd::timeout heapSampleTimeout = 1000L;
+    uint32_t heapMinFree = 0xffffffff;
+    uint32_t heapMinMaxBlock = 0xffffffff;
 
   public:
     Mqtt() {
@@ -125,10 +316,16 @@ class Mqtt {
          * connection is available.
          *
          */
-        mqttClient = wifiClient;
     }
 
     ~Mqtt() {
+        if (rxBuffer) {
+            free(rxBuffer);
+        }
+        clearConnections();
+        if (topicBuffer) {
+            free(topicBuffer);
+        }
     }
 
     void begin(Scheduler *_pSched, String _mqttServer = "", uint16_t _mqttServerPort = 1883,
@@ -181,11 +378,8 @@ class Mqtt {
         ustd::jsonfile conf;
 
         // read configuration
-        mqttServer = conf.readString("mqtt/host", _mqttServer);
-        mqttServerPort = (uint16_t)conf.readLong("mqtt/port", 1, 65535, _mqttServerPort);
-        mqttUsername = conf.readString("mqtt/username", _mqttUsername);
-        mqttPassword = conf.readString("mqtt/password", _mqttPassword);
         mqttRetained = conf.readBool("mqtt/alwaysRetained", _mqttRetained);
+        persistentSession = conf.readBool("mqtt/persistentSession", false);
         clientName = conf.readString("mqtt/clientName", 1, _clientName);
         domainToken = conf.readString("mqtt/domainToken", 1, _domainToken);
         outDomainToken = conf.readString("mqtt/outDomainToken", _outDomainToken);
@@ -196,6 +390,71 @@ class Mqtt {
         conf.readStringArray("mqtt/subscriptions", subsList);
         conf.readStringArray("mqtt/outgoingBlackList", outgoingBlockList);
         conf.readStringArray("mqtt/incomingBlackList", incomingBlockList);
+        buildTree(subsTree, subsList);
+        buildTree(outgoingBlockTree, outgoingBlockList);
+        buildTree(incomingBlockTree, incomingBlockList);
+
+        // outbound queue
+        outQueueLength = conf.readLong("mqtt/queue/length", 1, 1024, 32);
+        outQueueMaxPerTick = conf.readLong("mqtt/queue/maxPerTick", 1, 1024, 8);
+        outQueuePolicy = getPolicyFromString(conf.readString("mqtt/queue/policy"), DROPOLDEST);
+        ustd::array<JSONVar> policies;
+        outQueuePolicies.clear();
+        if (conf.readJsonVarArray("mqtt/queue/policies", policies)) {
+            for (unsigned int i = 0; i < policies.length(); i++) {
+                if (JSON.typeof(policies[i]) == "object" &&
+                    JSON.typeof(policies[i]["topic"]) == "string") {
+                    String filter = (const char *)policies[i]["topic"];
+                    String policy = (const char *)policies[i]["policy"];
+                    outQueuePolicies.add(filter, getPolicyFromString(policy, outQueuePolicy));
+                }
+            }
+        }
+
+        // last-value coalescing
+        ustd::array<JSONVar> rules;
+        coalesceRules.clear();
+        coalesceIntervals.erase();
+        coalesceList.erase();
+        if (conf.readJsonVarArray("mqtt/coalesce", rules)) {
+            for (unsigned int i = 0; i < rules.length(); i++) {
+                if (JSON.typeof(rules[i]) == "object" &&
+                    JSON.typeof(rules[i]["topic"]) == "string" &&
+                    JSON.typeof(rules[i]["intervalMs"]) == "number") {
+                    String filter = (const char *)rules[i]["topic"];
+                    long interval = (long)rules[i]["intervalMs"];
+                    if (interval > 0) {
+                        unsigned long ulInterval = (unsigned long)interval;
+                        int index = coalesceIntervals.add(ulInterval);
+                        if (index != -1) {
+                            coalesceRules.add(filter, index);
+                        }
+                    }
+                }
+            }
+        }
+        coalesceMaxTopics = conf.readLong("mqtt/coalesceMaxTopics", 1, 1024, 64);
+
+        // at-least-once delivery
+        conf.readStringArray("mqtt/outbox/topics", outboxList);
+        buildTree(outboxTree, outboxList);
+        outboxMaxSize = conf.readLong("mqtt/outbox/maxSize", 1024, 1048576, 16384);
+        outboxBatch = conf.readLong("mqtt/outbox/batch", 1, 64, 8);
+        outboxFlushInterval = conf.readLong("mqtt/outbox/flushInterval", 100, 600000, 5000);
+        outboxNonce = String(random(0x7fffffff));
+
+        maxTopicLength = conf.readLong("mqtt/maxTopicLength", 16, 1024, 128);
+
+        // connection management
+        connectTimeout = conf.readLong("mqtt/connectTimeout", 100, 30000, 2000);
+        reconnectMinDelay = conf.readLong("mqtt/reconnect/minDelay", 100, 3600000, 2000);
+        reconnectMaxDelay = conf.readLong("mqtt/reconnect/maxDelay", reconnectMinDelay, 3600000, 60000);
+        failbackInterval = conf.readLong("mqtt/failback", 0, 86400, 300);
+        statsInterval = conf.readLong("mqtt/statsInterval", 0, 86400, 60);
+        statsTimeout = statsInterval * 1000;
+
+        // broker connections and topic routes
+        readConnections(conf, _mqttServer, _mqttServerPort, _mqttUsername, _mqttPassword);
 
         // This configuration is preliminary but it is ok. Currently we have no network connection
         // and nothing can happen with this prelimiary information. As soon as a network connection
@@ -204,16 +463,38 @@ class Mqtt {
         // information like the mac id or the hostname but this information is inaccesible if the
         // network stack has not been enabled and configured.
 
+        // allocate the receive buffer once - it is reused for every incoming message
+        if (rxBuffer == nullptr) {
+            rxBuffer = (char *)malloc(MQTT_MAX_PACKET_SIZE + 1);
+            rxBufferSize = rxBuffer ? MQTT_MAX_PACKET_SIZE + 1 : 0;
+        }
+
         // init scheduler
         pSched = _pSched;
         tID = pSched->add([this]() { this->loop(); }, "mqtt");
 
-        // subscribe to all messages
+        // route all messages, handle control topics and state notifications separately
         pSched->subscribe(tID, "#", [this](String topic, String msg, String originator) {
             this->subsMsg(topic, msg, originator);
         });
+        buildCommandTree();
+        pSched->subscribe(tID, "mqtt/#", [this](String topic, String msg, String originator) {
+            this->commandMsg(topic, msg, originator);
+        });
+        // messages from the external server (echoes of our own publications) are ignored
+        pSched->subscribe(tID, "net/network", [this](String topic, String msg, String originator) {
+            if (originator != "mqtt") {
+                this->onNetworkState(NetState::fromMessage(msg), msg);
+            }
+        });
+        pSched->subscribe(tID, "net/power", [this](String topic, String msg, String originator) {
+            if (originator != "mqtt") {
+                this->setPowerProfile(PowerProfile::fromMessage(msg));
+            }
+        });
 
-        if (mqttServer.length()) {
+        pSched->publish("net/power/get");
+        if (connections.length()) {
             // query update from network stack
             pSched->publish("net/network/get");
         } else {
@@ -226,9 +507,6 @@ class Mqtt {
         bMqInit = configureMqttClient();
         bWarned = false;
         bStateRetained = false;
-        bCheckConnection = false;
-        mqttConnected = false;
-        mqttTickerTimeout = 5000L;  // 5 seconds
 
         publishState();
     }
@@ -261,10 +539,15 @@ class Mqtt {
             if (topic == subsList[i])
                 return handle;  // Already subbed via mqtt.
         }
-        if (mqttConnected) {
-            mqttClient.subscribe(topic.c_str());
-        }
         subsList.add(topic);
+        subsTree.add(topic);
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            T_CONNECTION &conn = *connections[i];
+            if (conn.connected && conn.subscribe) {
+                conn.mqttClient.subscribe(topic.c_str(), persistentSession ? 1 : 0);
+                conn.sessionSubscriptions = subsList.length();
+            }
+        }
         return handle;
     }
 
@@ -284,6 +567,11 @@ class Mqtt {
             if (topic == subsList[i])
                 subsList.erase(i);
         }
+        subsTree.remove(topic);
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            // the next connection renews all subscriptions of a persistent session
+            connections[i]->sessionServer = -1;
+        }
         return ret;
     }
 
@@ -301,6 +589,7 @@ class Mqtt {
         }
         if (outgoingBlockList.add(topic) == -1)
             return false;
+        outgoingBlockTree.add(topic);
         return true;
     }
 
@@ -316,6 +605,7 @@ class Mqtt {
             if (outgoingBlockList[i] == topic) {
                 if (!outgoingBlockList.erase(i))
                     return false;
+                outgoingBlockTree.remove(topic);
                 return true;
             }
         }
@@ -336,6 +626,7 @@ class Mqtt {
         }
         if (incomingBlockList.add(topic) == -1)
             return false;
+        incomingBlockTree.add(topic);
         return true;
     }
 
@@ -351,6 +642,7 @@ class Mqtt {
             if (incomingBlockList[i] == topic) {
                 if (!incomingBlockList.erase(i))
                     return false;
+                incomingBlockTree.remove(topic);
                 return true;
             }
         }
@@ -358,199 +650,884 @@ class Mqtt {
     }
 
   private:
+    inline bool isConnected() {
+        // the state of the gateway is the state of the first connection
+        return connections.length() && connections[0]->connected;
+    }
+
     inline void publishState() {
-        pSched->publish("mqtt/state", mqttConnected ? "connected" : "disconnected");
+        pSched->publish("mqtt/state", isConnected() ? "connected" : "disconnected");
+    }
+
+    void publishConnections() {
+        JSONVar res;
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            T_CONNECTION &conn = *connections[i];
+            T_SERVER &server = conn.servers[conn.current];
+            res[conn.name.c_str()]["connected"] = conn.connected;
+            res[conn.name.c_str()]["server"] = server.host + ":" + String(server.port);
+            res[conn.name.c_str()]["priority"] = (int)conn.current;
+            res[conn.name.c_str()]["servers"] = (int)conn.servers.length();
+            res[conn.name.c_str()]["queue"] = (int)conn.outQueueCount;
+        }
+        pSched->publish("mqtt/connections", JSON.stringify(res));
     }
 
     void loop() {
-        if (!isOn || !netUp || mqttServer.length() == 0) {
-            return;
+        PowerProfile::countWakeup();
+        if (isOn && heapSampleTimeout.test()) {
+            heapSampleTimeout.reset();
+            sampleHeap();
         }
-        if (mqttConnected) {
-            mqttClient.loop();
-        }
-        if (bCheckConnection || mqttTickerTimeout.test()) {
-            mqttTickerTimeout.reset();
-            bCheckConnection = false;
-            if (!mqttClient.connected()) {
-                // Attempt to connect
-                const char *usr = mqttUsername.length() ? mqttUsername.c_str() : NULL;
-                const char *pwd = mqttPassword.length() ? mqttPassword.c_str() : NULL;
-                bool conRes = mqttClient.connect(clientName.c_str(), usr, pwd, lwTopic.c_str(), 0,
-                                                 true, lwMsg.c_str());
-                if (conRes) {
-                    DBG2("Connected to mqtt server");
-                    mqttConnected = true;
-                    mqttClient.subscribe((clientName + "/#").c_str());
-                    mqttClient.subscribe((domainToken + "/#").c_str());
-                    for (unsigned int i = 0; i < subsList.length(); i++) {
-                        mqttClient.subscribe(subsList[i].c_str());
-                    }
-                    bWarned = false;
-                    pSched->publish("mqtt/config", outDomainPrefix + "+" + lwTopic + "+" + lwMsg);
-                    publishState();
-                } else {
-                    mqttConnected = false;
-                    if (!bWarned) {
-                        bWarned = true;
-                        publishState();
-                        DBG2("MQTT disconnected.");
-                    }
-                }
+        if (isOn && coalesceList.length()) {
+            flushCoalesced();
+        }
+        if (isOn && statsInterval && statsTimeout.test()) {
+            statsTimeout.reset();
+            publishStats();
+        }
+        for (unsigned int i = 0; isOn && i < connections.length(); i++) {
+            // outbox writes are batched, also while the network is down
+            if (connections[i]->pOutbox) {
+                connections[i]->pOutbox->loop();
             }
         }
+        if (!isOn || !netUp) {
+            return;
+        }
+        connectAttempted = false;
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            loopConnection(*connections[i], i);
+        }
     }
 
-    void mqttReceive(char *ctopic, unsigned char *payload, unsigned int length) {
-        String msg;
-        String topic;
-
-        // prepare message and topic
-        topic = (const char *)ctopic;
-        if (length && payload) {
-            char *szBuffer = (char *)malloc(length + 1);
-            if (szBuffer) {
-                memcpy(szBuffer, payload, length);
-                szBuffer[length] = 0;
-                msg = szBuffer;
-                free(szBuffer);
-            } else {
-                DBG("mqtt: ERROR - message body lost due to memory outage");
+    void loopConnection(T_CONNECTION &conn, unsigned int index) {
+        bool primary = index == 0;
+        if (conn.connected) {
+            unsigned long start = micros();
+            conn.mqttClient.loop();
+            addTiming(timingLoop, micros() - start);
+            drainQueue(conn, outQueueMaxPerTick);
+            drainOutbox(conn, index);
+        }
+        if (conn.connected && !conn.mqttClient.connected()) {
+            // connection to the server lost: even the first retry is delayed by a random time so
+            // that not all clients reconnect at the same moment after a server restart
+            DBG2("MQTT connection lost: " + conn.name);
+            conn.connected = false;
+            conn.current = 0;
+            if (primary) {
+                publishState();
             }
+            scheduleReconnect(conn);
         }
-
-        for (unsigned int i = 0; i < incomingBlockList.length(); i++) {
-            if (Scheduler::mqttmatch(topic, incomingBlockList[i])) {
-                // blocked incoming
-                DBG2("mqtt: Blocked " + topic);
-                return;
+        if (conn.connected && conn.current && failbackInterval && conn.failbackTimeout.test()) {
+            // try to return to the server of highest priority, the queue keeps the messages
+            DBG2("mqtt: failback of connection " + conn.name);
+            conn.mqttClient.disconnect();
+            conn.connected = false;
+            conn.current = 0;
+            conn.reconnectAttempts = 0;
+            conn.checkConnection = true;
+            if (primary) {
+                publishState();
             }
         }
-        for (unsigned int i = 0; i < subsList.length(); i++) {
-            if (Scheduler::mqttmatch(topic, subsList[i])) {
-                DBG2("mqtt: subscribed topic " + topic);
-                pSched->publish(topic, msg, "mqtt");
+        if (!conn.connected && !connectAttempted &&
+            (conn.checkConnection || conn.reconnectTimeout.test())) {
+            // connection attempts block: at most one per loop, the other connections wait
+            connectAttempted = true;
+            conn.checkConnection = false;
+            connectServer(conn, primary);
+        }
+    }
+
+    void connectServer(T_CONNECTION &conn, bool primary) {
+        T_SERVER &server = conn.servers[conn.current];
+        // limit the time the connection attempt can block the scheduler
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        conn.wifiClient.setTimeout((connectTimeout + 999) / 1000);  // seconds
+#else
+        conn.wifiClient.setTimeout(connectTimeout);  // milliseconds
+#endif
+        conn.mqttClient.setServer(server.host.c_str(), server.port);
+        setKeepAlive(conn);
+        const char *usr = server.username.length() ? server.username.c_str() : NULL;
+        const char *pwd = server.password.length() ? server.password.c_str() : NULL;
+        unsigned long start = millis();
+        bool conRes = conn.mqttClient.connect(clientName.c_str(), usr, pwd, lwTopic.c_str(), 0,
+                                              true, lwMsg.c_str(), !persistentSession);
+        statConnectDuration = millis() - start;
+        if (conRes) {
+            ++statConnects;
+            ++conn.statConnects;
+            DBG2("Connected to mqtt server " + server.host);
+            conn.connected = true;
+            conn.reconnectAttempts = 0;
+            if (conn.current) {
+                ++conn.statFailovers;
+                conn.failbackTimeout = failbackInterval * 1000;
+                conn.failbackTimeout.reset();
+            }
+            if (conn.subscribe) {
+                subscribeAll(conn);
+            }
+            if (conn.pOutbox) {
+                // everything unconfirmed is published again
+                conn.pOutbox->rewind();
+            }
+            if (primary) {
+                bWarned = false;
+                pSched->publish("mqtt/config", outDomainPrefix + "+" + lwTopic + "+" + lwMsg);
+                publishState();
+            } else if (bStateRetained) {
+                // mqtt/state is routed to the first connection only: replace the last will here
+                conn.mqttClient.publish(lwTopic.c_str(), "connected", true);
+            }
+        } else {
+            ++statConnectFailures;
+            conn.connected = false;
+            if (conn.current + 1 < conn.servers.length()) {
+                // fail over to the next server after a short pause, so that the blocking attempts
+                // to several dead servers leave time for the scheduler in between
+                DBG2("mqtt: server " + server.host + " not reachable, trying next");
+                ++conn.current;
+                conn.reconnectTimeout = reconnectMinDelay;
+                conn.reconnectTimeout.reset();
                 return;
             }
+            conn.current = 0;
+            if (primary && !bWarned) {
+                bWarned = true;
+                publishState();
+                DBG2("MQTT disconnected.");
+            }
+            scheduleReconnect(conn);
+        }
+    }
+
+    void subscribeAll(T_CONNECTION &conn) {
+        uint8_t qos = persistentSession ? 1 : 0;
+        unsigned int first = 0;
+        if (persistentSession && conn.sessionServer == (int)conn.current) {
+            // the server kept the session: only subscriptions added in the meantime are missing
+            first = conn.sessionSubscriptions;
+        } else {
+            conn.mqttClient.subscribe((clientName + "/#").c_str(), qos);
+            conn.mqttClient.subscribe((domainToken + "/#").c_str(), qos);
+        }
+        for (unsigned int i = first; i < subsList.length(); i++) {
+            conn.mqttClient.subscribe(subsList[i].c_str(), qos);
+        }
+        conn.sessionServer = persistentSession ? (int)conn.current : -1;
+        conn.sessionSubscriptions = subsList.length();
+    }
+
+    void scheduleReconnect(T_CONNECTION &conn) {
+        // exponential backoff with jitter: the delay is a random value between half and the full
+        // backoff time, which doubles with every failed attempt up to reconnectMaxDelay
+        unsigned long delay = reconnectMinDelay;
+        for (unsigned int i = 0; i < conn.reconnectAttempts && delay < reconnectMaxDelay; i++) {
+            delay *= 2;
+        }
+        if (delay > reconnectMaxDelay) {
+            delay = reconnectMaxDelay;
+        }
+        delay = delay / 2 + random(delay / 2 + 1);
+        ++conn.reconnectAttempts;
+        conn.reconnectTimeout = delay;
+        conn.reconnectTimeout.reset();
+        DBG2("mqtt: next connection attempt in " + String(delay) + "ms");
+    }
+
+    void mqttReceive(char *ctopic, unsigned char *payload, unsigned int length) {
+        // PubSubClient delivers the topic zero terminated inside its own buffer, but not the
+        // payload: terminate it in the preallocated receive buffer instead of allocating memory
+        const char *msg = terminatePayload(payload, length);
+        if (msg == nullptr) {
+            DBG("mqtt: ERROR - message body lost due to memory outage");
+            return;
+        }
+
+        if (outboxAckTopic.length() && strcmp(ctopic, outboxAckTopic.c_str()) == 0) {
+            // marker of the outbox echoed by the server
+            confirmOutbox(msg);
+            return;
+        }
+
+        ++statMsgsIn;
+        statBytesIn += length;
+        if (incomingBlockTree.match(ctopic)) {
+            // blocked incoming
+            DBG2("mqtt: Blocked " + String(ctopic));
+            ++statBlockedIn;
+            return;
+        }
+        if (subsTree.match(ctopic)) {
+            DBG2("mqtt: subscribed topic " + String(ctopic));
+            pSched->publish(ctopic, msg, "mqtt");
+            return;
         }
         // strip the client name token or the domain token in messages for us
         for (unsigned int i = 0; i < ownedPrefixes.length(); i++) {
-            if (ownedPrefixes[i].length() <= topic.length()) {
-                // basically this comparison is not really needed since at this point we could
-                // ONLY have messages that match either the domainToken or the clientName since
-                // we have exactly subscribed to those. But who knows....
-                if (ownedPrefixes[i] == topic.substring(0, ownedPrefixes[i].length())) {
-                    topic = (const char *)(ctopic + ownedPrefixes[i].length());
-                    pSched->publish(topic, msg, "mqtt");
+            // basically this comparison is not really needed since at this point we could
+            // ONLY have messages that match either the domainToken or the clientName since
+            // we have exactly subscribed to those. But who knows....
+            const String &prefix = ownedPrefixes[i];
+            if (strncmp(ctopic, prefix.c_str(), prefix.length()) == 0) {
+                pSched->publish(ctopic + prefix.length(), msg, "mqtt");
+            }
+        }
+    }
+
+    const char *terminatePayload(unsigned char *payload, unsigned int length) {
+        if (length + 1 > rxBufferSize) {
+            // only happens if the PubSubClient buffer is larger than MQTT_MAX_PACKET_SIZE
+            char *pNew = (char *)realloc(rxBuffer, length + 1);
+            if (pNew == nullptr) {
+                return nullptr;
+            }
+            rxBuffer = pNew;
+            rxBufferSize = length + 1;
+        }
+        if (length && payload) {
+            memcpy(rxBuffer, payload, length);
+        }
+        rxBuffer[length] = 0;
+        return rxBuffer;
+    }
+
+    void sampleHeap() {
+        uint32_t freeHeap = ESP.getFreeHeap();
+        uint32_t maxBlock = getMaxFreeBlock();
+        if (freeHeap < heapMinFree) {
+            heapMinFree = freeHeap;
+        }
+        if (maxBlock < heapMinMaxBlock) {
+            heapMinMaxBlock = maxBlock;
+        }
+    }
+
+    void setPowerProfile(PowerProfile::Profile profile) {
+        powerProfile = profile;
+        pSched->reschedule(tID, PowerProfile::select(profile, 0, 10000L, 50000L));
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            setKeepAlive(*connections[i]);
+        }
+    }
+
+    void setKeepAlive(T_CONNECTION &conn) {
+#ifdef MQTT_SET_KEEPALIVE
+        // requires PubSubClient 2.8: an established connection keeps the interval it was
+        // opened with, the server only learns it with CONNECT
+        conn.mqttClient.setKeepAlive(PowerProfile::select(powerProfile, 15, 60, 120));
+#endif
+    }
+
+    void publishHeap() {
+        sampleHeap();
+        JSONVar heap;
+        heap["free"] = (long)ESP.getFreeHeap();
+        heap["maxBlock"] = (long)getMaxFreeBlock();
+        heap["minFree"] = (long)heapMinFree;
+        heap["minMaxBlock"] = (long)heapMinMaxBlock;
+        pSched->publish("mqtt/heap", JSON.stringify(heap));
+    }
+
+    static uint32_t getMaxFreeBlock() {
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        return ESP.getMaxAllocHeap();
+#else
+        return ESP.getMaxFreeBlockSize();
+#endif
+    }
+
+    bool coalesce(const String &topic, const String &msg) {
+        int rule = coalesceRules.find(topic.c_str());
+        if (rule == -1) {
+            return false;
+        }
+        unsigned long now = millis();
+        for (unsigned int i = 0; i < coalesceList.length(); i++) {
+            T_COALESCED &entry = coalesceList[i];
+            if (entry.topic == topic) {
+                if (timeDiff(entry.lastSent, now) >= entry.interval) {
+                    // interval elapsed: forward immediately
+                    entry.lastSent = now;
+                    entry.pending = false;
+                    enqueue(topic, msg);
+                } else {
+                    // keep only the latest value until the interval elapsed
+                    if (entry.pending) {
+                        ++statCoalesceSuppressed;
+                    }
+                    entry.msg = msg;
+                    entry.pending = true;
                 }
+                return true;
             }
         }
+        if (coalesceList.length() >= coalesceMaxTopics) {
+            // table is full: forward without coalescing
+            return false;
+        }
+        // first message of a new topic is forwarded immediately
+        T_COALESCED entry = {topic, "", coalesceIntervals[rule], now, false};
+        coalesceList.add(entry);
+        enqueue(topic, msg);
+        return true;
     }
 
-    void subsMsg(String topic, String msg, String originator) {
-        if (originator == "mqtt") {
-            return;  // avoid loops
+    void flushCoalesced() {
+        unsigned long now = millis();
+        for (unsigned int i = 0; i < coalesceList.length(); i++) {
+            T_COALESCED &entry = coalesceList[i];
+            if (entry.pending && timeDiff(entry.lastSent, now) >= entry.interval) {
+                entry.lastSent = now;
+                entry.pending = false;
+                enqueue(entry.topic, entry.msg);
+            }
         }
+    }
 
-        // router function
-        if (mqttConnected) {
-            unsigned int len = msg.length() + 1;
-            for (unsigned int i = 0; i < outgoingBlockList.length(); i++) {
-                if (Scheduler::mqttmatch(topic, outgoingBlockList[i])) {
-                    // Item is blocked.
-                    return;
+    T_CONNECTION &routeConnection(const String &topic) {
+        // requires at least one connection
+        int route = connections.length() > 1 ? routeTree.find(topic.c_str()) : -1;
+        return *connections[route == -1 ? 0 : route];
+    }
+
+    bool appendOutbox(const String &topic, const String &msg) {
+        if (connections.length() == 0 || !outboxTree.match(topic)) {
+            return false;
+        }
+        T_CONNECTION &conn = routeConnection(topic);
+        if (conn.pOutbox == nullptr) {
+            return false;
+        }
+        if (!conn.pOutbox->append(topic, msg)) {
+            DBG("mqtt: ERROR - message too large for the outbox: " + topic);
+        }
+        return true;
+    }
+
+    void drainOutbox(T_CONNECTION &conn, unsigned int index) {
+        if (conn.pOutbox == nullptr) {
+            return;
+        }
+        unsigned int count = conn.pOutbox->publish(
+            [this, &conn](const String &topic, const String &msg) {
+                if (publishMessage(conn, topic, msg)) {
+                    return true;
+                }
+                if (!conn.mqttClient.connected()) {
+                    // connection lost: keep the message until we are connected again
+                    return false;
+                }
+                // the message can never be published (e.g. too large): drop it like drainQueue
+                ++conn.pOutbox->statDropped;
+                return true;
+            },
+            outQueueMaxPerTick);
+        if (count == 0 || !conn.mqttClient.connected()) {
+            return;
+        }
+        // the server echoes the marker after it has received all messages before it
+        String marker = outboxNonce + ":" + String(index) + ":";
+        marker += String(conn.pOutbox->getSent());
+        publishMessage(conn, "!" + outboxAckTopic, marker);
+    }
+
+    void confirmOutbox(const char *marker) {
+        // "<nonce>:<connection index>:<sequence number>"
+        const char *p = strchr(marker, ':');
+        if (p == nullptr || (unsigned int)(p - marker) != outboxNonce.length() ||
+            strncmp(marker, outboxNonce.c_str(), outboxNonce.length())) {
+            // outdated marker of a previous boot
+            return;
+        }
+        char *end;
+        unsigned long index = strtoul(p + 1, &end, 10);
+        if (*end != ':' || index >= connections.length() || !connections[index]->pOutbox) {
+            return;
+        }
+        connections[index]->pOutbox->confirm(strtoul(end + 1, nullptr, 10));
+    }
+
+    bool enqueue(const String &topic, const String &msg) {
+        if (connections.length() == 0) {
+            return false;
+        }
+        T_CONNECTION &conn = routeConnection(topic);
+        if (conn.outQueue == nullptr) {
+            ++conn.statQueueDropped;
+            return false;
+        }
+        int policy = outQueuePolicies.find(topic.c_str());
+        if (policy == -1) {
+            policy = outQueuePolicy;
+        }
+        if (policy == QueuePolicy::COALESCE) {
+            // replace the content of an already queued message with the same topic
+            for (unsigned int i = 0; i < conn.outQueueCount; i++) {
+                T_OUTMSG &queued = conn.outQueue[(conn.outQueueHead + i) % conn.outQueueSize];
+                if (queued.topic == topic) {
+                    queued.msg = msg;
+                    ++statQueueCoalesced;
+                    return true;
                 }
             }
-            String tpc;
-            if (topic.c_str()[0] == '!') {
-                tpc = &(topic.c_str()[1]);
-            } else {
-                tpc = outDomainPrefix + "/" + topic;
+        }
+        if (conn.outQueueCount == conn.outQueueSize) {
+            ++conn.statQueueDropped;
+            if (policy == QueuePolicy::DROPNEWEST) {
+                return false;
             }
+            // drop the oldest message
+            conn.outQueueHead = (conn.outQueueHead + 1) % conn.outQueueSize;
+            --conn.outQueueCount;
+        }
+        // assigning to an existing slot reuses its string buffers
+        unsigned int tail = (conn.outQueueHead + conn.outQueueCount) % conn.outQueueSize;
+        T_OUTMSG &slot = conn.outQueue[tail];
+        slot.topic = topic;
+        slot.msg = msg;
+        ++conn.outQueueCount;
+        if (conn.outQueueCount > conn.statQueuePeak) {
+            conn.statQueuePeak = conn.outQueueCount;
+        }
+        return true;
+    }
 
-            bool bRetain = mqttRetained;
-            if (tpc.c_str()[0] == '!') {
-                // remove second exclamation point
-                tpc = &(topic.c_str()[2]);
-                bRetain = true;
+    void drainQueue(T_CONNECTION &conn, unsigned int maxMessages) {
+        while (conn.outQueueCount && maxMessages--) {
+            T_OUTMSG &queued = conn.outQueue[conn.outQueueHead];
+            if (!publishMessage(conn, queued.topic, queued.msg) &&
+                !conn.mqttClient.connected()) {
+                // connection lost: keep the message until we are connected again
+                return;
             }
-            if (!bRetain && bStateRetained && topic == "mqtt/state") {
-                // the state topic shall always be retained
+            conn.outQueueHead = (conn.outQueueHead + 1) % conn.outQueueSize;
+            --conn.outQueueCount;
+        }
+    }
+
+    bool publishMessage(T_CONNECTION &conn, const String &topic, const String &msg) {
+        bool bRetain = mqttRetained;
+        const char *tpc = buildTopic(topic, bRetain);
+        if (tpc == nullptr) {
+            DBG("mqtt: ERROR topic too long, not published: " + topic + " | " + msg);
+            ++statPublishFailed;
+            return false;
+        }
+
+        // fixed header (max. 5 bytes) + topic length (2 bytes) + topic + payload
+        unsigned int len = 5 + 2 + strlen(tpc) + msg.length();
+        if (len > MQTT_MAX_PACKET_SIZE) {
+            DBG("mqtt: FATAL ERROR: len=" + String(len) + " message too large: " + topic +
+                ". You need to re-compile the PubSubClient library and increase #define "
+                "MQTT_MAX_PACKET_SIZE.");
+            ++statPublishFailed;
+            ++statPacketTooLarge;
+            return false;
+        }
+
+        DBG3("mqtt: publishing...");
+        if (conn.mqttClient.publish(tpc, msg.c_str(), bRetain)) {
+            DBG2("mqtt publish: " + topic + " | " + msg);
+            ++statMsgsOut;
+            ++conn.statMsgsOut;
+            statBytesOut += msg.length();
+            return true;
+        }
+        DBG("mqtt: ERROR len=" + String(len) + ", not published: " + topic + " | " + msg);
+        ++statPublishFailed;
+        return false;
+    }
+
+    const char *buildTopic(const String &topic, bool &bRetain) {
+        const char *pTopic = topic.c_str();
+        if (pTopic[0] == '!') {
+            // unmodified topics are published directly from the original string
+            if (pTopic[1] == '!') {
+                // second exclamation point: always retained
                 bRetain = true;
+                return pTopic + 2;
             }
+            return pTopic + 1;
+        }
+        if (!bRetain && bStateRetained && topic == "mqtt/state") {
+            // the state topic shall always be retained
+            bRetain = true;
+        }
+        // the prefix is already in the buffer - append the topic in place
+        if (topicBuffer == nullptr || topic.length() > maxTopicLength) {
+            ++statTopicTooLong;
+            return nullptr;
+        }
+        memcpy(topicBuffer + topicPrefixLength, pTopic, topic.length() + 1);
+        return topicBuffer;
+    }
+
+    void prepareTopicBuffer() {
+        // rebuild the buffer holding "<outDomainPrefix>/" followed by space for maxTopicLength
+        unsigned int len = outDomainPrefix.length() + 1;
+        char *pNew = (char *)realloc(topicBuffer, len + maxTopicLength + 1);
+        if (pNew == nullptr) {
+            DBG("mqtt: ERROR - failed to allocate topic buffer");
+            return;
+        }
+        topicBuffer = pNew;
+        topicPrefixLength = len;
+        memcpy(topicBuffer, outDomainPrefix.c_str(), len - 1);
+        topicBuffer[len - 1] = '/';
+        topicBuffer[len] = 0;
+    }
 
-            DBG3("mqtt: publishing...");
-            if (mqttClient.publish(tpc.c_str(), msg.c_str(), bRetain)) {
-                DBG2("mqtt publish: " + topic + " | " + msg);
-            } else {
-                DBG("mqtt: ERROR len=" + String(len) + ", not published: " + topic + " | " + msg);
-                if (len > 128) {
-                    DBG("mqtt: FATAL ERROR: you need to re-compile the PubSubClient library "
-                        "and "
-                        "increase #define MQTT_MAX_PACKET_SIZE.");
+    void publishStats() {
+        JSONVar stats;
+        stats["in"]["msgs"] = (long)statMsgsIn;
+        stats["in"]["bytes"] = (long)statBytesIn;
+        stats["in"]["blocked"] = (long)statBlockedIn;
+        stats["out"]["msgs"] = (long)statMsgsOut;
+        stats["out"]["bytes"] = (long)statBytesOut;
+        stats["out"]["blocked"] = (long)statBlockedOut;
+        stats["out"]["failed"] = (long)statPublishFailed;
+        stats["out"]["tooLarge"] = (long)statPacketTooLarge;
+        stats["out"]["topicTooLong"] = (long)statTopicTooLong;
+        // the queue values are the totals of all connections, the peak is the highest of them
+        unsigned int queueLength = 0, queueSize = 0, queuePeak = 0;
+        unsigned long queueDropped = 0;
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            T_CONNECTION &conn = *connections[i];
+            queueLength += conn.outQueueCount;
+            queueSize += conn.outQueueSize;
+            queueDropped += conn.statQueueDropped;
+            if (conn.statQueuePeak > queuePeak) {
+                queuePeak = conn.statQueuePeak;
+            }
+        }
+        stats["queue"]["length"] = (int)queueLength;
+        stats["queue"]["size"] = (int)queueSize;
+        stats["queue"]["peak"] = (int)queuePeak;
+        stats["queue"]["dropped"] = (long)queueDropped;
+        stats["queue"]["coalesced"] = (long)statQueueCoalesced;
+        if (outboxList.length()) {
+            unsigned long pending = 0, stored = 0, dropped = 0, flushes = 0, written = 0;
+            for (unsigned int i = 0; i < connections.length(); i++) {
+                Outbox *pOutbox = connections[i]->pOutbox;
+                if (pOutbox) {
+                    pending += pOutbox->pending();
+                    stored += pOutbox->getFileSize();
+                    dropped += pOutbox->statDropped;
+                    flushes += pOutbox->statFlushes;
+                    written += pOutbox->statBytesWritten;
                 }
             }
+            stats["outbox"]["pending"] = (long)pending;
+            stats["outbox"]["stored"] = (long)stored;
+            stats["outbox"]["dropped"] = (long)dropped;
+            stats["outbox"]["flushes"] = (long)flushes;
+            stats["outbox"]["written"] = (long)written;
+        }
+        stats["coalesce"]["topics"] = (int)coalesceList.length();
+        stats["coalesce"]["suppressed"] = (long)statCoalesceSuppressed;
+        stats["connection"]["connects"] = (long)statConnects;
+        stats["connection"]["reconnects"] = (long)(statConnects ? statConnects - 1 : 0);
+        stats["connection"]["failures"] = (long)statConnectFailures;
+        stats["connection"]["connectMs"] = (long)statConnectDuration;
+        stats["connection"]["attempts"] =
+            (int)(connections.length() ? connections[0]->reconnectAttempts : 0);
+        bool multiple =
+            connections.length() > 1 || (connections.length() && connections[0]->servers.length() > 1);
+        if (multiple) {
+            // per connection values, only if more than one broker is configured
+            for (unsigned int i = 0; i < connections.length(); i++) {
+                T_CONNECTION &conn = *connections[i];
+                JSONVar entry;
+                entry["connected"] = conn.connected;
+                entry["priority"] = (int)conn.current;
+                entry["msgs"] = (long)conn.statMsgsOut;
+                entry["queue"] = (int)conn.outQueueCount;
+                entry["dropped"] = (long)conn.statQueueDropped;
+                entry["connects"] = (long)conn.statConnects;
+                entry["failovers"] = (long)conn.statFailovers;
+                stats["connections"][conn.name.c_str()] = entry;
+            }
+        }
+        stats["timing"]["loop"] = getTiming(timingLoop);
+        stats["timing"]["route"] = getTiming(timingRoute);
+        pSched->publish("mqtt/stats", JSON.stringify(stats));
+        // timing values are reported per interval
+        timingLoop = {0, 0, 0, 0};
+        timingRoute = {0, 0, 0, 0};
+    }
+
+    static void addTiming(T_TIMING &timing, unsigned long us) {
+        if (timing.count == 0 || us < timing.min) {
+            timing.min = us;
+        }
+        if (us > timing.max) {
+            timing.max = us;
+        }
+        ++timing.count;
+        timing.total += us;
+    }
+
+    static JSONVar getTiming(T_TIMING &timing) {
+        JSONVar res;
+        res["min"] = (long)timing.min;
+        res["avg"] = (long)(timing.count ? timing.total / timing.count : 0);
+        res["max"] = (long)timing.max;
+        return res;
+    }
+
+    static QueuePolicy getPolicyFromString(String val, QueuePolicy defVal = DROPOLDEST) {
+        val.toLowerCase();
+        if (val == "dropoldest") {
+            return DROPOLDEST;
+        } else if (val == "dropnewest") {
+            return DROPNEWEST;
+        } else if (val == "coalesce") {
+            return COALESCE;
         } else {
-            DBG2("mqtt: NO CONNECTION, not published: " + topic + " | " + msg);
+            return defVal;
+        }
+    }
+
+    void subsMsg(String topic, String msg, String originator) {
+        if (originator == "mqtt") {
+            return;  // avoid loops
+        }
+
+        // router function
+        unsigned long start = micros();
+        if (outgoingBlockTree.match(topic)) {
+            // Item is blocked.
+            ++statBlockedOut;
+            return;
         }
+        if (!appendOutbox(topic, msg) && !coalesce(topic, msg) && !enqueue(topic, msg)) {
+            DBG2("mqtt: QUEUE FULL, not published: " + topic + " | " + msg);
+        }
+        addTiming(timingRoute, micros() - start);
+    }
+
+    void buildCommandTree() {
+        commandTree.clear();
+        commandTree.add("mqtt/state/get", CMD_STATE_GET);
+        commandTree.add("mqtt/stats/get", CMD_STATS_GET);
+        commandTree.add("mqtt/heap/get", CMD_HEAP_GET);
+        commandTree.add("mqtt/config/get", CMD_CONFIG_GET);
+        commandTree.add("mqtt/connections/get", CMD_CONNECTIONS_GET);
+        commandTree.add("mqtt/outgoingblock/set", CMD_OUTGOINGBLOCK_SET);
+        commandTree.add("mqtt/outgoingblock/remove", CMD_OUTGOINGBLOCK_REMOVE);
+        commandTree.add("mqtt/incomingblock/set", CMD_INCOMINGBLOCK_SET);
+        commandTree.add("mqtt/incomingblock/remove", CMD_INCOMINGBLOCK_REMOVE);
+    }
 
-        // internal processing
-        if (topic == "mqtt/state/get") {
+    void commandMsg(String topic, String msg, String originator) {
+        if (originator == "mqtt") {
+            return;  // avoid loops
+        }
+        switch (commandTree.find(topic.c_str())) {
+        case CMD_STATE_GET:
             publishState();
-        } else if (topic == "mqtt/config/get") {
+            break;
+        case CMD_STATS_GET:
+            publishStats();
+            break;
+        case CMD_HEAP_GET:
+            publishHeap();
+            break;
+        case CMD_CONFIG_GET:
             pSched->publish("mqtt/config", outDomainPrefix + "+" + lwTopic + "+" + lwMsg);
-        } else if (topic == "mqtt/outgoingblock/set") {
+            break;
+        case CMD_CONNECTIONS_GET:
+            publishConnections();
+            break;
+        case CMD_OUTGOINGBLOCK_SET:
             outgoingBlockSet(msg);
-        } else if (topic == "mqtt/outgoingblock/remove") {
+            break;
+        case CMD_OUTGOINGBLOCK_REMOVE:
             outgoingBlockRemove(msg);
-        } else if (topic == "mqtt/incomingblock/set") {
+            break;
+        case CMD_INCOMINGBLOCK_SET:
             incomingBlockSet(msg);
-        } else if (topic == "mqtt/incomingblock/remove") {
+            break;
+        case CMD_INCOMINGBLOCK_REMOVE:
             incomingBlockRemove(msg);
-        } else if (topic == "net/network") {
-            // network state received:
-            JSONVar jsonState = JSON.parse(msg);
-            if (JSON.typeof(jsonState) != "object") {
-                DBG("mqtt: Received broken network state " + msg);
-                return;
-            }
-            String state = (const char *)jsonState["state"];
-            String hostname = (const char *)jsonState["hostname"];
-            String mac = (const char *)jsonState["mac"];
-            if (state == "connected") {
-                DBG3("mqtt: received network connect");
-                if (!netUp) {
-                    DBG2("mqtt: net state online");
-                    finalizeConfiguration(hostname, mac);
-                    netUp = true;
-                    bCheckConnection = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void onNetworkState(const NetState::T_STATE &state, const String &msg) {
+        if (!state.valid) {
+            DBG("mqtt: Received broken network state " + msg);
+            return;
+        }
+        if (state.connected) {
+            DBG3("mqtt: received network connect");
+            if (!netUp) {
+                DBG2("mqtt: net state online");
+                String hostname = state.hostname;
+                String mac = state.mac;
+                finalizeConfiguration(hostname, mac);
+                netUp = true;
+                for (unsigned int i = 0; i < connections.length(); i++) {
+                    connections[i]->checkConnection = true;
                 }
-            } else {
-                netUp = false;
-                mqttConnected = false;
-                publishState();
-                DBG2("mqtt: net state offline");
             }
+        } else {
+            netUp = false;
+            for (unsigned int i = 0; i < connections.length(); i++) {
+                T_CONNECTION &conn = *connections[i];
+                conn.connected = false;
+                conn.current = 0;
+                conn.reconnectAttempts = 0;
+            }
+            publishState();
+            DBG2("mqtt: net state offline");
+        }
+    }
+
+    static void buildTree(ustd::TopicTree &tree, ustd::array<String> &list) {
+        tree.clear();
+        for (unsigned int i = 0; i < list.length(); i++) {
+            tree.add(list[i]);
         }
     }
 
     bool configureMqttClient() {
-        if (mqttServer.length() == 0) {
+        if (connections.length() == 0) {
             DBG2("mqtt: No mqtt host defined. Ignoring configuration...");
             return false;
         }
-        bCheckConnection = true;
-        mqttClient.setServer(mqttServer.c_str(), mqttServerPort);
-
-        if (!bMqInit) {
-            mqttClient.setCallback([this](char *topic, unsigned char *msg, unsigned int len) {
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            T_CONNECTION &conn = *connections[i];
+            conn.checkConnection = true;
+            // messages of all connections are received by the same handler
+            conn.mqttClient.setCallback([this](char *topic, unsigned char *msg, unsigned int len) {
                 this->mqttReceive(topic, msg, len);
             });
-            bMqInit = true;
         }
         return true;
     }
 
+    void readConnections(ustd::jsonfile &conf, String &defHost, uint16_t defPort,
+                         String &defUsername, String &defPassword) {
+        clearConnections();
+        routeTree.clear();
+        T_SERVER server;
+        server.host = conf.readString("mqtt/host", defHost);
+        server.port = (uint16_t)conf.readLong("mqtt/port", 1, 65535, defPort);
+        server.username = conf.readString("mqtt/username", defUsername);
+        server.password = conf.readString("mqtt/password", defPassword);
+        String username = server.username;
+        String password = server.password;
+        if (server.host.length()) {
+            addServer("default", server, true);
+        }
+
+        // additional brokers, grouped into connections by name in order of priority
+        ustd::array<JSONVar> brokers;
+        if (conf.readJsonVarArray("mqtt/brokers", brokers)) {
+            for (unsigned int i = 0; i < brokers.length(); i++) {
+                JSONVar &broker = brokers[i];
+                if (JSON.typeof(broker) != "object" || JSON.typeof(broker["host"]) != "string") {
+                    continue;
+                }
+                server.host = (const char *)broker["host"];
+                server.port = JSON.typeof(broker["port"]) == "number"
+                                  ? (uint16_t)(long)broker["port"]
+                                  : defPort;
+                server.username = JSON.typeof(broker["username"]) == "string"
+                                      ? String((const char *)broker["username"])
+                                      : username;
+                server.password = JSON.typeof(broker["password"]) == "string"
+                                      ? String((const char *)broker["password"])
+                                      : password;
+                String name = JSON.typeof(broker["connection"]) == "string"
+                                  ? String((const char *)broker["connection"])
+                                  : String("default");
+                bool subscribe = JSON.typeof(broker["subscribe"]) == "boolean"
+                                     ? (bool)broker["subscribe"]
+                                     : true;
+                addServer(name, server, subscribe);
+            }
+        }
+
+        // topics routed to connections other than the first one
+        ustd::array<JSONVar> routes;
+        if (conf.readJsonVarArray("mqtt/routes", routes)) {
+            for (unsigned int i = 0; i < routes.length(); i++) {
+                if (JSON.typeof(routes[i]) != "object" ||
+                    JSON.typeof(routes[i]["topic"]) != "string" ||
+                    JSON.typeof(routes[i]["connection"]) != "string") {
+                    continue;
+                }
+                String filter = (const char *)routes[i]["topic"];
+                int index = findConnection((const char *)routes[i]["connection"]);
+                if (index == -1) {
+                    DBG("mqtt: ERROR - route " + filter + " to unknown connection");
+                    continue;
+                }
+                routeTree.add(filter, index);
+            }
+        }
+    }
+
+    void addServer(const String &name, T_SERVER &server, bool subscribe) {
+        int index = findConnection(name);
+        if (index == -1) {
+            T_CONNECTION *pConn = new T_CONNECTION;
+            pConn->name = name;
+            pConn->subscribe = subscribe;
+            pConn->mqttClient.setClient(pConn->wifiClient);
+            pConn->outQueue = new T_OUTMSG[outQueueLength];
+            pConn->outQueueSize = pConn->outQueue ? outQueueLength : 0;
+            if (outboxList.length() && subscribe) {
+                // the confirmation markers are received via the subscriptions: connections
+                // without subscriptions use the outbound queue for outbox topics as well
+                pConn->pOutbox = new Outbox("/mqtt-" + name + ".obx", outboxMaxSize, outboxBatch,
+                                            outboxFlushInterval);
+                pConn->pOutbox->begin();
+            }
+            index = connections.add(pConn);
+            if (index == -1) {
+                delete[] pConn->outQueue;
+                delete pConn->pOutbox;
+                delete pConn;
+                DBG("mqtt: ERROR - failed to add connection " + name);
+                return;
+            }
+        }
+        connections[index]->servers.add(server);
+    }
+
+    int findConnection(const String &name) {
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            if (connections[i]->name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void clearConnections() {
+        for (unsigned int i = 0; i < connections.length(); i++) {
+            if (connections[i]->pOutbox) {
+                // nothing unconfirmed is lost
+                connections[i]->pOutbox->flush();
+                delete connections[i]->pOutbox;
+            }
+            delete[] connections[i]->outQueue;
+            delete connections[i];
+        }
+        connections.erase();
+    }
+
     void finalizeConfiguration(String &hostname, String &mac) {
         // get network information
         if (hostname.length() == 0) {
@@ -572,6 +1549,7 @@ class Mqtt {
         } else {
             outDomainPrefix = clientName;
         }
+        prepareTopicBuffer();
         if (lwTopic.length()) {
             lwMsg = replaceVars(lwMsg, hostname, mac);
         } else {
@@ -579,6 +1557,7 @@ class Mqtt {
             lwMsg = "disconnected";
             bStateRetained = true;
         }
+        outboxAckTopic = outboxList.length() ? clientName + "/mqtt/outbox" : "";
         String clientPrefix = clientName + "/";
         String domainPrefix = domainToken + "/";
         ownedPrefixes.erase();
@@ -12,6 +12,10 @@ munet implements the following classes based on the cooperative scheduler muwerk
 * * \ref ustd::MuSerial Serial protocol to connect two muwerk MCUs to allow transparent
          pub/sub message exchange. This allows non-networked hardware to be connected
          to networked hardware via a serial link.
+* * \ref ustd::TopicTree Precompiled set of MQTT topic filters used for fast topic matching
+* * \ref ustd::PowerProfile Power profile that coordinates the task periods of all munet tasks
+* * \ref ustd::NetState Shared, parsed-once network state of the `net/network` notification
+* * \ref ustd::Outbox Flash-backed outbox for MQTT messages that are delivered at least once
 
 Libraries are header-only and should work with any c++11 compiler and
 and support platforms esp8266 and esp32.
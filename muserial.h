@@ -6,12 +6,68 @@
 #include "ustd_map.h"
 
 #include "scheduler.h"
+#include "topictree.h"
+#include "powerprofile.h"
 //#include <Arduino_JSON.h>
 
 #ifdef __ATTINY__
 #define HardwareSerial TinySoftwareSerial
 #endif
 
+#ifndef MUSERIAL_MAX_FRAME
+#if defined(__ATTINY__) || defined(__UNO__)
+#define MUSERIAL_MAX_FRAME 128
+#else
+#define MUSERIAL_MAX_FRAME 1024
+#endif
+#endif
+
+#ifndef MUSERIAL_TX_RING
+#if defined(__ATTINY__) || defined(__UNO__)
+#define MUSERIAL_TX_RING 0
+#elif defined(__ESP__) && !defined(__ESP32__) && !defined(__ESP32_RISC__)
+#define MUSERIAL_TX_RING 2048
+#else
+#define MUSERIAL_TX_RING 4096
+#endif
+#endif
+
+#ifndef MUSERIAL_TX_BUFFER
+#if defined(__ATTINY__) || defined(__UNO__)
+#define MUSERIAL_TX_BUFFER 0
+#else
+#define MUSERIAL_TX_BUFFER 1024
+#endif
+#endif
+
+#ifndef MUSERIAL_PRIO_BUFFER
+#if defined(__ATTINY__) || defined(__UNO__)
+#define MUSERIAL_PRIO_BUFFER 0
+#else
+#define MUSERIAL_PRIO_BUFFER 128
+#endif
+#endif
+
+#ifndef MUSERIAL_TX_WINDOW
+#if defined(__ATTINY__) || defined(__UNO__)
+#define MUSERIAL_TX_WINDOW 16
+#else
+#define MUSERIAL_TX_WINDOW 64
+#endif
+#endif
+
+#ifndef MUSERIAL_MAX_HOPS
+#define MUSERIAL_MAX_HOPS 8
+#endif
+
+#ifndef MUSERIAL_READ_CHUNK
+#if defined(__ATTINY__) || defined(__UNO__)
+#define MUSERIAL_READ_CHUNK 16
+#else
+#define MUSERIAL_READ_CHUNK 128
+#endif
+#endif
+
 namespace ustd {
 
 /*! \brief munet MuSerial Class
@@ -69,6 +125,35 @@ void setup() {
 }
 \endcode
 
+## Compact mode
+
+If both nodes support it, frequently used topics are replaced by 1-2 byte topic ids that are
+announced once with a `TOPICDEF` frame. See `compactMode`, `compactMaxTopics` and
+`compactMinUses`.
+
+## Acknowledge mode
+
+If both nodes support it, frames use protocol version 2 with a CRC-16 and are acknowledged by the
+other node. Unacknowledged frames are retransmitted (go-back-N with a window of at most
+`MUSERIAL_TX_WINDOW` frames and `MUSERIAL_TX_RING` bytes). The round trip time is measured from
+the acknowledge of one frame per window that was not retransmitted; the bytes in flight are then
+limited to twice the bandwidth-delay product of the line, which keeps retransmissions short.
+Frames that do not fit into the window wait in the transmit queue until acknowledges open it. See
+`ackMode` and `ackTimeout`.
+
+## Transmit queue
+
+Frames are queued (see `txBufferSize`) and written without blocking as the serial port accepts
+them. Pings and acknowledges overtake queued messages.
+
+## Multiple links
+
+A scheduler can run several MuSerial instances to chain MCUs, e.g. `nodeA <-> hub <-> nodeB <->
+nodeC`. The links of a scheduler learn from the pings which nodes are reachable through which link
+(up to `MUSERIAL_MAX_HOPS` hops). A message with a topic starting with `<node>/` is only forwarded
+on the link that leads to `node`, all other messages are forwarded on all links except the one
+they came from.
+
 For a complete example, see:
 <a href="https://github.com/muwerk/examples/tree/master/serialBridge">muwerk SerialBridge
 example</a>
@@ -79,6 +164,7 @@ class MuSerial {
     int tID;
 
     String name;
+    String statsGetTopic;  // "<name>/link/stats/get", built once for the routing path
     HardwareSerial *pSerial;
     unsigned long baudRate;
     uint8_t connectionLed;
@@ -86,6 +172,7 @@ class MuSerial {
 
     enum LinkState { SYNC, HEADER, MSG, MUCRC };
     bool bCheckLink = false;
+    PowerProfile::Profile powerProfile = PowerProfile::PERFORMANCE;
     uint8_t blockNum = 0;
     LinkState linkState;
     unsigned long lastRead = 0;
@@ -98,17 +185,120 @@ class MuSerial {
     String remoteName = "";
     ustd::array<String> outgoingBlockList;
     ustd::array<String> incomingBlockList;
+    ustd::TopicTree outgoingBlockTree;
+    ustd::TopicTree incomingBlockTree;
 
     const uint8_t SOH = 0x01, STX = 0x02, ETX = 0x03, EOT = 0x04;
-    const uint8_t VER = 0x01;
+    const uint8_t VER = 0x01;   // XOR checksum, no acknowledge
+    const uint8_t VER2 = 0x02;  // CRC-16, sliding window acknowledge/retransmit
 
     /*! protocol elements of MuSerial */
     enum LinkCmd {
-        MUPING,  //!< period ping messages consisting of
-                 //!< <unix-time-as-string><nul><remote-system-name><nul>
-        MQTT     //!< MQTT message consisting of: <topic><nul><message><nul>
+        MUPING,    //!< period ping messages consisting of
+                   //!< <unix-time-as-string><nul><remote-system-name><nul>[<capabilities><nul>
+                   //!< [<routes><nul>]]
+        MQTT,      //!< MQTT message consisting of: <topic><nul><message><nul>[<originator><nul>]
+        TOPICDEF,  //!< compact mode topic definition consisting of: <topic-id><topic><nul>
+        MQTTC,     //!< compact mode MQTT message consisting of:
+                   //!< <topic-id><message><nul>[<originator><nul>]
+        ACK        //!< acknowledge consisting of: <next-expected-block-number>
     };
 
+    /*! A part of the payload of a frame */
+    typedef struct t_segment {
+        const uint8_t *data;  //!< start of the segment
+        unsigned int len;     //!< length of the segment in bytes
+    } T_SEGMENT;
+
+    // compact mode - topic dictionaries for both directions
+    static const uint8_t COMPACT_CANDIDATES = 8;
+    bool peerCompact = false;
+    unsigned int peerMaxTopics = 0;
+    ustd::TopicTree txTopicIds;
+    ustd::array<String> txTopics;
+    ustd::array<String> rxTopics;
+    String compactCandidates[COMPACT_CANDIDATES];
+    uint8_t compactHits[COMPACT_CANDIDATES] = {};
+    uint8_t lastCandidate = 0;
+    uint16_t candidateMisses = 0;
+    unsigned long lastTopicDef = 0;
+
+    // acknowledge mode - go-back-N retransmission of sequenced frames
+    uint16_t session = 0;
+    bool peerAck = false;
+    bool peerSessionKnown = false;
+    uint16_t peerSession = 0;
+    bool rxSynced = false;
+    uint8_t rxExpected = 0;
+    bool ackPending = false;
+    /*! Byte ring buffer holding complete frames */
+    typedef struct t_ring {
+        uint8_t *buf;   //!< buffer or nullptr if not allocated
+        uint16_t size;  //!< size of the buffer
+        uint16_t head;  //!< start of the oldest frame
+        uint16_t used;  //!< number of bytes in use
+    } T_RING;
+
+    T_RING seqRing = {};     // sequenced frames, retained until acknowledged
+    uint16_t seqSent = 0;    // bytes of seqRing already written to the serial port
+    bool seqRewind = false;  // retransmit at the next frame boundary
+    int pendingAck = -1;     // acknowledge received while a sequenced frame is written
+    uint16_t txSlotLen[MUSERIAL_TX_WINDOW];
+    uint8_t txBase = 0;   // block number of the oldest unacknowledged frame
+    uint8_t txCount = 0;      // number of unacknowledged frames
+    uint8_t txFirstSent = 0;  // frames of the window transmitted at least once
+    uint16_t seqWaiting = 0;  // sequenced frames in txQueue, waiting for the window to open
+    unsigned long txLastSend = 0;
+    bool txFastResent = false;  // resent on a duplicate acknowledge, until the window advances
+    bool txTiming = false;      // the round trip of frame txTimedNum is measured
+    uint8_t txTimedNum = 0;
+    unsigned long txTimedStart = 0;
+    unsigned long txRtt = 0;  // smoothed round trip time of sequenced frames
+
+    // transmit queue - frames are written from loop() as the serial port accepts them
+    T_RING prioRing = {};  // pings and acknowledges
+    T_RING txQueue = {};   // all other frames that are not retained for retransmission
+    T_RING *pTxCur = nullptr;
+    uint16_t txFrameLeft = 0;
+
+    // routing - nodes reachable through this link, learned from pings and forwarded messages
+    typedef struct t_route {
+        String node;
+        uint8_t hops;
+        unsigned long lastSeen;
+    } T_ROUTE;
+    ustd::array<T_ROUTE> routes;
+    MuSerial *pNextLink = nullptr;
+
+    static MuSerial *&firstLink() {
+        // head of the list of all links of this node, used for routing between the links
+        static MuSerial *pFirst = nullptr;
+        return pFirst;
+    }
+
+    // statistics
+    unsigned long statFramesIn = 0;
+    unsigned long statFramesOut = 0;
+    unsigned long statBytesIn = 0;
+    unsigned long statBytesOut = 0;
+    unsigned long statCrcErrors = 0;
+    unsigned long statFramingErrors = 0;
+    unsigned long statOversize = 0;
+    unsigned long statAllocFailures = 0;
+    unsigned long statReadTimeouts = 0;
+    unsigned long statSequenceErrors = 0;
+    unsigned long statRetransmits = 0;
+    unsigned long statUnacknowledged = 0;
+    unsigned long statTxDropped = 0;
+    unsigned long statTopicIdHits = 0;
+    unsigned long rttLast = 0;
+    unsigned long rttMin = 0;
+    unsigned long rttMax = 0;
+    bool pingEcho = false;
+    unsigned long pingEchoValue = 0;
+    unsigned long pingEchoTime = 0;
+    unsigned long lastStats = 0;
+
     /*! Header of serial transmission: MuSerial sends messages as <Header><payload><Footer> */
     typedef struct t_header {
         uint8_t soh;   //!< = SOH;
@@ -118,7 +308,7 @@ class MuSerial {
         uint8_t hLen;  //!< Hi byte payload length
         uint8_t lLen;  //!< Lo byte length, payload length is hLen*256+lLen
         uint8_t stx;   //!< = STX;
-        uint8_t pad;   //!< = 0;  (padding)
+        uint8_t pad;   //!< number of links a MQTT message travelled (0: direct from an old node)
     } T_HEADER;
 
     /*! Footer of serial transmission */
@@ -126,7 +316,9 @@ class MuSerial {
         uint8_t etx;   //!< = ETX;  Last byte included in CRC calculation
         uint8_t pad2;  //!< = 0; (padding)
         uint8_t crc;   //!< primite CRC, calculated starting with ver-field of header, payload and
-                       //!< footer up and including etx.
+                       //!< footer up and including etx. For VER2: lo byte of a CRC-16/CCITT
+                       //!< starting with ver-field of header, payload and etx, pad2 holds the
+                       //!< hi byte.
         uint8_t eot;   //!< = EOT;
     } T_FOOTER;
 
@@ -135,10 +327,29 @@ class MuSerial {
                                //!< or active-low (false) logic is used.
     unsigned long connectionLedBlinkDurationMs =
         200;  //!< milli-secs the connectionLed is flashed on receiving a ping.
+    bool compactMode = true;  //!< If `true`, compact mode is offered to the other node: frequently
+                              //!< used topics are transmitted as 1-2 byte topic ids.
+    unsigned int compactMaxTopics = 32;  //!< Maximum number of topic ids per direction.
+    uint8_t compactMinUses = 2;  //!< Number of uses after which a topic is assigned a topic id.
+    bool ackMode = true;  //!< If `true`, acknowledge mode is offered to the other node: frames are
+                          //!< protected by CRC-16, acknowledged and retransmitted on loss.
+    unsigned long ackTimeout = 200;  //!< milli-secs without acknowledge (in addition to the
+                                     //!< transmission time) before unacknowledged frames are
+                                     //!< retransmitted. Once the round trip time is measured,
+                                     //!< the round trip time plus at most ackTimeout.
+    unsigned long statsInterval = 60;  //!< Interval in seconds for publishing the link statistics
+                                       //!< on `<name>/link/<remoteName>/stats`, 0 disables.
+    uint16_t txBufferSize = MUSERIAL_TX_BUFFER;  //!< Size of the transmit queue, must be set before
+                                                //!< calling `begin()`. 0: blocking writes.
+#if defined(__ESP__)
+    size_t rxBufferSize = 1024;  //!< Size of the UART receive buffer (ESP only), must be set
+                                 //!< before calling `begin()`.
+#endif
 
     MuSerial(String name, HardwareSerial *pSerial, unsigned long baudRate = 115200,
-             uint8_t connectionLed = -1)
-        : name(name), pSerial(pSerial), baudRate(baudRate), connectionLed(connectionLed) {
+             uint8_t connectionLed = -1, uint16_t maxFrameSize = MUSERIAL_MAX_FRAME)
+        : name(name), pSerial(pSerial), baudRate(baudRate), connectionLed(connectionLed),
+          msgBufSize(maxFrameSize) {
         /*! Instantiate a serial link between two muwerk instances.
 
         @param name Name of this node (used in pub/sub protocol, received as 'remoteName' by other
@@ -147,10 +358,25 @@ class MuSerial {
         @param baudRate baud rate for communication. Must be same as used by other node.
         @param connectionLed optional gpio pin number of a led (e.g. LED_BUILTIN) that is flashed on
         receiving a PING from other system.
+        @param maxFrameSize optional maximum payload size of a received frame (default
+        `MUSERIAL_MAX_FRAME`: 1024, 128 on ATtiny and Uno). The receive buffer is allocated once
+        in `begin()`, larger frames are dropped.
          */
     }
 
     ~MuSerial() {
+        for (MuSerial **pp = &firstLink(); *pp; pp = &(*pp)->pNextLink) {
+            if (*pp == this) {
+                *pp = pNextLink;
+                break;
+            }
+        }
+        if (msgBuf) {
+            free(msgBuf);
+        }
+        freeRing(seqRing);
+        freeRing(prioRing);
+        freeRing(txQueue);
     }
 
     void begin(Scheduler *_pSched) {
@@ -159,6 +385,29 @@ class MuSerial {
          * @param _pSched Pointer to the muwerk scheduler.
          */
         pSched = _pSched;
+        statsGetTopic = name + "/link/stats/get";
+        if (pSched != nullptr && pNextLink == nullptr && firstLink() != this) {
+            // all links of a scheduler share their routes
+            pNextLink = firstLink();
+            firstLink() = this;
+        }
+        if (msgBuf == nullptr) {
+            msgBuf = (unsigned char *)malloc(msgBufSize);
+            if (msgBuf == nullptr) {
+                msgBufSize = 0;
+            }
+        }
+        if (ackMode) {
+            allocRing(seqRing, MUSERIAL_TX_RING);
+        }
+        allocRing(prioRing, MUSERIAL_PRIO_BUFFER);
+        allocRing(txQueue, txBufferSize);
+        // identifies this instance to the other node, a change signals a restart
+        session = (uint16_t)(random(1, 0xffff) ^ micros());
+#if defined(__ESP__)
+        // a larger UART buffer must be set before begin() and allows longer task periods
+        pSerial->setRxBufferSize(rxBufferSize);
+#endif
         pSerial->begin(baudRate);
 #ifdef __ARDUINO__
         while (!*pSerial) {
@@ -166,11 +415,12 @@ class MuSerial {
 #endif
 
         auto ft = [=]() { this->loop(); };
-        tID = pSched->add(ft, "serlink", 20000L);  // check every 20ms
+        tID = pSched->add(ft, "serlink", getTaskPeriod());
         auto fnall = [=](String topic, String msg, String originator) {
             this->subsMsg(topic, msg, originator);
         };
         pSched->subscribe(tID, "#", fnall);
+        pSched->publish("net/power/get");
         bCheckLink = true;
         linkState = SYNC;
         if (connectionLed != -1) {
@@ -195,6 +445,7 @@ class MuSerial {
         }
         if (outgoingBlockList.add(topic) == -1)
             return false;
+        outgoingBlockTree.add(topic);
         return true;
     }
 
@@ -211,6 +462,7 @@ class MuSerial {
             if (outgoingBlockList[i] == topic) {
                 if (!outgoingBlockList.erase(i))
                     return false;
+                outgoingBlockTree.remove(topic);
                 return true;
             }
         }
@@ -231,6 +483,7 @@ class MuSerial {
         }
         if (incomingBlockList.add(topic) == -1)
             return false;
+        incomingBlockTree.add(topic);
         return true;
     }
 
@@ -247,6 +500,7 @@ class MuSerial {
             if (incomingBlockList[i] == topic) {
                 if (!incomingBlockList.erase(i))
                     return false;
+                incomingBlockTree.remove(topic);
                 return true;
             }
         }
@@ -261,6 +515,19 @@ class MuSerial {
         return c;
     }
 
+    static uint16_t crc16(const uint8_t *buf, unsigned int len, uint16_t init = 0xffff) {
+        // CRC-16/CCITT-FALSE, nibble table to keep flash and ram usage small on AVR
+        static const uint16_t table[16] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5,
+                                           0x60c6, 0x70e7, 0x8108, 0x9129, 0xa14a, 0xb16b,
+                                           0xc18c, 0xd1ad, 0xe1ce, 0xf1ef};
+        uint16_t c = init;
+        for (unsigned int i = 0; i < len; i++) {
+            c = (c << 4) ^ table[(c >> 12) ^ (buf[i] >> 4)];
+            c = (c << 4) ^ table[(c >> 12) ^ (buf[i] & 0x0f)];
+        }
+        return c;
+    }
+
     void ping() {
         char strTime[16];
 #if defined(__ARDUINO__) || defined(__ARM__) || defined(__RISC_V__)
@@ -268,48 +535,888 @@ class MuSerial {
 #else
         ltoa(time(nullptr), strTime, 15);
 #endif
-        sendOut(strTime, name, LinkCmd::MUPING);
+        // capabilities: comma separated list of tokens, old nodes ignore this field
+        String caps = "";
+        if (compactMode) {
+            caps = "c" + String(getKnownRxTopics()) + "/" + String(compactMaxTopics);
+        }
+        if (ackMode) {
+            caps += (caps.length() ? ",a" : "a") + String(session);
+        }
+        // round trip time: the peer returns our timestamp and the time it held it
+        caps += (caps.length() ? ",e" : "e") + String(millis());
+        if (pingEcho) {
+            caps += ",r" + String(pingEchoValue) + ":" + String(timeDiff(pingEchoTime, millis()));
+            pingEcho = false;
+        }
+        String adv = getAdvertisedRoutes();
+        T_SEGMENT segs[] = {{(const uint8_t *)strTime, (unsigned int)strlen(strTime) + 1},
+                            {(const uint8_t *)name.c_str(), name.length() + 1},
+                            {(const uint8_t *)caps.c_str(), caps.length() + 1},
+                            {(const uint8_t *)adv.c_str(), adv.length() + 1}};
+        sendFrame(LinkCmd::MUPING, segs, adv.length() ? 4 : 3);
         lastPingSent = pSched->getUptime();
+        expireRoutes();
+    }
+
+    String getAdvertisedRoutes() {
+        // <node>:<hops from this node>,... of all nodes reachable through the other links of this
+        // scheduler (split horizon: routes learned from the peer are not sent back)
+        String adv = "";
+        for (MuSerial *p = firstLink(); p; p = p->pNextLink) {
+            if (p == this || p->pSched != pSched || !p->linkConnected) {
+                continue;
+            }
+            adv += (adv.length() ? "," : "") + p->remoteName + ":1";
+            for (unsigned int i = 0; i < p->routes.length(); i++) {
+                if (p->routes[i].hops < MUSERIAL_MAX_HOPS) {
+                    adv += "," + p->routes[i].node + ":" + String(p->routes[i].hops);
+                }
+            }
+        }
+        return adv;
+    }
+
+    void handleRoutes(const char *adv) {
+        for (const char *p = adv; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : nullptr) {
+            const char *pSep = strchr(p, ':');
+            const char *pEnd = strchr(p, ',');
+            if (pSep == nullptr || (pEnd && pSep > pEnd)) {
+                continue;
+            }
+            String node = "";
+            node.concat(p, pSep - p);
+            learnRoute(node.c_str(), atoi(pSep + 1) + 1);
+        }
+    }
+
+    void learnRoute(const char *node, unsigned int hops) {
+        if (hops > MUSERIAL_MAX_HOPS || name == node || remoteName == node) {
+            return;
+        }
+        int i = findRoute(node);
+        if (i != -1) {
+            routes[i].hops = hops;
+            routes[i].lastSeen = pSched->getUptime();
+            return;
+        }
+        T_ROUTE route = {node, (uint8_t)hops, pSched->getUptime()};
+        routes.add(route);
+    }
+
+    int findRoute(const char *node, unsigned int len) {
+        for (unsigned int i = 0; i < routes.length(); i++) {
+            if (routes[i].node.length() == len && !strncmp(routes[i].node.c_str(), node, len)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int findRoute(const char *node) {
+        return findRoute(node, strlen(node));
+    }
+
+    bool isBehind(const char *node, unsigned int len) {
+        // true if node is the peer or can be reached through this link
+        return (remoteName.length() == len && !strncmp(remoteName.c_str(), node, len)) ||
+               findRoute(node, len) != -1;
+    }
+
+    uint8_t getHops(const char *node, unsigned int len) {
+        // hops from this node to node if reachable through one of the other links, 0 otherwise
+        for (MuSerial *p = firstLink(); p; p = p->pNextLink) {
+            if (p == this || p->pSched != pSched) {
+                continue;
+            }
+            if (p->remoteName.length() == len && !strncmp(p->remoteName.c_str(), node, len)) {
+                return 1;
+            }
+            int i = p->findRoute(node, len);
+            if (i != -1) {
+                return p->routes[i].hops;
+            }
+        }
+        return 0;
+    }
+
+    static const char *getFirstLevel(const char *topic, unsigned int *pLen) {
+        const char *pSep = strchr(topic, '/');
+        *pLen = pSep ? pSep - topic : strlen(topic);
+        return topic;
+    }
+
+    void expireRoutes() {
+        for (unsigned int i = routes.length(); i > 0; i--) {
+            if (pSched->getUptime() - routes[i - 1].lastSeen > pingReceiveTimeout) {
+                routes.erase(i - 1);
+            }
+        }
+    }
+
+    void updateRtt(unsigned long rtt) {
+        rttLast = rtt;
+        if (rttMin == 0 || rtt < rttMin) {
+            rttMin = rtt;
+        }
+        if (rtt > rttMax) {
+            rttMax = rtt;
+        }
+    }
+
+    void publishStats() {
+        // Arduino_JSON is not available on all platforms supported by MuSerial
+        String json = "{\"connected\":" + String(linkConnected ? "true" : "false") +
+                      ",\"frames\":{\"in\":" + String(statFramesIn) +
+                      ",\"out\":" + String(statFramesOut) +
+                      "},\"bytes\":{\"in\":" + String(statBytesIn) +
+                      ",\"out\":" + String(statBytesOut) +
+                      "},\"errors\":{\"crc\":" + String(statCrcErrors) +
+                      ",\"framing\":" + String(statFramingErrors) +
+                      ",\"oversize\":" + String(statOversize) +
+                      ",\"alloc\":" + String(statAllocFailures) +
+                      ",\"timeout\":" + String(statReadTimeouts) +
+                      ",\"sequence\":" + String(statSequenceErrors) +
+                      "},\"retransmits\":" + String(statRetransmits) +
+                      ",\"unacknowledged\":" + String(statUnacknowledged) +
+                      ",\"queue\":{\"used\":" + String(getTxBacklog()) +
+                      ",\"dropped\":" + String(statTxDropped) + "}" +
+                      ",\"topicIds\":{\"used\":" + String(txTopics.length()) +
+                      ",\"hits\":" + String(statTopicIdHits) + "}" +
+                      ",\"routes\":" + String(routes.length()) +
+                      ",\"rtt\":{\"last\":" + String(rttLast) + ",\"min\":" + String(rttMin) +
+                      ",\"max\":" + String(rttMax) + "}}";
+        // round trip min/max are reset after each report
+        rttMin = rttMax = 0;
+        lastStats = pSched->getUptime();
+        pSched->publish(name + "/link/" + remoteName + "/stats", json, name);
     }
 
     void handleTime(uint64_t remoteTime) {
         // XXX do maybe something?
     }
 
+    void handleCapabilities(const char *caps) {
+        bool compact = false;
+        bool ack = false;
+        uint16_t remoteSession = 0;
+        unsigned int known = 0;
+        unsigned int max = 0;
+        for (const char *p = caps; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : nullptr) {
+            if (*p == 'c') {
+                // c<number of our topic ids known by the peer>/<max topic ids of the peer>
+                char *pEnd;
+                compact = true;
+                known = strtoul(p + 1, &pEnd, 10);
+                max = *pEnd == '/' ? strtoul(pEnd + 1, nullptr, 10) : 0;
+            } else if (*p == 'a') {
+                // a<session of the peer>
+                ack = true;
+                remoteSession = strtoul(p + 1, nullptr, 10);
+            } else if (*p == 'e') {
+                // e<timestamp of the peer in ms>, returned with our next ping
+                pingEcho = true;
+                pingEchoValue = strtoul(p + 1, nullptr, 10);
+                pingEchoTime = millis();
+            } else if (*p == 'r') {
+                // r<our timestamp in ms>:<ms the peer held the timestamp>
+                char *pEnd;
+                unsigned long sent = strtoul(p + 1, &pEnd, 10);
+                unsigned long held = *pEnd == ':' ? strtoul(pEnd + 1, nullptr, 10) : 0;
+                updateRtt(timeDiff(sent, millis()) - held);
+            }
+        }
+        if (peerSessionKnown && remoteSession != peerSession) {
+            // the peer restarted: resynchronize on the next sequenced frame
+            rxSynced = false;
+        }
+        peerSession = remoteSession;
+        peerSessionKnown = true;
+        peerAck = ack && ackMode && seqRing.buf != nullptr;
+        peerCompact = compact && compactMode;
+        peerMaxTopics = max;
+        if (peerCompact && known < txTopics.length() &&
+            pSched->getUptime() - lastTopicDef > pingPeriod) {
+            // the peer lost topic definitions (e.g. restarted): send them again
+            for (unsigned int id = known; id < txTopics.length(); id++) {
+                sendTopicDef(id);
+            }
+        }
+    }
+
+    void sendMessage(const String &topic, const String &msg, const String &originator = "",
+                     uint8_t hops = 1) {
+        // the originator is only transmitted for messages forwarded from other nodes
+        T_SEGMENT orig = {(const uint8_t *)originator.c_str(), originator.length() + 1};
+        unsigned int count = originator.length() ? 3 : 2;
+        if (peerCompact) {
+            int id = getTopicId(topic);
+            if (id != -1) {
+                uint8_t idBuf[2];
+                T_SEGMENT segs[] = {{idBuf, encodeId(id, idBuf)},
+                                    {(const uint8_t *)msg.c_str(), msg.length() + 1},
+                                    orig};
+                if (sendFrame(LinkCmd::MQTTC, segs, count, hops)) {
+                    ++statTopicIdHits;
+                }
+                return;
+            }
+        }
+        T_SEGMENT segs[] = {{(const uint8_t *)topic.c_str(), topic.length() + 1},
+                            {(const uint8_t *)msg.c_str(), msg.length() + 1},
+                            orig};
+        sendFrame(LinkCmd::MQTT, segs, count, hops);
+    }
+
+    int getTopicId(const String &topic) {
+        int id = txTopicIds.find(topic.c_str());
+        if (id != -1) {
+            return id;
+        }
+        unsigned int maxTopics = compactMaxTopics < peerMaxTopics ? compactMaxTopics : peerMaxTopics;
+        if (txTopics.length() >= maxTopics || strchr(topic.c_str(), '+') ||
+            strchr(topic.c_str(), '#') || !isFrequent(topic)) {
+            return -1;
+        }
+        String entry = topic;
+        id = txTopics.add(entry);
+        if (id == -1) {
+            return -1;
+        }
+        if (!sendTopicDef(id)) {
+            // the transmit queue is full: the peer would not know the id
+            txTopics.erase(id);
+            return -1;
+        }
+        txTopicIds.add(topic, id);
+        return id;
+    }
+
+    bool isFrequent(const String &topic) {
+        if (compactMinUses <= 1) {
+            return true;
+        }
+        for (uint8_t i = 0; i < COMPACT_CANDIDATES; i++) {
+            if (compactHits[i] && compactCandidates[i] == topic) {
+                if (++compactHits[i] < compactMinUses) {
+                    return false;
+                }
+                compactCandidates[i] = "";
+                compactHits[i] = 0;
+                return true;
+            }
+        }
+        if (++candidateMisses % (8 * COMPACT_CANDIDATES) == 0) {
+            // aging: candidates that are no longer used give way to new topics
+            for (uint8_t i = 0; i < COMPACT_CANDIDATES; i++) {
+                if (compactHits[i]) {
+                    --compactHits[i];
+                }
+            }
+        }
+        // replace the least used candidate, of equally used ones the newest: with more topics
+        // than candidates, the older candidates still reach compactMinUses
+        uint8_t victim = lastCandidate;
+        for (uint8_t i = 0; i < COMPACT_CANDIDATES; i++) {
+            if (compactHits[i] < compactHits[victim]) {
+                victim = i;
+            }
+        }
+        compactCandidates[victim] = topic;
+        compactHits[victim] = 1;
+        lastCandidate = victim;
+        return false;
+    }
+
+    bool sendTopicDef(unsigned int id) {
+        uint8_t idBuf[2];
+        T_SEGMENT segs[] = {{idBuf, encodeId(id, idBuf)},
+                            {(const uint8_t *)txTopics[id].c_str(), txTopics[id].length() + 1}};
+        lastTopicDef = pSched->getUptime();
+        return sendFrame(LinkCmd::TOPICDEF, segs, 2);
+    }
+
+    unsigned int getKnownRxTopics() {
+        // number of consecutive topic ids received from the peer
+        unsigned int known = 0;
+        while (known < rxTopics.length() && rxTopics[known].length()) {
+            ++known;
+        }
+        return known;
+    }
+
+    static unsigned int encodeId(unsigned int id, uint8_t *buf) {
+        // topic ids 0..127 use one byte, larger ids two bytes with the high bit set
+        if (id < 0x80) {
+            buf[0] = (uint8_t)id;
+            return 1;
+        }
+        buf[0] = (uint8_t)(0x80 | (id >> 8));
+        buf[1] = (uint8_t)(id & 0xff);
+        return 2;
+    }
+
+    static unsigned int decodeId(const uint8_t *buf, unsigned int len, unsigned int *pId) {
+        if (len < 1) {
+            return 0;
+        }
+        if (buf[0] < 0x80) {
+            *pId = buf[0];
+            return 1;
+        }
+        if (len < 2) {
+            return 0;
+        }
+        *pId = ((buf[0] & 0x7f) << 8) | buf[1];
+        return 2;
+    }
+
     void sendOut(String topic, String msg, LinkCmd cmd = LinkCmd::MQTT) {
+        // Serial.println("Sending " + topic + ", " + msg);
+        T_SEGMENT segs[] = {{(const uint8_t *)topic.c_str(), topic.length() + 1},
+                            {(const uint8_t *)msg.c_str(), msg.length() + 1}};
+        sendFrame(cmd, segs, 2);
+    }
+
+    static bool isSequenced(uint8_t cmd) {
+        return cmd != LinkCmd::MUPING && cmd != LinkCmd::ACK;
+    }
+
+    bool sendFrame(LinkCmd cmd, const T_SEGMENT *segs, unsigned int count, uint8_t hops = 0) {
         T_HEADER th = {};
         T_FOOTER tf = {};
-        unsigned char ccrc;
-        unsigned char nul = 0x0;
 
-        // Serial.println("Sending " + topic + ", " + msg);
+        unsigned int len = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            len += segs[i].len;
+        }
+        unsigned int frameLen = sizeof(th) + len + sizeof(tf);
+        bool sequenced = false;
+        bool waiting = false;
+        if (peerAck && isSequenced(cmd)) {
+            // frames keep their order: while frames are waiting, new frames wait behind them
+            sequenced = seqWaiting == 0 && isWindowOpen(frameLen);
+            // a frame that can never fit into the window is sent unacknowledged
+            waiting = !sequenced && txQueue.buf && frameLen <= seqRing.size;
+        }
+        // pings stay VER 1 until the peer announced acknowledge mode, so that old nodes keep
+        // detecting the link. Waiting frames get their block number and CRC when they enter the
+        // window.
+        bool v2 = sequenced || waiting || cmd == LinkCmd::ACK ||
+                  (peerAck && cmd == LinkCmd::MUPING);
+
         th.soh = SOH;
-        th.ver = VER;
-        th.num = blockNum++;
+        th.ver = v2 ? VER2 : VER;
+        th.num = sequenced ? (uint8_t)(txBase + txCount) : blockNum++;
         th.cmd = cmd;
-        unsigned int len = topic.length() + msg.length() + 2;
         th.hLen = len / 256;
         th.lLen = len % 256;
         th.stx = STX;
+        th.pad = hops;
 
         tf.etx = ETX;
         tf.eot = EOT;
 
-        ccrc = crc((const uint8_t *)&(th.ver), sizeof(th) - 1);
-        ccrc = crc((const uint8_t *)topic.c_str(), topic.length(), ccrc);
-        ccrc = crc((const uint8_t *)&nul, 1, ccrc);
-        ccrc = crc((const uint8_t *)msg.c_str(), msg.length(), ccrc);
-        ccrc = crc((const uint8_t *)&nul, 1, ccrc);
-        ccrc = crc((const uint8_t *)&tf, 2, ccrc);
+        if (v2) {
+            uint16_t c16 = crc16((const uint8_t *)&(th.ver), sizeof(th) - 1);
+            for (unsigned int i = 0; i < count; i++) {
+                c16 = crc16(segs[i].data, segs[i].len, c16);
+            }
+            c16 = crc16((const uint8_t *)&tf, 1, c16);
+            tf.pad2 = c16 >> 8;
+            tf.crc = c16 & 0xff;
+        } else {
+            unsigned char ccrc = crc((const uint8_t *)&(th.ver), sizeof(th) - 1);
+            for (unsigned int i = 0; i < count; i++) {
+                ccrc = crc(segs[i].data, segs[i].len, ccrc);
+            }
+            tf.crc = crc((const uint8_t *)&tf, 2, ccrc);
+        }
 
-        tf.crc = ccrc;
+        T_RING *pRing = &txQueue;
+        if (sequenced) {
+            // keep a copy of the frame until it has been acknowledged
+            pRing = &seqRing;
+        } else if (!isSequenced(cmd) && fits(prioRing, frameLen)) {
+            // pings and acknowledges overtake queued messages to keep the link alive
+            pRing = &prioRing;
+        }
+        if (pRing->buf == nullptr) {
+            // no transmit queue: blocking writes
+            ++statFramesOut;
+            statBytesOut += frameLen;
+            pSerial->write((unsigned char *)&th, sizeof(th));
+            for (unsigned int i = 0; i < count; i++) {
+                pSerial->write(segs[i].data, segs[i].len);
+            }
+            pSerial->write((unsigned char *)&tf, sizeof(tf));
+            return true;
+        }
+        if (!fits(*pRing, frameLen)) {
+            ++statTxDropped;
+            return false;
+        }
+        ++statFramesOut;
+        if (waiting) {
+            ++seqWaiting;
+        } else if (!sequenced && peerAck && isSequenced(cmd)) {
+            ++statUnacknowledged;
+        }
+        putRing(*pRing, (const uint8_t *)&th, sizeof(th));
+        for (unsigned int i = 0; i < count; i++) {
+            putRing(*pRing, segs[i].data, segs[i].len);
+        }
+        putRing(*pRing, (const uint8_t *)&tf, sizeof(tf));
+        if (sequenced) {
+            txSlotLen[txCount++] = frameLen;
+            if (txCount == 1) {
+                // the retransmit timer runs for the oldest unacknowledged frame
+                txLastSend = millis();
+            }
+        }
+        drainTx();
+        return true;
+    }
 
-        pSerial->write((unsigned char *)&th, sizeof(th));
-        pSerial->write((unsigned char *)topic.c_str(), topic.length());
-        pSerial->write((uint8_t)nul);
-        pSerial->write((unsigned char *)msg.c_str(), msg.length());
-        pSerial->write((uint8_t)nul);
-        pSerial->write((unsigned char *)&tf, sizeof(tf));
+    uint16_t getWindowBytes() {
+        // twice the bandwidth-delay product, the whole ring until the round trip time is known.
+        // A larger window only delays the acknowledges and makes go-back-N resend more.
+        if (txRtt == 0) {
+            return seqRing.size;
+        }
+        unsigned long bytes = baudRate / 10 * 2 * txRtt / 1000;
+        return bytes < seqRing.size ? (uint16_t)bytes : seqRing.size;
+    }
+
+    bool isWindowOpen(unsigned int frameLen) {
+        // a frame is accepted while the bytes in flight are below the window, so that large
+        // frames cannot stall it
+        return txCount < MUSERIAL_TX_WINDOW && fits(seqRing, frameLen) &&
+               seqRing.used < getWindowBytes();
+    }
+
+    static uint8_t getRing(const T_RING &ring, uint16_t offset) {
+        return ring.buf[(ring.head + offset) % ring.size];
+    }
+
+    static void setRing(T_RING &ring, uint16_t offset, uint8_t value) {
+        ring.buf[(ring.head + offset) % ring.size] = value;
+    }
+
+    void sealFrame(T_RING &ring, uint16_t offset, uint8_t ver, uint8_t num) {
+        // sets version (header byte 1) and block number (byte 2) of a queued frame and
+        // recalculates its CRC (footer bytes 1 and 2) in place
+        uint16_t frameLen = getFrameLen(ring, offset);
+        uint16_t footer = offset + frameLen - sizeof(T_FOOTER);
+        setRing(ring, offset + 1, ver);
+        setRing(ring, offset + 2, num);
+        uint16_t c16 = 0xffff;
+        unsigned char ccrc = 0;
+        if (ver != VER2) {
+            setRing(ring, footer + 1, 0);
+        }
+        // the CRC covers the header from the version, the payload and the end of the footer
+        uint16_t crcLen = frameLen - 1 - (ver == VER2 ? 3 : 2);
+        for (uint16_t i = 1; i <= crcLen; i++) {
+            uint8_t b = getRing(ring, offset + i);
+            if (ver == VER2) {
+                c16 = crc16(&b, 1, c16);
+            } else {
+                ccrc = crc(&b, 1, ccrc);
+            }
+        }
+        if (ver == VER2) {
+            setRing(ring, footer + 1, c16 >> 8);
+            setRing(ring, footer + 2, c16 & 0xff);
+        } else {
+            setRing(ring, footer + 2, ccrc);
+        }
+    }
+
+    bool isWaitingFrame(const T_RING &ring) {
+        // only frames waiting for the window are queued as sequenced VER 2 frames (header bytes 1
+        // and 3: version and command)
+        return getRing(ring, 1) == VER2 && isSequenced(getRing(ring, 3));
+    }
+
+    void promoteWaiting() {
+        // moves waiting frames from the head of txQueue into the window as it opens
+        while (seqWaiting && txQueue.used && isWaitingFrame(txQueue)) {
+            uint16_t frameLen = getFrameLen(txQueue, 0);
+            if (!peerAck) {
+                // acknowledge mode ended (e.g. the link was lost): send unacknowledged
+                sealFrame(txQueue, 0, VER, blockNum++);
+                --seqWaiting;
+                ++statUnacknowledged;
+                return;
+            }
+            if (!isWindowOpen(frameLen)) {
+                return;
+            }
+            uint16_t offset = seqRing.used;
+            uint16_t pos = txQueue.head;
+            uint16_t n = txQueue.size - pos;
+            if (n > frameLen) {
+                n = frameLen;
+            }
+            putRing(seqRing, txQueue.buf + pos, n);
+            putRing(seqRing, txQueue.buf, frameLen - n);
+            dropRing(txQueue, frameLen);
+            sealFrame(seqRing, offset, VER2, (uint8_t)(txBase + txCount));
+            --seqWaiting;
+            txSlotLen[txCount++] = frameLen;
+            if (txCount == 1) {
+                txLastSend = millis();
+            }
+        }
+    }
+
+    void allocRing(T_RING &ring, uint16_t size) {
+        if (size && ring.buf == nullptr) {
+            ring.buf = (uint8_t *)malloc(size);
+            ring.size = ring.buf ? size : 0;
+            ring.head = ring.used = 0;
+        }
+    }
+
+    static void freeRing(T_RING &ring) {
+        if (ring.buf) {
+            free(ring.buf);
+            ring.buf = nullptr;
+        }
+    }
+
+    static bool fits(const T_RING &ring, unsigned int len) {
+        return ring.buf && ring.used + len <= ring.size;
+    }
+
+    static void putRing(T_RING &ring, const uint8_t *data, unsigned int len) {
+        // appends data to the ring, space has been checked by the caller
+        uint16_t pos = (ring.head + ring.used) % ring.size;
+        unsigned int n = ring.size - pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ring.buf + pos, data, n);
+        memcpy(ring.buf, data + n, len - n);
+        ring.used += len;
+    }
+
+    static void dropRing(T_RING &ring, uint16_t len) {
+        ring.head = (ring.head + len) % ring.size;
+        ring.used -= len;
+    }
+
+    static uint16_t getFrameLen(const T_RING &ring, uint16_t offset) {
+        // total length of the frame starting at offset, taken from its header
+        uint8_t hi = ring.buf[(ring.head + offset + 4) % ring.size];
+        uint8_t lo = ring.buf[(ring.head + offset + 5) % ring.size];
+        return sizeof(T_HEADER) + 256 * hi + lo + sizeof(T_FOOTER);
+    }
+
+    bool nextTxFrame() {
+        // frames are never interleaved: a new frame is selected only at frame boundaries
+        if (pendingAck != -1) {
+            uint8_t next = pendingAck;
+            pendingAck = -1;
+            handleAck(next);
+        }
+        if (seqRewind) {
+            seqRewind = false;
+            seqSent = 0;
+        }
+        promoteWaiting();
+        if (prioRing.used) {
+            pTxCur = &prioRing;
+            txFrameLeft = getFrameLen(prioRing, 0);
+        } else if (seqSent < seqRing.used) {
+            pTxCur = &seqRing;
+            txFrameLeft = getFrameLen(seqRing, seqSent);
+            startTiming();
+        } else if (txQueue.used && !(seqWaiting && isWaitingFrame(txQueue))) {
+            // a waiting frame at the head blocks the queue until the window opens
+            pTxCur = &txQueue;
+            txFrameLeft = getFrameLen(txQueue, 0);
+        } else {
+            pTxCur = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    void drainTx() {
+#ifdef __ATTINY__
+        int space = 0x7fff;  // TinySoftwareSerial does not report its buffer space
+#else
+        int space = pSerial->availableForWrite();
+#endif
+        while (space > 0) {
+            if (txFrameLeft == 0 && !nextTxFrame()) {
+                return;
+            }
+            uint16_t offset = pTxCur == &seqRing ? seqSent : 0;
+            uint16_t pos = (pTxCur->head + offset) % pTxCur->size;
+            uint16_t n = pTxCur->size - pos;
+            if (n > txFrameLeft) {
+                n = txFrameLeft;
+            }
+            if (n > space) {
+                n = space;
+            }
+            n = pSerial->write(pTxCur->buf + pos, n);
+            if (n == 0) {
+                return;
+            }
+            if (pTxCur == &seqRing) {
+                seqSent += n;
+            } else {
+                dropRing(*pTxCur, n);
+            }
+            txFrameLeft -= n;
+            space -= n;
+            statBytesOut += n;
+        }
+    }
+
+    void retransmit() {
+        // go-back-N: resend all unacknowledged frames in order, starting at the next frame
+        // boundary
+        if (pTxCur == &seqRing && txFrameLeft) {
+            seqRewind = true;
+        } else {
+            seqSent = 0;
+        }
+        // the acknowledge of a resent frame cannot be told apart from the first one
+        txTiming = false;
+        txLastSend = millis();
+        statRetransmits += txCount;
+    }
+
+    void startTiming() {
+        // one frame of the window is timed at a time, and only on its first transmission
+        uint8_t slot = 0;
+        for (uint16_t offset = 0; offset < seqSent && slot < txCount; slot++) {
+            offset += txSlotLen[slot];
+        }
+        if (slot < txFirstSent) {
+            return;
+        }
+        txFirstSent = slot + 1;
+        if (!txTiming) {
+            txTiming = true;
+            txTimedNum = txBase + slot;
+            txTimedStart = millis();
+        }
+    }
+
+    void updateTxRtt(uint8_t acked) {
+        if (!txTiming || (uint8_t)(txTimedNum - txBase) >= acked) {
+            return;
+        }
+        unsigned long rtt = timeDiff(txTimedStart, millis());
+        txRtt = txRtt ? (7 * txRtt + rtt + 4) / 8 : rtt;
+        if (txRtt == 0) {
+            txRtt = 1;
+        }
+        txTiming = false;
+    }
+
+    unsigned long getWindowTxTime() {
+        // milli-secs until the window is written: only pings, acknowledges and the frame in
+        // transmission go before it, frames waiting in txQueue do not
+        unsigned int bytes = prioRing.used + seqRing.used - seqSent;
+        if (pTxCur != &seqRing) {
+            bytes += txFrameLeft;
+        }
+        return getTxTime(bytes);
+    }
+
+    unsigned int getTxBacklog() {
+        return seqRing.used + prioRing.used + txQueue.used;
+    }
+
+    unsigned long getTxTime(unsigned int bytes) {
+        // milli-secs required to transmit bytes, 10 bit times each (8N1)
+        return (unsigned long)bytes * 10000L / baudRate;
+    }
+
+    void handleAck(uint8_t next) {
+        if (pTxCur == &seqRing && txFrameLeft) {
+            // the frame currently written must not be released
+            pendingAck = next;
+            return;
+        }
+        uint8_t acked = next - txBase;
+        if (acked == 0 && txCount && !txFastResent) {
+            // duplicate acknowledge: the peer dropped a frame out of sequence, resend without
+            // waiting for the timeout. The line keeps the order, so the further duplicates
+            // were caused by the same loss until the window advances.
+            txFastResent = true;
+            retransmit();
+            return;
+        }
+        if (acked == 0 || acked > txCount) {
+            // stale acknowledge
+            return;
+        }
+        for (uint8_t i = 0; i < acked; i++) {
+            dropRing(seqRing, txSlotLen[i]);
+            seqSent = seqSent > txSlotLen[i] ? seqSent - txSlotLen[i] : 0;
+        }
+        updateTxRtt(acked);
+        txFastResent = false;
+        txFirstSent = txFirstSent > acked ? txFirstSent - acked : 0;
+        txCount -= acked;
+        memmove(txSlotLen, txSlotLen + acked, txCount * sizeof(txSlotLen[0]));
+        txBase = next;
+        txLastSend = millis();
+    }
+
+    unsigned long getAckTimeout() {
+        // a lost tail of the window is only detected by the timeout: once the round trip time
+        // is measured, wait for it plus a margin of at most ackTimeout
+        if (txRtt == 0) {
+            return ackTimeout;
+        }
+        return txRtt + (3 * txRtt < ackTimeout ? 3 * txRtt : ackTimeout);
+    }
+
+    void checkRetransmit() {
+        if (txCount == 0) {
+            return;
+        }
+        if (timeDiff(txLastSend, millis()) > getAckTimeout() + getWindowTxTime()) {
+            retransmit();
+        }
+    }
+
+    void resetAckState() {
+        // a new session makes the peer resynchronize to our block numbers
+        ++session;
+        peerAck = false;
+        rxSynced = false;
+        ackPending = false;
+        if (pTxCur == &seqRing) {
+            // the frame currently written is lost, the receiver resynchronizes on SOH
+            pTxCur = nullptr;
+            txFrameLeft = 0;
+        }
+        seqRing.head = seqRing.used = 0;
+        seqSent = 0;
+        seqRewind = false;
+        pendingAck = -1;
+        txCount = 0;
+        txFirstSent = 0;
+        txFastResent = false;
+        txTiming = false;
+    }
+
+    bool acceptSequence(uint8_t num) {
+        // in-order delivery: only the expected block number is accepted, all other frames are
+        // dropped and answered with the acknowledge of the expected frame
+        ackPending = true;
+        if (!rxSynced) {
+            rxSynced = true;
+            rxExpected = num + 1;
+            return true;
+        }
+        if (num != rxExpected) {
+            ++statSequenceErrors;
+            return false;
+        }
+        ++rxExpected;
+        return true;
+    }
+
+    void sendAck() {
+        ackPending = false;
+        T_SEGMENT segs[] = {{&rxExpected, 1}};
+        sendFrame(LinkCmd::ACK, segs, 1);
+    }
+
+    static unsigned int splitFields(const uint8_t *buf, unsigned int len, const char **fields,
+                                    unsigned int maxFields) {
+        // split a payload into zero terminated strings, returns the number of fields found
+        unsigned int count = 0;
+        unsigned int pos = 0;
+        while (count < maxFields && pos < len) {
+            const uint8_t *pEnd = (const uint8_t *)memchr(buf + pos, 0, len - pos);
+            if (pEnd == nullptr) {
+                break;
+            }
+            fields[count++] = (const char *)(buf + pos);
+            pos = (pEnd - buf) + 1;
+        }
+        return count;
+    }
+
+    void handleFrame(LinkCmd cmd, const uint8_t *buf, unsigned int len) {
+        const char *fields[4];
+        unsigned int count;
+        unsigned int id;
+        unsigned int idLen;
+        switch (cmd) {
+        case LinkCmd::MUPING:
+            count = splitFields(buf, len, fields, 4);
+            if (count < 2) {
+                return;
+            }
+            lastMsg = pSched->getUptime();
+            remoteName = fields[1];
+            // XXX: Y2031?
+            handleTime(atol(fields[0]));
+            handleCapabilities(count >= 3 ? fields[2] : nullptr);
+            handleRoutes(count == 4 ? fields[3] : nullptr);
+            if (connectionLed != -1) {
+                digitalWrite(connectionLed, !activeLogic);
+                ledTimer = millis();
+            }
+            if (!linkConnected) {
+                linkConnected = true;
+                pSched->publish(name + "/link/" + remoteName, "connected", name);
+            }
+            break;
+        case LinkCmd::MQTT:
+            count = splitFields(buf, len, fields, 3);
+            if (count < 2) {
+                return;
+            }
+            lastMsg = pSched->getUptime();
+            internalPub(fields[0], fields[1], count == 3 ? fields[2] : nullptr);
+            break;
+        case LinkCmd::TOPICDEF:
+            idLen = decodeId(buf, len, &id);
+            if (!idLen || id >= compactMaxTopics ||
+                splitFields(buf + idLen, len - idLen, fields, 1) < 1) {
+                return;
+            }
+            lastMsg = pSched->getUptime();
+            while (rxTopics.length() <= id) {
+                String empty = "";
+                if (rxTopics.add(empty) == -1) {
+                    return;
+                }
+            }
+            rxTopics[id] = fields[0];
+            break;
+        case LinkCmd::MQTTC:
+            idLen = decodeId(buf, len, &id);
+            count = idLen ? splitFields(buf + idLen, len - idLen, fields, 2) : 0;
+            if (count < 1) {
+                return;
+            }
+            lastMsg = pSched->getUptime();
+            if (id < rxTopics.length() && rxTopics[id].length()) {
+                internalPub(rxTopics[id].c_str(), fields[0], count == 2 ? fields[1] : nullptr);
+            }
+            break;
+        case LinkCmd::ACK:
+            if (len >= 1) {
+                lastMsg = pSched->getUptime();
+                handleAck(buf[0]);
+            }
+            break;
+        }
     }
 
   private:
@@ -317,38 +1424,166 @@ class MuSerial {
     unsigned char *pHd;
     uint16_t hLen;
     uint16_t msgLen, curMsg;
+    uint16_t msgBufSize;
     unsigned char *msgBuf = nullptr;
-    bool allocated = false;
     T_FOOTER fo;
     unsigned char *pFo;
     uint16_t cLen;
 
-    bool internalPub(String topic, String msg) {
-        for (unsigned int i = 0; i < incomingBlockList.length(); i++) {
-            if (Scheduler::mqttmatch(topic, incomingBlockList[i])) {
-                return false;
-            }
+    bool internalPub(const char *topic, const char *msg, const char *originator) {
+        if (incomingBlockTree.match(topic) || hd.pad > MUSERIAL_MAX_HOPS) {
+            return false;
+        }
+        if (originator && *originator && remoteName != originator) {
+            // message forwarded by the peer: the originating node is reachable through this link
+            learnRoute(originator, hd.pad ? hd.pad : 1);
+        } else {
+            originator = remoteName.c_str();
+        }
+
+        // Serial.println("In: " + String(topic));
+        topic = stripPrefix(topic, name);
+
+        // Serial.println("InPub: " + String(topic));
+        pSched->publish(topic, msg, originator);
+        return true;
+    }
+
+    static const char *stripPrefix(const char *topic, const String &prefix) {
+        // skips <prefix>/ at the start of topic
+        unsigned int len = prefix.length();
+        if (len && strncmp(topic, prefix.c_str(), len) == 0 && topic[len] == '/') {
+            return topic + len + 1;
         }
+        return topic;
+    }
 
-        // Serial.println("In: " + topic);
-        String pre2 = remoteName + "/";
-        String pre1 = name + "/";
-        if (topic.substring(0, pre1.length()) == pre1) {
-            topic = topic.substring(pre1.length());
+    unsigned long getTaskPeriod() {
+        // micro-secs until half of the receive buffer is filled (or half of the transmit buffer
+        // of the serial port is empty if the transmit queue is used) at the configured baud rate
+#if defined(__ESP__)
+        unsigned long bufferSize = rxBufferSize;
+        unsigned long txFifoSize = 128;
+#elif defined(SERIAL_RX_BUFFER_SIZE)
+        unsigned long bufferSize = SERIAL_RX_BUFFER_SIZE;
+        unsigned long txFifoSize = SERIAL_TX_BUFFER_SIZE;
+#else
+        unsigned long bufferSize = 64;
+        unsigned long txFifoSize = 64;
+#endif
+        if (txQueue.buf && txFifoSize < bufferSize) {
+            bufferSize = txFifoSize;
         }
-        if (topic.substring(0, pre2.length()) == pre1) {
-            topic = topic.substring(pre2.length());
+        unsigned long bytesPerSec = baudRate / 10;  // 8N1: 10 bits per byte
+        if (bytesPerSec == 0) {
+            return 20000L;
         }
+        unsigned long period = (unsigned long)((uint64_t)bufferSize * 500000L / bytesPerSec);
+        if (period < 1000L) {
+            return 1000L;
+        }
+        // check at least every 20ms, every 100ms in low power profile
+        unsigned long maxPeriod = PowerProfile::select(powerProfile, 20000L, 20000L, 100000L);
+        return period > maxPeriod ? maxPeriod : period;
+    }
 
-        // Serial.println("InPub: " + topic);
-        pSched->publish(topic, msg, remoteName);
-        return true;
+    static uint16_t copySpan(uint8_t *dst, uint16_t pos, uint16_t size, const uint8_t *&src,
+                             size_t &len) {
+        // copies as much of src as fits into dst[pos..size), returns the new position
+        size_t n = size - pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(dst + pos, src, n);
+        src += n;
+        len -= n;
+        return pos + n;
+    }
+
+    bool checkFrame() {
+        if (hd.ver == VER2) {
+            uint16_t c16 = crc16((const uint8_t *)&(hd.ver), sizeof(hd) - 1);
+            c16 = crc16(msgBuf, msgLen, c16);
+            c16 = crc16((const uint8_t *)&fo, 1, c16);
+            return c16 == (uint16_t)((fo.pad2 << 8) | fo.crc);
+        }
+        unsigned char ccrc = crc((const uint8_t *)&(hd.ver), sizeof(hd) - 1);
+        ccrc = crc(msgBuf, msgLen, ccrc);
+        ccrc = crc((const uint8_t *)&fo, 2, ccrc);
+        return ccrc == fo.crc;
+    }
+
+    void parse(const uint8_t *buf, size_t len) {
+        while (len) {
+            switch (linkState) {
+            case SYNC: {
+                const uint8_t *pSoh = (const uint8_t *)memchr(buf, SOH, len);
+                if (pSoh == nullptr) {
+                    return;
+                }
+                len -= pSoh - buf + 1;
+                buf = pSoh + 1;
+                hd.soh = SOH;
+                linkState = HEADER;
+                pHd = (unsigned char *)&hd;
+                hLen = 1;
+            } break;
+            case HEADER:
+                hLen = copySpan(pHd, hLen, sizeof(hd), buf, len);
+                if (hLen == sizeof(hd)) {
+                    // XXX: check block number
+                    if ((hd.ver != VER && hd.ver != VER2) || hd.stx != STX) {
+                        ++statFramingErrors;
+                        linkState = SYNC;
+                    } else {
+                        msgLen = 256 * hd.hLen + hd.lLen;
+                        if (msgLen <= msgBufSize) {
+                            // the frame is parsed in place in the preallocated buffer
+                            curMsg = 0;
+                            linkState = msgLen ? MSG : SYNC;
+                        } else {
+                            if (msgBuf == nullptr) {
+                                ++statAllocFailures;
+                            } else {
+                                ++statOversize;
+                            }
+                            linkState = SYNC;
+                        }
+                    }
+                }
+                break;
+            case MSG:
+                curMsg = copySpan(msgBuf, curMsg, msgLen, buf, len);
+                if (curMsg == msgLen) {
+                    linkState = MUCRC;
+                    pFo = (unsigned char *)&fo;
+                    cLen = 0;
+                }
+                break;
+            case MUCRC:
+                cLen = copySpan(pFo, cLen, sizeof(fo), buf, len);
+                if (cLen == sizeof(fo)) {
+                    linkState = SYNC;
+                    if (fo.etx != ETX || fo.eot != EOT) {
+                        ++statFramingErrors;
+                    } else if (!checkFrame()) {
+                        ++statCrcErrors;
+                    } else {
+                        // Serial.println("Msg received");
+                        ++statFramesIn;
+                        if (hd.ver != VER2 || !isSequenced(hd.cmd) || acceptSequence(hd.num)) {
+                            handleFrame((LinkCmd)hd.cmd, msgBuf, msgLen);
+                        }
+                    }
+                }
+                break;
+            }
+        }
     }
 
     bool ld = false;
     void loop() {
-        unsigned char ccrc;
-        unsigned char c;
+        PowerProfile::countWakeup();
         if (bCheckLink) {
             if (ledTimer) {
                 if (timeDiff(ledTimer, millis()) > connectionLedBlinkDurationMs) {
@@ -361,135 +1596,41 @@ class MuSerial {
             if (pSched->getUptime() - lastPingSent > pingPeriod) {
                 ping();
             }
-            while (pSerial->available() > 0) {
-                c = pSerial->read();
-                lastRead = pSched->getUptime();
-                switch (linkState) {
-                case SYNC:
-                    if (c == SOH) {
-                        hd.soh = SOH;
-                        linkState = HEADER;
-                        pHd = (unsigned char *)&hd;
-                        hLen = 1;
-                    }
-                    continue;
-                    break;
-                case HEADER:
-                    pHd[hLen] = c;
-                    hLen++;
-                    if (hLen == sizeof(hd)) {
-                        // XXX: check block number
-                        if (hd.ver != VER || hd.stx != STX) {
-                            linkState = SYNC;
-                        } else {
-                            msgLen = 256 * hd.hLen + hd.lLen;
-                            if (msgLen < 1024) {
-                                msgBuf = (unsigned char *)malloc(msgLen);
-                                curMsg = 0;
-                                if (msgBuf) {
-                                    linkState = MSG;
-                                    allocated = true;
-                                } else {
-                                    linkState = SYNC;
-                                }
-                            } else {
-                                linkState = SYNC;
-                            }
-                        }
-                    }
-                    continue;
-                    break;
-                case MSG:
-                    msgBuf[curMsg] = c;
-                    ++curMsg;
-                    if (curMsg == msgLen) {
-                        linkState = MUCRC;
-                        pFo = (unsigned char *)&fo;
-                        cLen = 0;
-                    }
-                    continue;
-                    break;
-                case MUCRC:
-                    pFo[cLen] = c;
-                    ++cLen;
-                    if (cLen == sizeof(fo)) {
-                        if (fo.etx != ETX || fo.eot != EOT) {
-                            if (allocated && msgBuf != nullptr) {
-                                free(msgBuf);
-                                msgBuf = nullptr;
-                                allocated = false;
-                            }
-                            linkState = SYNC;
-                            continue;
-                        } else {
-                            ccrc = crc((const uint8_t *)&(hd.ver), sizeof(hd) - 1);
-                            ccrc = crc(msgBuf, msgLen, ccrc);
-                            ccrc = crc((const uint8_t *)&fo, 2, ccrc);
-                            if (ccrc != fo.crc) {
-                                if (allocated && msgBuf != nullptr) {
-                                    free(msgBuf);
-                                    msgBuf = nullptr;
-                                    allocated = false;
-                                }
-                                linkState = SYNC;
-                                continue;
-                            } else {
-                                uint64_t remoteTime = 0;
-                                // Serial.println("Msg received");
-                                if (strlen((const char *)msgBuf) + 2 <= msgLen) {
-                                    lastMsg = pSched->getUptime();
-                                    const char *pM =
-                                        (const char *)&msgBuf[strlen((const char *)msgBuf) + 1];
-                                    if (strlen(pM) + strlen((const char *)msgBuf) + 2 <= msgLen) {
-                                        switch ((LinkCmd)hd.cmd) {
-                                        case LinkCmd::MUPING:
-                                            remoteName = pM;
-                                            // XXX: Y2031?
-                                            remoteTime = atol((const char *)msgBuf);
-                                            handleTime(remoteTime);
-                                            lastMsg = pSched->getUptime();
-                                            if (connectionLed != -1) {
-                                                digitalWrite(connectionLed, !activeLogic);
-                                                ledTimer = millis();
-                                            }
-                                            if (!linkConnected) {
-                                                linkConnected = true;
-                                                pSched->publish(name + "/link/" + remoteName,
-                                                                "connected", name);
-                                            }
-                                            break;
-                                        case LinkCmd::MQTT:
-                                            internalPub((const char *)msgBuf, pM);
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (allocated && msgBuf != nullptr) {
-                                    free(msgBuf);
-                                    msgBuf = nullptr;
-                                    allocated = false;
-                                }
-                                linkState = SYNC;
-                            }
-                        }
-                    }
-                    continue;
+            uint8_t chunk[MUSERIAL_READ_CHUNK];
+            int avail;
+            while ((avail = pSerial->available()) > 0) {
+                // only request what is available: readBytes() must not wait for its timeout
+                size_t len = pSerial->readBytes(
+                    (char *)chunk, avail < (int)sizeof(chunk) ? (size_t)avail : sizeof(chunk));
+                if (len == 0) {
                     break;
                 }
+                lastRead = pSched->getUptime();
+                statBytesIn += len;
+                parse(chunk, len);
+            }
+            if (ackPending) {
+                // one cumulative acknowledge per batch keeps the link pipelined
+                sendAck();
+            }
+            checkRetransmit();
+            drainTx();
+            if (statsInterval && linkConnected &&
+                pSched->getUptime() - lastStats >= statsInterval) {
+                publishStats();
             }
             if (linkConnected || linkState != SYNC) {
                 if (linkState != SYNC) {
                     if ((unsigned long)(pSched->getUptime() - lastRead) > readTimeout) {
+                        ++statReadTimeouts;
                         linkState = SYNC;
                         if (linkConnected) {
                             pSched->publish(name + "/link/" + remoteName, "disconnected", name);
                         }
                         linkConnected = false;
-                        if (allocated && msgBuf != nullptr) {
-                            free(msgBuf);
-                            msgBuf = nullptr;
-                            allocated = false;
-                        }
+                        peerCompact = false;
+                        resetAckState();
+                        routes.erase();
                     }
                 } else {
                     if ((unsigned long)(pSched->getUptime() - lastMsg) > pingReceiveTimeout) {
@@ -497,6 +1638,9 @@ class MuSerial {
                             pSched->publish(name + "/link/" + remoteName, "disconnected", name);
                         }
                         linkConnected = false;
+                        peerCompact = false;
+                        resetAckState();
+                        routes.erase();
                     }
                 }
             }
@@ -504,23 +1648,37 @@ class MuSerial {
     }
 
     void subsMsg(String topic, String msg, String originator) {
-        if (originator == remoteName) {
-            // prevent loops;
+        if (topic == statsGetTopic) {
+            publishStats();
+            return;
+        }
+        if (topic == "net/power") {
+            powerProfile = PowerProfile::fromMessage(msg);
+            pSched->reschedule(tID, getTaskPeriod());
+        }
+        unsigned int len = originator.length();
+        if (originator == remoteName || isBehind(originator.c_str(), len)) {
+            // prevent loops: never send a message back in the direction it came from
             // Serial.println("Loop prevented: " + topic + " - " + msg + " from: " + originator);
             return;
         }
+        // messages of other nodes carry their originator and hop count
+        uint8_t hops = getHops(originator.c_str(), len);
+        if (hops >= MUSERIAL_MAX_HOPS) {
+            return;
+        }
         // Serial.println("MQ-in: " + topic + " - " + msg + " from: " + originator);
-        for (unsigned int i = 0; i < outgoingBlockList.length(); i++) {
-            if (Scheduler::mqttmatch(topic, outgoingBlockList[i])) {
-                // Serial.println("blocked: " + topic + " - " + msg + " from: " + originator);
-                return;
-            }
+        if (outgoingBlockTree.match(topic)) {
+            // Serial.println("blocked: " + topic + " - " + msg + " from: " + originator);
+            return;
         }
-        String pre = remoteName + "/";
-        if (topic.substring(0, pre.length()) == pre) {
-            sendOut(topic, msg);
-        } else {
-            sendOut(remoteName + "/" + topic, msg);
+        const char *node = getFirstLevel(topic.c_str(), &len);
+        if (isBehind(node, len)) {
+            // addressed to the peer or to a node behind it
+            sendMessage(topic, msg, hops ? originator : "", hops + 1);
+        } else if (getHops(node, len) == 0) {
+            // not addressed to a node reachable through another link
+            sendMessage(remoteName + "/" + topic, msg, hops ? originator : "", hops + 1);
         }
     };
 };
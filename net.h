@@ -14,6 +14,42 @@
 #include "jsonfile.h"
 #include "heartbeat.h"
 #include "timeout.h"
+#include "powerprofile.h"
+#include "netstate.h"
+
+#ifndef NET_RTC_OFFSET
+#define NET_RTC_OFFSET 32  // ESP8266 RTC user memory block used for the fast connect data
+#endif
+
+#ifndef NET_FAST_CONNECT_TIMEOUT
+#define NET_FAST_CONNECT_TIMEOUT 3000  // [ms] before falling back to a full connect
+#endif
+
+#ifndef NET_EVENT_PERIOD
+#define NET_EVENT_PERIOD 250000L  // [us] task period of the net task in event mode
+#endif
+
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 2
+typedef arduino_event_id_t T_NET_WIFI_EVENT;
+typedef arduino_event_info_t T_NET_WIFI_EVENT_INFO;
+#define NET_EVENT_STA_GOT_IP ARDUINO_EVENT_WIFI_STA_GOT_IP
+#define NET_EVENT_STA_DISCONNECTED ARDUINO_EVENT_WIFI_STA_DISCONNECTED
+#define NET_EVENT_AP_STACONNECTED ARDUINO_EVENT_WIFI_AP_STACONNECTED
+#define NET_EVENT_AP_STADISCONNECTED ARDUINO_EVENT_WIFI_AP_STADISCONNECTED
+#else
+typedef system_event_id_t T_NET_WIFI_EVENT;
+typedef system_event_info_t T_NET_WIFI_EVENT_INFO;
+#define NET_EVENT_STA_GOT_IP SYSTEM_EVENT_STA_GOT_IP
+#define NET_EVENT_STA_DISCONNECTED SYSTEM_EVENT_STA_DISCONNECTED
+#define NET_EVENT_AP_STACONNECTED SYSTEM_EVENT_AP_STACONNECTED
+#define NET_EVENT_AP_STADISCONNECTED SYSTEM_EVENT_AP_STADISCONNECTED
+#endif
+#endif
+
+#ifndef NET_FAST_CONNECT_LEASE_AGE
+#define NET_FAST_CONNECT_LEASE_AGE 3600  // seconds a cached DHCP lease is reused, below the lease time
+#endif
 
 namespace ustd {
 
@@ -92,6 +128,46 @@ class Net {
     bool defaultReboot;
     ustd::jsonfile config;
 
+    // parsed configuration - read once from the configuration file, so that (re)connects and
+    // state publishing do not need to access the file system
+    struct {
+        Netmode mode;
+        String hostname;
+        bool eventMode;
+        unsigned long scanMaxAge;
+        PowerProfile::Profile power;
+        struct {
+            String SSID;
+            String password;
+            String address;
+            String netmask;
+            String gateway;
+            String dns[2];
+            unsigned long connectTimeout;
+            unsigned long maxRetries;
+            bool rebootOnFailure;
+            bool fastConnect;
+        } station;
+        struct {
+            String SSID;
+            String password;
+            String address;
+            String netmask;
+            String gateway;
+            unsigned int channel;
+            bool hidden;
+            unsigned int maxConnections;
+        } ap;
+        // Buggy config*Time ESP8266 APIs assume api param char* remain valid indefinitly!
+        // Unresolved as of now: https://github.com/esp8266/Arduino/issues/7056
+        // Hence the ntp configuration is kept here
+        struct {
+            String hosts[3];
+            unsigned int hostCount;
+            String dstRules;
+        } ntp;
+    } conf;
+
     // hardware info
     String apmAddress;
     String macAddress;
@@ -115,8 +191,53 @@ class Net {
     bool bOnceConnected;
     int initialCounter;
     int deathCounter;
+    // runtime control - fast connect
+    typedef struct {
+        uint32_t crc;
+        uint32_t ssidHash;
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint32_t leaseTime;  // epoch time the DHCP lease was obtained, 0 if not yet known
+        uint32_t address;   // DHCP lease, 0 if the station uses a static address
+        uint32_t gateway;
+        uint32_t netmask;
+        uint32_t dns[2];
+    } T_FAST_CONNECT;
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+    static T_FAST_CONNECT &rtcFastConnect() {
+        // fast connect data in RTC memory, survives resets and deep sleep
+        static RTC_DATA_ATTR T_FAST_CONNECT fc;
+        return fc;
+    }
+#endif
+    bool fastConnecting = false;
+    bool usingLease = false;
+    bool leaseTimePending = false;  // the lease was obtained before the clock was set
+    unsigned long leaseObtained = 0;
+    bool lastFastConnect = false;
+    unsigned long connectStart = 0;
+    unsigned long connectDuration = 0;
+    // runtime control - event mode, flags are set by the WiFi event handlers
+    bool eventsRegistered = false;
+    volatile bool evStationChanged = false;
+    volatile bool evClientsChanged = false;
+#if !defined(__ESP32__) && !defined(__ESP32_RISC__)
+    WiFiEventHandler evHandlers[4];
+#endif
+    // runtime control - power profile
+    PowerProfile::Profile powerProfile = PowerProfile::PERFORMANCE;
+    ustd::timeout powerSample = 10000;
+    unsigned long powerSampleTime = 0;
+    unsigned long powerWakeups = 0;
+    unsigned long wakeupRate = 0;
     // runtime control - wifi scanning
+    enum ScanFormat { SCAN_FULL, SCAN_PAGED, SCAN_COMPACT };
     bool scanning = false;
+    bool scanHidden = false;
+    int scanResult = WIFI_SCAN_FAILED;  // result of the last scan, the networks are kept by WiFi
+    unsigned long scanTime = 0;
+    ScanFormat scanFormat = SCAN_FULL;
+    long scanMinRssi = -1000;
 
     // operating values - station
     ustd::sensorprocessor rssival = ustd::sensorprocessor(20, 1800, 2.0);
@@ -245,12 +366,93 @@ class Net {
         pSched->subscribe(
             tID, "net/networks/get",
             [this](String topic, String msg, String originator) { this->requestScan(msg); });
+
+        pSched->subscribe(tID, "net/power/set",
+                          [this](String topic, String msg, String originator) {
+                              this->setPowerProfile(PowerProfile::fromString(msg, powerProfile));
+                          });
+
+        pSched->subscribe(
+            tID, "net/power/get",
+            [this](String topic, String msg, String originator) { this->publishPower(); });
+    }
+
+    void setPowerProfile(PowerProfile::Profile profile) {
+        powerProfile = profile;
+        applyTaskPeriod();
+        applySleepMode();
+        publishPower();
+    }
+
+    void applyTaskPeriod() {
+        unsigned long period = PowerProfile::select(powerProfile, 0, 20000L, 100000L);
+        if (conf.eventMode) {
+            // events do the work, the task only handles timeouts
+            period = PowerProfile::select(powerProfile, NET_EVENT_PERIOD, NET_EVENT_PERIOD,
+                                          1000000L);
+        }
+        pSched->reschedule(tID, period);
+    }
+
+    void applySleepMode() {
+        if (mode == Netmode::OFF) {
+            return;
+        }
+        // an access point must not sleep in order to stay reachable for its clients
+        bool sleep = powerProfile != PowerProfile::PERFORMANCE && mode == Netmode::STATION;
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        WiFi.setSleep(sleep);
+#else
+        if (!sleep) {
+            WiFi.setSleepMode(WIFI_NONE_SLEEP);
+        } else {
+            WiFi.setSleepMode(powerProfile == PowerProfile::LOWPOWER ? WIFI_LIGHT_SLEEP
+                                                                     : WIFI_MODEM_SLEEP);
+        }
+#endif
+    }
+
+    void publishPower() {
+        JSONVar power;
+        power["profile"] = PowerProfile::toString(powerProfile);
+        power["wakeups"] = (unsigned long)wakeupRate;
+        pSched->publish("net/power", JSON.stringify(power));
+    }
+
+    void samplePower() {
+        // wakeups per second of all munet tasks
+        unsigned long now = millis();
+        unsigned long wakeups = PowerProfile::getWakeups();
+        if (now != powerSampleTime) {
+            wakeupRate = (uint64_t)(wakeups - powerWakeups) * 1000 / (now - powerSampleTime);
+        }
+        powerWakeups = wakeups;
+        powerSampleTime = now;
+        powerSample.reset();
+    }
+
+    static bool takeEvent(volatile bool &flag) {
+        // the WiFi handlers may run in another task (ESP32): a flag is only cleared after it was
+        // found set, and always before the WiFi state is queried. An event arriving in between
+        // is covered by that query, later events stay set for the next loop.
+        if (!flag) {
+            return false;
+        }
+        flag = false;
+        return true;
     }
 
     void loop() {
+        PowerProfile::countWakeup();
+        if (powerSample.test()) {
+            samplePower();
+        }
         if (mode == Netmode::OFF) {
             return;
         }
+        // in event mode the WiFi state is only queried after an event
+        bool stationChanged = takeEvent(evStationChanged) || !conf.eventMode;
+        bool clientsChanged = takeEvent(evClientsChanged) || !conf.eventMode;
         // radio specific state handling
         switch (curState) {
         case NOTDEFINED:
@@ -261,10 +463,12 @@ class Net {
         case CONNECTED:
         case SERVING:
             // states with active radio
-            unsigned int conns = WiFi.softAPgetStationNum();
-            if (conns != connections) {
-                connections = conns;
-                pSched->publish("net/connections", String(connections));
+            if (clientsChanged) {
+                unsigned int conns = WiFi.softAPgetStationNum();
+                if (conns != connections) {
+                    connections = conns;
+                    pSched->publish("net/connections", String(connections));
+                }
             }
             break;
         }
@@ -278,12 +482,27 @@ class Net {
             }
             break;
         case CONNECTINGAP:
-            if (WiFi.status() == WL_CONNECTED) {
+            if (stationChanged && WiFi.status() == WL_CONNECTED) {
                 curState = CONNECTED;
-                DBG("Connected to WiFi with ip address " + WiFi.localIP().toString());
+                connectDuration = millis() - connectStart;
+                lastFastConnect = fastConnecting;
+                fastConnecting = false;
+                DBG("Connected to WiFi with ip address " + WiFi.localIP().toString() + " in " +
+                    String(connectDuration) + "ms");
+                if (conf.station.fastConnect) {
+                    saveFastConnect();
+                }
                 configureTime();
                 return;
             }
+            if (fastConnecting && millis() - connectStart > NET_FAST_CONNECT_TIMEOUT) {
+                // the access point may have moved to another channel or the lease is invalid
+                DBG("Fast connect failed, connecting with full scan");
+                clearFastConnect();
+                beginStation(false);
+                connectTimeout.reset();
+                return;
+            }
             if (connectTimeout.test()) {
                 DBG("Timout connecting to WiFi " + SSID + ", status: " + WiFi.status());
                 if (bOnceConnected) {
@@ -297,14 +516,14 @@ class Net {
                         }
                     }
                     DBG("Reconnecting...");
-                    WiFi.reconnect();
+                    reconnectStation();
                     connectTimeout.reset();
                 } else {
                     if (initialCounter > 0) {
                         if (bRebootOnContinuedFailure) {
                             --initialCounter;
                         }
-                        WiFi.reconnect();
+                        reconnectStation();
                         connectTimeout.reset();
                         curState = CONNECTINGAP;
                     } else {
@@ -320,14 +539,21 @@ class Net {
         case CONNECTED:
             bOnceConnected = true;
             deathCounter = reconnectMaxRetries;
-            if (connectionMonitor.beat()) {
-                if (WiFi.status() == WL_CONNECTED) {
+            if (stationChanged && conf.eventMode && WiFi.status() != WL_CONNECTED) {
+                reconnectStation();
+                curState = CONNECTINGAP;
+                connectTimeout.reset();
+            } else if (connectionMonitor.beat()) {
+                if (leaseTimePending) {
+                    stampLease();
+                }
+                if (conf.eventMode || WiFi.status() == WL_CONNECTED) {
                     long rssi = WiFi.RSSI();
                     if (rssival.filter(&rssi)) {
                         pSched->publish("net/rssi", String(rssi));
                     }
                 } else {
-                    WiFi.reconnect();
+                    reconnectStation();
                     curState = CONNECTINGAP;
                     connectTimeout.reset();
                 }
@@ -375,6 +601,9 @@ class Net {
             stopServices();
         } else if (msg == "restart") {
             stopServices();
+            // pick up changes of the configuration file
+            loadNetConfig();
+            cleanupNetConfig();
             pSched->publish("net/network/control", "start");
         }
     }
@@ -401,6 +630,7 @@ class Net {
         config.writeString(prefix + "SSID", SSID);
         config.writeString(prefix + "password", password);
         config.writeBool("net/station/rebootOnFailure", restart);
+        loadNetConfig();
     }
 
     void readNetConfig(Netmode opmode, bool restart) {
@@ -431,6 +661,51 @@ class Net {
             deviceID.replace(":", "");
             config.writeString("net/deviceid", deviceID);
         }
+        loadNetConfig();
+        cleanupNetConfig();
+    }
+
+    void loadNetConfig() {
+        ustd::array<String> hosts;
+
+        conf.mode = getModeFromString(config.readString("net/mode"), defaultMode);
+        conf.hostname = config.readString("net/hostname");
+        conf.eventMode = config.readBool("net/eventMode", false);
+        conf.scanMaxAge = config.readLong("net/scanMaxAge", 0, 3600, 30);
+        conf.power = PowerProfile::fromString(config.readString("net/power"));
+
+        conf.station.SSID = config.readString("net/station/SSID");
+        conf.station.password = config.readString("net/station/password");
+        conf.station.address = config.readString("net/station/address");
+        conf.station.netmask = config.readString("net/station/netmask");
+        conf.station.gateway = config.readString("net/station/gateway");
+        config.readStringArray("net/services/dns/host", hosts);
+        for (unsigned int i = 0; i < 2; i++) {
+            conf.station.dns[i] = i < hosts.length() ? hosts[i] : "";
+        }
+        conf.station.connectTimeout =
+            config.readLong("net/station/connectTimeout", 3, 3600, 15) * 1000;
+        conf.station.maxRetries = config.readLong("net/station/maxRetries", 1, 1000000000, 40);
+        conf.station.rebootOnFailure =
+            config.readBool("net/station/rebootOnFailure", defaultReboot);
+        conf.station.fastConnect = config.readBool("net/station/fastConnect", false);
+
+        conf.ap.SSID = config.readString("net/ap/SSID", "muwerk-${macls}");
+        conf.ap.password = config.readString("net/ap/password");
+        conf.ap.address = config.readString("net/ap/address");
+        conf.ap.netmask = config.readString("net/ap/netmask");
+        conf.ap.gateway = config.readString("net/ap/gateway");
+        conf.ap.channel = config.readLong("net/ap/channel", 1, 13, 1);
+        conf.ap.hidden = config.readBool("net/ap/hidden", false);
+        conf.ap.maxConnections = config.readLong("net/ap/maxConnections", 1, 8, 4);
+
+        conf.ntp.dstRules = config.readString("net/services/ntp/dstrules");
+        hosts.erase();
+        config.readStringArray("net/services/ntp/host", hosts);
+        conf.ntp.hostCount = hosts.length() < 3 ? hosts.length() : 3;
+        for (unsigned int i = 0; i < 3; i++) {
+            conf.ntp.hosts[i] = i < conf.ntp.hostCount ? hosts[i] : "";
+        }
     }
 
     void cleanupNetConfig() {
@@ -488,9 +763,54 @@ class Net {
         // }
     }
 
+    void registerEvents() {
+        // the handlers may run in another task, they only flag the change for the net task
+        if (eventsRegistered) {
+            return;
+        }
+        eventsRegistered = true;
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        WiFi.onEvent([this](T_NET_WIFI_EVENT event, T_NET_WIFI_EVENT_INFO info) {
+            switch (event) {
+            case NET_EVENT_STA_GOT_IP:
+            case NET_EVENT_STA_DISCONNECTED:
+                evStationChanged = true;
+                break;
+            case NET_EVENT_AP_STACONNECTED:
+            case NET_EVENT_AP_STADISCONNECTED:
+                evClientsChanged = true;
+                break;
+            default:
+                break;
+            }
+        });
+#else
+        evHandlers[0] = WiFi.onStationModeGotIP(
+            [this](const WiFiEventStationModeGotIP &event) { evStationChanged = true; });
+        evHandlers[1] = WiFi.onStationModeDisconnected(
+            [this](const WiFiEventStationModeDisconnected &event) { evStationChanged = true; });
+        evHandlers[2] = WiFi.onSoftAPModeStationConnected(
+            [this](const WiFiEventSoftAPModeStationConnected &event) { evClientsChanged = true; });
+        evHandlers[3] = WiFi.onSoftAPModeStationDisconnected(
+            [this](const WiFiEventSoftAPModeStationDisconnected &event) {
+                evClientsChanged = true;
+            });
+#endif
+    }
+
     void startServices() {
-        mode = getModeFromString(config.readString("net/mode"), defaultMode);
+        mode = conf.mode;
+        if (conf.eventMode) {
+            registerEvents();
+        }
+        powerProfile = conf.power;
+        applyTaskPeriod();
+        // query the state once after (re)start
+        evStationChanged = true;
+        evClientsChanged = true;
         wifiSetMode(mode);
+        applySleepMode();
+        publishPower();
         switch (mode) {
         case Netmode::OFF:
             DBG("Network is disabled");
@@ -541,6 +861,7 @@ class Net {
             break;
         }
         scanning = false;
+        scanResult = WIFI_SCAN_FAILED;
         connections = 0;
         curState = Netstate::NOTCONFIGURED;
         wifiSetMode(Netmode::OFF);
@@ -549,30 +870,21 @@ class Net {
 
     bool startAP() {
         // configure hostname
-        hostname = replaceVars(config.readString("net/hostname", "muwerk-${macls}"));
+        hostname = replaceVars(conf.hostname.length() ? conf.hostname : "muwerk-${macls}");
         wifiAPSetHostname(hostname);
 
         // configure network
-        String address = config.readString("net/ap/address");
-        String netmask = config.readString("net/ap/netmask");
-        String gateway = config.readString("net/ap/gateway");
-        if (address.length() & netmask.length()) {
-            wifiSoftAPConfig(address, gateway, netmask);
+        if (conf.ap.address.length() & conf.ap.netmask.length()) {
+            wifiSoftAPConfig(conf.ap.address, conf.ap.gateway, conf.ap.netmask);
         }
 
         // configure AP
-        SSID = replaceVars(config.readString("net/ap/SSID", "muwerk-${macls}"));
-        if (!SSID.length()) {
-            SSID = replaceVars("muwerk-${macls}");
-        }
-        password = config.readString("net/ap/password");
-        unsigned int channel = config.readLong("net/ap/channel", 1, 13, 1);
-        bool hidden = config.readBool("net/ap/hidden", false);
-        unsigned int maxConnections = config.readLong("net/ap/maxConnections", 1, 8, 4);
+        SSID = getAPSSID();
+        password = conf.ap.password;
         connections = 0;
 
         DBG("Starting AP with SSID " + SSID + "...");
-        if (wifiSoftAP(SSID, password, channel, hidden, maxConnections)) {
+        if (wifiSoftAP(SSID, password, conf.ap.channel, conf.ap.hidden, conf.ap.maxConnections)) {
             wifiAPSetHostname(hostname);
             DBG("AP Serving");
             return true;
@@ -584,33 +896,23 @@ class Net {
 
     bool startSTATION() {
         // get connection parameters
-        hostname = replaceVars(config.readString("net/hostname"));
-        SSID = config.readString("net/station/SSID");
-        password = config.readString("net/station/password");
-
-        // get network parameter
-        ustd::array<String> dns;
-        String address = config.readString("net/station/address");
-        String netmask = config.readString("net/station/netmask");
-        String gateway = config.readString("net/station/gateway");
-        config.readStringArray("net/services/dns/host", dns);
-
-        // read some cached values
-        connectTimeout = config.readLong("net/station/connectTimeout", 3, 3600, 15) * 1000;
-        reconnectMaxRetries = config.readLong("net/station/maxRetries", 1, 1000000000, 40);
-        bRebootOnContinuedFailure = config.readBool("net/station/rebootOnFailure", defaultReboot);
+        hostname = replaceVars(conf.hostname);
+        SSID = conf.station.SSID;
+        password = conf.station.password;
+
+        // set connection management values
+        connectTimeout = conf.station.connectTimeout;
+        reconnectMaxRetries = conf.station.maxRetries;
+        bRebootOnContinuedFailure = conf.station.rebootOnFailure;
 
         DBG("Connecting WiFi " + SSID);
         wifiSetHostname(hostname);
-        if (wifiBegin(SSID, password)) {
+        if (beginStation(conf.station.fastConnect)) {
             deathCounter = reconnectMaxRetries;
             initialCounter = reconnectMaxRetries;
             bOnceConnected = false;
             curState = CONNECTINGAP;
             connectTimeout.reset();
-            if (!wifiConfig(address, gateway, netmask, dns)) {
-                DBG("Failed to set network configuration");
-            }
             wifiSetHostname(hostname);  // override dhcp option "host name"
             configureTime();
             return true;
@@ -618,29 +920,166 @@ class Net {
         return false;
     }
 
-    // Buggy config*Time ESP8266 APIs assume api param char* remain valid indefinitly!
-    // Unresolved as of now: https://github.com/esp8266/Arduino/issues/7056
-    // Hence:
-    ustd::array<String> ntpHosts;
-    String ntpDstRules;
+    bool beginStation(bool fast) {
+        T_FAST_CONNECT fc;
+        fastConnecting = fast && readFastConnect(fc);
+        usingLease = false;
+        connectStart = millis();
+        if (fastConnecting) {
+            // skip the scan by connecting to the last known access point
+            DBG("Fast connecting WiFi " + SSID + " on channel " + String(fc.channel));
+            if (!wifiBegin(SSID, password, fc.channel, fc.bssid)) {
+                return false;
+            }
+            if (!conf.station.address.length() && fc.address && isLeaseValid(fc)) {
+                // skip DHCP by using the last lease while it has certainly not expired
+                usingLease = true;
+                IPAddress dns1(fc.dns[0]);
+                IPAddress dns2(fc.dns[1]);
+                if (conf.station.dns[0].length()) {
+                    dns1.fromString(conf.station.dns[0]);
+                }
+                if (conf.station.dns[1].length()) {
+                    dns2.fromString(conf.station.dns[1]);
+                }
+                WiFi.config(IPAddress(fc.address), IPAddress(fc.gateway), IPAddress(fc.netmask),
+                            dns1, dns2);
+                return true;
+            }
+        } else if (!wifiBegin(SSID, password)) {
+            return false;
+        }
+        if (!wifiConfig(conf.station.address, conf.station.gateway, conf.station.netmask,
+                        conf.station.dns)) {
+            DBG("Failed to set network configuration");
+        }
+        return true;
+    }
+
+    void reconnectStation() {
+        if (conf.station.fastConnect) {
+            // the connection may still be bound to the cached access point
+            beginStation(true);
+        } else {
+            connectStart = millis();
+            WiFi.reconnect();
+        }
+    }
+
+    static uint32_t getHash(const uint8_t *data, size_t len, uint32_t hash = 2166136261UL) {
+        // FNV-1a
+        while (len--) {
+            hash = (hash ^ *data++) * 16777619UL;
+        }
+        return hash;
+    }
+
+    uint32_t getFastConnectCrc(T_FAST_CONNECT &fc) {
+        return getHash((const uint8_t *)&fc + sizeof(fc.crc), sizeof(fc) - sizeof(fc.crc));
+    }
+
+    bool readFastConnect(T_FAST_CONNECT &fc) {
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        fc = rtcFastConnect();
+#else
+        if (!ESP.rtcUserMemoryRead(NET_RTC_OFFSET, (uint32_t *)&fc, sizeof(fc))) {
+            return false;
+        }
+#endif
+        // the data is only valid for the configured network
+        return fc.crc == getFastConnectCrc(fc) &&
+               fc.ssidHash == getHash((const uint8_t *)SSID.c_str(), SSID.length()) &&
+               fc.channel;
+    }
+
+    void writeFastConnect(T_FAST_CONNECT &fc) {
+        fc.crc = getFastConnectCrc(fc);
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        rtcFastConnect() = fc;
+#else
+        ESP.rtcUserMemoryWrite(NET_RTC_OFFSET, (uint32_t *)&fc, sizeof(fc));
+#endif
+    }
+
+    void clearFastConnect() {
+        T_FAST_CONNECT fc;
+        memset(&fc, 0, sizeof(fc));
+        writeFastConnect(fc);
+    }
+
+    static uint32_t getEpoch() {
+        // 0 until the clock has been set by NTP (on ESP32 it keeps running in deep sleep)
+        time_t now = time(nullptr);
+        return now > 1609459200L ? (uint32_t)now : 0;  // 2021-01-01
+    }
+
+    static bool isLeaseValid(const T_FAST_CONNECT &fc) {
+        // without a clock the age of the lease is unknown: DHCP is safer than an address conflict
+        uint32_t now = getEpoch();
+        return fc.leaseTime && now >= fc.leaseTime &&
+               now - fc.leaseTime < NET_FAST_CONNECT_LEASE_AGE;
+    }
+
+    void stampLease() {
+        // the clock was set after the DHCP request: date the lease back to the request
+        uint32_t now = getEpoch();
+        T_FAST_CONNECT fc;
+        if (!now || !readFastConnect(fc)) {
+            return;
+        }
+        leaseTimePending = false;
+        if (fc.address) {
+            fc.leaseTime = now - (millis() - leaseObtained) / 1000;
+            writeFastConnect(fc);
+        }
+    }
+
+    void saveFastConnect() {
+        T_FAST_CONNECT fc;
+        uint32_t leaseTime = usingLease && readFastConnect(fc) ? fc.leaseTime : 0;
+        if (!usingLease) {
+            // DHCP was used, the lease has just been obtained
+            leaseObtained = connectStart;
+            leaseTime = getEpoch();
+            if (leaseTime) {
+                leaseTime -= (millis() - leaseObtained) / 1000;
+            }
+            leaseTimePending = leaseTime == 0;
+        }
+        memset(&fc, 0, sizeof(fc));
+        fc.ssidHash = getHash((const uint8_t *)SSID.c_str(), SSID.length());
+        const uint8_t *bssid = WiFi.BSSID();
+        if (bssid) {
+            memcpy(fc.bssid, bssid, sizeof(fc.bssid));
+        }
+        fc.channel = WiFi.channel();
+        fc.leaseTime = leaseTime;
+        if (!conf.station.address.length()) {
+            fc.address = WiFi.localIP();
+            fc.gateway = WiFi.gatewayIP();
+            fc.netmask = WiFi.subnetMask();
+            fc.dns[0] = WiFi.dnsIP(0);
+            fc.dns[1] = WiFi.dnsIP(1);
+        }
+        writeFastConnect(fc);
+    }
 
     void configureTime() {
-        ntpDstRules = config.readString("net/services/ntp/dstrules");
-        config.readStringArray("net/services/ntp/host", ntpHosts);
+        const String *hosts = conf.ntp.hosts;
+        unsigned int count = conf.ntp.hostCount;
 
-        if (ntpDstRules.length() && ntpHosts.length()) {
+        if (conf.ntp.dstRules.length() && count) {
             // configure ntp servers AND TZ variable
-            configTzTime(ntpDstRules.c_str(), ntpHosts[0].c_str(),
-                         ntpHosts.length() > 1 ? ntpHosts[1].c_str() : nullptr,
-                         ntpHosts.length() > 2 ? ntpHosts[2].c_str() : nullptr);
-        } else if (ntpHosts.length()) {
+            configTzTime(conf.ntp.dstRules.c_str(), hosts[0].c_str(),
+                         count > 1 ? hosts[1].c_str() : nullptr,
+                         count > 2 ? hosts[2].c_str() : nullptr);
+        } else if (count) {
             // configure ntp servers without TZ variable
-            configTime(0, 0, ntpHosts[0].c_str(),
-                       ntpHosts.length() > 1 ? ntpHosts[1].c_str() : nullptr,
-                       ntpHosts.length() > 2 ? ntpHosts[2].c_str() : nullptr);
-        } else if (ntpDstRules.length()) {
+            configTime(0, 0, hosts[0].c_str(), count > 1 ? hosts[1].c_str() : nullptr,
+                       count > 2 ? hosts[2].c_str() : nullptr);
+        } else if (conf.ntp.dstRules.length()) {
             // configure only TZ variable
-            setenv("TZ", ntpDstRules.c_str(), 3);
+            setenv("TZ", conf.ntp.dstRules.c_str(), 3);
         } else {
             // take from RTC?
         }
@@ -648,45 +1087,59 @@ class Net {
 
     void publishState() {
         JSONVar net;
+        String state;
+        String hostname;
+        String ip;
 
         net["mode"] = getStringFromMode(mode);
         net["mac"] = macAddress;
 
         switch (curState) {
         case NOTCONFIGURED:
-            net["state"] = "notconfigured";
+            state = "notconfigured";
             break;
         case CONNECTINGAP:
-            net["state"] = "connectingap";
+            state = "connectingap";
             net["SSID"] = WiFi.SSID();
             break;
         case CONNECTED:
-            net["state"] = "connected";
+            state = "connected";
+            hostname = wifiGetHostname();
+            ip = WiFi.localIP().toString();
             net["SSID"] = WiFi.SSID();
-            net["hostname"] = wifiGetHostname();
-            net["ip"] = WiFi.localIP().toString();
+            net["hostname"] = hostname;
+            net["ip"] = ip;
+            net["connectTime"] = (unsigned long)connectDuration;
+            net["fastConnect"] = lastFastConnect;
             break;
         case SERVING:
-            net["state"] = "serving";
-            net["hostname"] = wifiAPGetHostname();
+            state = "serving";
+            hostname = wifiAPGetHostname();
+            net["hostname"] = hostname;
             break;
         default:
-            net["state"] = "undefined";
+            state = "undefined";
             break;
         }
+        net["state"] = state;
         if (curState != NOTCONFIGURED && (mode == Netmode::AP || mode == Netmode::BOTH)) {
             net["ap"]["mac"] = WiFi.softAPmacAddress();
-            net["ap"]["SSID"] = replaceVars(config.readString("net/ap/SSID", "muwerk-${macls}"));
+            net["ap"]["SSID"] = getAPSSID();
             net["ap"]["ip"] = WiFi.softAPIP().toString();
             net["ap"]["connections"] = (int)connections;
         }
         String json = JSON.stringify(net);
+        // local subscribers get the parsed state without parsing the message again
+        NetState::update(json, state, hostname, macAddress, ip);
         pSched->publish("net/network", json);
     }
 
     void requestScan(String scantype = "async") {
         bool async = true;
         bool hidden = false;
+        unsigned long maxAge = conf.scanMaxAge;
+        scanFormat = SCAN_FULL;
+        scanMinRssi = -1000;
         for (String arg = shift(scantype, ','); arg.length(); arg = shift(scantype, ',')) {
             arg.toLowerCase();
             if (arg == "sync") {
@@ -695,8 +1148,26 @@ class Net {
                 async = true;
             } else if (arg == "hidden") {
                 hidden = true;
+            } else if (arg == "paged") {
+                scanFormat = SCAN_PAGED;
+            } else if (arg == "compact") {
+                scanFormat = SCAN_COMPACT;
+            } else if (arg.startsWith("minrssi=")) {
+                scanMinRssi = arg.substring(8).toInt();
+            } else if (arg.startsWith("maxage=")) {
+                maxAge = arg.substring(7).toInt();
             }
         }
+        if (scanning) {
+            // the result is published with these options when the running scan is done
+            return;
+        }
+        if (scanResult >= 0 && (scanHidden || !hidden) && millis() - scanTime < maxAge * 1000) {
+            // reuse the last scan
+            publishScan(scanResult);
+            return;
+        }
+        scanHidden = hidden;
         processScan(WiFi.scanNetworks(async, hidden));
     }
 
@@ -707,43 +1178,77 @@ class Net {
                 DBG("WiFi scan running...");
                 scanning = true;
             }
-            break;
+            return;
         case WIFI_SCAN_FAILED:
             DBG("WiFi scan FAILED.");
-            publishScan(result);
-            scanning = false;
+            break;
         case 0:
             DBG("WiFi scan succeeded: No network found.");
-            scanning = false;
-            publishScan(result);
             break;
         default:
             DBGF("WiFi scan succeeded: %u networks found.\r\n", result);
-            scanning = false;
-            publishScan(result);
+            break;
         }
+        scanning = false;
+        scanResult = result;
+        scanTime = millis();
+        publishScan(result);
     }
 
-    void publishScan(int result) {
-        JSONVar res;
-
-        res["result"] = result < 0 ? "error" : "ok";
-        res["networks"] = JSON.parse("[]");
+    JSONVar getNetworkJson(int i) {
+        JSONVar network;
 
-        for (int i = 0; i < result; i++) {
-            JSONVar network;
-
-            network["ssid"] = WiFi.SSID(i);
-            network["rssi"] = WiFi.RSSI(i);
-            network["channel"] = WiFi.channel(i);
-            network["encryption"] = getStringFromEncryption(WiFi.encryptionType(i));
-            network["bssid"] = WiFi.BSSIDstr(i);
+        network["ssid"] = WiFi.SSID(i);
+        network["rssi"] = WiFi.RSSI(i);
+        network["channel"] = WiFi.channel(i);
+        network["encryption"] = getStringFromEncryption(WiFi.encryptionType(i));
+        network["bssid"] = WiFi.BSSIDstr(i);
 #if !defined(__ESP32__) && !defined(__ESP32_RISC__)
-            network["hidden"] = WiFi.isHidden(i);
+        network["hidden"] = WiFi.isHidden(i);
 #endif
-            res["networks"][i] = network;
+        return network;
+    }
+
+    void publishScan(int result) {
+        // the result is built network by network to keep the heap usage low
+        if (result < 0) {
+            pSched->publish("net/networks", "{\"result\":\"error\",\"networks\":[]}");
+            return;
+        }
+        String out;
+        unsigned int count = 0;
+        if (scanFormat == SCAN_FULL) {
+            out = "{\"result\":\"ok\",\"networks\":[";
         }
-        pSched->publish("net/networks", JSON.stringify(res));
+        for (int i = 0; i < result; i++) {
+            if (WiFi.RSSI(i) < scanMinRssi) {
+                continue;
+            }
+            switch (scanFormat) {
+            case SCAN_FULL:
+                if (count) {
+                    out += ",";
+                }
+                out += JSON.stringify(getNetworkJson(i));
+                break;
+            case SCAN_PAGED:
+                pSched->publish("net/networks/" + String(count), JSON.stringify(getNetworkJson(i)));
+                break;
+            case SCAN_COMPACT:
+                // <rssi>,<channel>,<encryption>,<bssid>,<ssid> - the ssid may contain commas
+                out += String(WiFi.RSSI(i)) + "," + String(WiFi.channel(i)) + "," +
+                       getStringFromEncryption(WiFi.encryptionType(i)) + "," + WiFi.BSSIDstr(i) +
+                       "," + WiFi.SSID(i) + "\n";
+                break;
+            }
+            ++count;
+        }
+        if (scanFormat == SCAN_FULL) {
+            out += "]}";
+        } else if (scanFormat == SCAN_PAGED) {
+            out = "{\"result\":\"ok\",\"count\":" + String(count) + "}";
+        }
+        pSched->publish("net/networks", out);
     }
 
     void initLed() {
@@ -763,6 +1268,11 @@ class Net {
         }
     }
 
+    String getAPSSID() {
+        String ssid = replaceVars(conf.ap.SSID);
+        return ssid.length() ? ssid : replaceVars("muwerk-${macls}");
+    }
+
     String replaceVars(String val) {
         String hexAddress = macAddress;
         hexAddress.replace(":", "");
@@ -927,8 +1437,7 @@ class Net {
         return WiFi.softAPConfig(addr, gate, mask);
     }
 
-    static bool wifiConfig(String &address, String &gateway, String &netmask,
-                           ustd::array<String> &dns) {
+    static bool wifiConfig(String &address, String &gateway, String &netmask, String dns[2]) {
         IPAddress addr;
         IPAddress gate;
         IPAddress mask;
@@ -943,22 +1452,23 @@ class Net {
             DBG("Setting static gateway: " + gateway);
             gate.fromString(gateway);
         }
-        if (dns.length() > 0) {
+        if (dns[0].length()) {
             DBG("Setting dns server 1: " + String(dns[0]));
             dns1.fromString(dns[0]);
         }
-        if (dns.length() > 1) {
+        if (dns[1].length()) {
             DBG("Setting dns server 2: " + String(dns[1]));
             dns2.fromString(dns[1]);
         }
         return WiFi.config(addr, gate, mask, dns1, dns2);
     }
 
-    static bool wifiBegin(String &ssid, String &passphrase) {
+    static bool wifiBegin(String &ssid, String &passphrase, int32_t channel = 0,
+                          const uint8_t *bssid = nullptr) {
 #if defined(__ESP32__) || defined(__ESP32_RISC__)
-        return WiFi.begin(ssid.c_str(), passphrase.c_str());
+        return WiFi.begin(ssid.c_str(), passphrase.c_str(), channel, bssid);
 #else
-        return WiFi.begin(ssid, passphrase);
+        return WiFi.begin(ssid, passphrase, channel, bssid);
 #endif
     }
 
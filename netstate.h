@@ -0,0 +1,98 @@
+// netstate.h
+#pragma once
+
+#include "ustd_platform.h"
+
+#include <Arduino_JSON.h>
+
+namespace ustd {
+
+/*! \brief munet NetState helper
+
+The network state is published by Net as a JSON object on `net/network`. Mqtt, Ota and Web all
+need the state of the network, but parsing the same message in every task is wasteful. NetState
+holds the parsed content of the last `net/network` message, shared by all tasks:
+
+\code{cpp}
+pSched->subscribe(tID, "net/network", [this](String topic, String msg, String originator) {
+    const NetState::T_STATE &state = NetState::fromMessage(msg);
+    if (state.connected) {
+        // ...
+    }
+});
+\endcode
+
+Net registers every state it publishes with `NetState::update()`, so local subscribers never
+parse the message. Messages that do not originate from a local Net (e.g. forwarded by MuSerial)
+are parsed once on first access.
+*/
+class NetState {
+  public:
+    typedef struct {
+        String state;     // `notconfigured`, `connectingap`, `connected`, `serving` or `undefined`
+        String hostname;  // hostname in states `connected` and `serving`, otherwise empty
+        String mac;       // mac address of the station interface
+        String ip;        // ip address in state `connected`, otherwise empty
+        bool connected;   // `true` if `state` is `connected`
+        bool valid;       // `false` if the message could not be parsed
+    } T_STATE;
+
+    static const T_STATE &fromMessage(const String &msg) {
+        /*! Get the parsed content of a `net/network` message
+         *
+         * @param msg The message received on `net/network`
+         * @return The network state. The reference stays valid, but its content changes with the
+         * next message.
+         */
+        if (msg != lastMessage()) {
+            parse(msg);
+        }
+        return lastState();
+    }
+
+    static void update(const String &msg, const String &state, const String &hostname,
+                       const String &mac, const String &ip) {
+        /*! Register a `net/network` message that is about to be published
+         *
+         * Called by Net with the already known values of the message.
+         */
+        lastMessage() = msg;
+        set(state, hostname, mac, ip, true);
+    }
+
+  private:
+    static void parse(const String &msg) {
+        lastMessage() = msg;
+        JSONVar jsonState = JSON.parse(msg);
+        if (JSON.typeof(jsonState) != "object") {
+            set("", "", "", "", false);
+            return;
+        }
+        set((const char *)jsonState["state"], (const char *)jsonState["hostname"],
+            (const char *)jsonState["mac"], (const char *)jsonState["ip"], true);
+    }
+
+    static void set(const String &state, const String &hostname, const String &mac,
+                    const String &ip, bool valid) {
+        T_STATE &s = lastState();
+        s.state = state;
+        s.hostname = hostname;
+        s.mac = mac;
+        s.ip = ip;
+        s.connected = state == "connected";
+        s.valid = valid;
+    }
+
+    // the last message and its parsed state: all subscribers of a message share one parse
+    static String &lastMessage() {
+        static String msg;
+        return msg;
+    }
+
+    static T_STATE &lastState() {
+        static T_STATE state = {"", "", "", "", false, false};
+        return state;
+    }
+};
+
+}  // namespace ustd
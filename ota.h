@@ -11,10 +11,25 @@
 
 #include "scheduler.h"
 #include "filesystem.h"
+#include "powerprofile.h"
+#include "netstate.h"
 
 #include <ArduinoOTA.h>
 #include <Arduino_JSON.h>
 
+#include <WiFiClientSecure.h>
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+#include <HTTPClient.h>
+#include <Update.h>
+#else
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#endif
+
+#ifndef OTA_CHUNK_SIZE
+#define OTA_CHUNK_SIZE 4096  // size of the download buffers, one flash sector
+#endif
+
 namespace ustd {
 
 /*! \brief munet OTA Class
@@ -53,6 +68,31 @@ ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
 \endcode
 
 to set an OTA password. This will be supported within the API in a future version.
+
+## Pull updates
+
+Additionally, an update can be downloaded from a HTTP(S) server by publishing the URL of the image
+to `ota/update/url`. The message is either the plain URL or a JSON object:
+
+\code{json}
+{"url": "https://fw.example.com/node.bin", "type": "sketch", "md5": "<md5 of the image>"}
+\endcode
+
+`type` is `sketch` (default) or `filesystem`, `md5` is optional and verified by the updater. The
+image is downloaded in chunks from the task loop while all other tasks keep running. On ESP32 the
+flash is written by a separate writer task from one buffer while the next chunk is received into
+the other buffer. `ota/state` reports `start`, `end` and `error`, and `ota/progress` reports the
+progress once per second:
+
+\code{json}
+{"type": "sketch", "bytes": 204800, "total": 412320, "percent": 49, "rate": 51200}
+\endcode
+
+`rate` is the throughput in bytes per second. After a successful update the device restarts
+(see `rebootOnSuccess`).
+
+Security note: HTTPS connections are encrypted but the server certificate is not verified. Use the
+`md5` field to ensure the integrity of the image.
  */
 class Ota {
   private:
@@ -64,8 +104,35 @@ class Ota {
     bool bNetUp = false;
     bool bCheckOTA = false;
     bool bOTAUpdateActive = false;
+    unsigned long taskPeriod = 25000L;  // check for ota every 25ms in performance profile
+
+    // pull update state
+    typedef enum { PULL_IDLE, PULL_RUNNING, PULL_REBOOT } T_PULL_STATE;
+    T_PULL_STATE pullState = PULL_IDLE;
+    WiFiClient *pPullClient = nullptr;
+    HTTPClient *pPullHttp = nullptr;
+    uint8_t *pullBuf[2] = {nullptr, nullptr};
+    unsigned int pullFill = 0;  // buffer that receives data
+    size_t pullFillLen = 0;
+    size_t pullTotal = 0;
+    size_t pullReceived = 0;
+    volatile size_t pullWritten = 0;
+    String pullType;
+    unsigned long pullStart = 0;
+    unsigned long pullLastData = 0;
+    unsigned long pullLastProgress = 0;
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+    // flash writer task: writes one buffer while the other one is filled
+    TaskHandle_t writerTask = nullptr;
+    uint8_t *volatile writeBuf = nullptr;
+    volatile size_t writeLen = 0;
+    volatile bool writeBusy = false;
+    volatile bool writeError = false;
+#endif
 
   public:
+    bool rebootOnSuccess = true;        // restart the device after a successful pull update
+    unsigned long pullTimeout = 10000;  // abort a pull update if no data arrives for [ms]
     Ota() {
         //! Instantiate a over-the-air (OTA) software update object.
     }
@@ -84,41 +151,340 @@ class Ota {
          */
         // init scheduler
         pSched = _pSched;
-        tID = pSched->add([this]() { this->loop(); }, "ota", 25000L);  // check for ota every 25ms
+        tID = pSched->add([this]() { this->loop(); }, "ota", taskPeriod);
 
-        // subscribe to all messages
-        pSched->subscribe(tID, "#", [this](String topic, String msg, String originator) {
-            this->subsMsg(topic, msg, originator);
+        // subscribe only to the topics handled by Ota
+        pSched->subscribe(tID, "net/network", [this](String topic, String msg, String originator) {
+            this->onNetworkState(NetState::fromMessage(msg));
         });
+        pSched->subscribe(tID, "net/power", [this](String topic, String msg, String originator) {
+            this->setPowerProfile(PowerProfile::fromMessage(msg));
+        });
+        pSched->subscribe(tID, "ota/update/url",
+                          [this](String topic, String msg, String originator) {
+                              this->startPull(msg);
+                          });
 
         pSched->publish("net/network/get");
+        pSched->publish("net/power/get");
     }
 
   private:
     void loop() {
+        PowerProfile::countWakeup();
         if (bCheckOTA) {
             ArduinoOTA.handle();
         }
+        if (pullState == PULL_RUNNING) {
+            pullStep();
+        } else if (pullState == PULL_REBOOT && millis() - pullLastProgress > 1000) {
+            // give the last state messages a chance to leave the device
+            ESP.restart();
+        }
+    }
+
+    void publishState(const char *state, String error = "") {
+        JSONVar msg;
+        msg["state"] = state;
+        msg["type"] = pullType.c_str();
+        if (error.length()) {
+            msg["error"] = error.c_str();
+        }
+        pSched->publish("ota/state", JSON.stringify(msg));
+    }
+
+    void publishProgress() {
+        unsigned long elapsed = millis() - pullStart;
+        JSONVar msg;
+        msg["type"] = pullType.c_str();
+        msg["bytes"] = (unsigned long)pullWritten;
+        msg["total"] = (unsigned long)pullTotal;
+        msg["percent"] = (int)(pullTotal ? (uint64_t)pullWritten * 100 / pullTotal : 0);
+        msg["rate"] = (unsigned long)(elapsed ? (uint64_t)pullWritten * 1000 / elapsed : 0);
+        pSched->publish("ota/progress", JSON.stringify(msg));
+        pullLastProgress = millis();
+    }
+
+    void startPull(String msg) {
+        String url = msg;
+        String md5 = "";
+        pullType = "sketch";
+        JSONVar jsonMsg = JSON.parse(msg);
+        if (JSON.typeof(jsonMsg) == "object") {
+            url = (const char *)jsonMsg["url"];
+            if (JSON.typeof(jsonMsg["type"]) == "string") {
+                pullType = (const char *)jsonMsg["type"];
+            }
+            if (JSON.typeof(jsonMsg["md5"]) == "string") {
+                md5 = (const char *)jsonMsg["md5"];
+            }
+        }
+        if (pullState != PULL_IDLE || bOTAUpdateActive) {
+            publishState("error", "update in progress");
+            return;
+        }
+        if (!bNetUp) {
+            publishState("error", "no network");
+            return;
+        }
+        if (url.startsWith("https://")) {
+            WiFiClientSecure *pSecure = new WiFiClientSecure();
+            pSecure->setInsecure();
+            pPullClient = pSecure;
+        } else {
+            pPullClient = new WiFiClient();
+        }
+        pPullHttp = new HTTPClient();
+        // the request is sent and the headers are received synchronously
+        if (!pPullHttp->begin(*pPullClient, url)) {
+            finishPull(false, "invalid url");
+            return;
+        }
+        int code = pPullHttp->GET();
+        if (code != 200) {
+            finishPull(false, "http " + String(code));
+            return;
+        }
+        int size = pPullHttp->getSize();
+        if (size <= 0) {
+            finishPull(false, "unknown size");
+            return;
+        }
+        pullTotal = size;
+        pullReceived = 0;
+        pullWritten = 0;
+        pullFill = 0;
+        pullFillLen = 0;
+        // the ESP8266 writes the flash synchronously and needs a single buffer
+        pullBuf[0] = (uint8_t *)malloc(OTA_CHUNK_SIZE);
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        pullBuf[1] = (uint8_t *)malloc(OTA_CHUNK_SIZE);
+        if (!pullBuf[1]) {
+            finishPull(false, "out of memory");
+            return;
+        }
+#endif
+        if (!pullBuf[0]) {
+            finishPull(false, "out of memory");
+            return;
+        }
+#if defined(U_FS)
+        int command = pullType == "filesystem" ? U_FS : U_FLASH;
+#else
+        int command = pullType == "filesystem" ? U_SPIFFS : U_FLASH;
+#endif
+        if (command != U_FLASH) {
+            fsEnd();
+        }
+        if (!Update.begin(pullTotal, command)) {
+            if (command != U_FLASH) {
+                // the pull is not running yet, finishPull() would not mount it again
+                fsBegin();
+            }
+            finishPull(false, "update begin failed " + String(Update.getError()));
+            return;
+        }
+        if (md5.length()) {
+            Update.setMD5(md5.c_str());
+        }
+        // from here on finishPull() aborts the update and mounts the file system again
+        pullState = PULL_RUNNING;
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        writeBusy = false;
+        writeError = false;
+        if (xTaskCreate([](void *pOta) { ((Ota *)pOta)->writerLoop(); }, "otawriter", 4096, this,
+                        2, &writerTask) != pdPASS) {
+            writerTask = nullptr;
+            finishPull(false, "writer task");
+            return;
+        }
+#endif
+        pullStart = pullLastData = pullLastProgress = millis();
+        publishState("start");
+        // run often while downloading, the other tasks keep running
+        pSched->reschedule(tID, 1000L);
+    }
+
+    void pullStep() {
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        if (writeError) {
+            finishPull(false, "flash write failed " + String(Update.getError()));
+            return;
+        }
+#endif
+        WiFiClient *pStream = pPullHttp->getStreamPtr();
+        unsigned long now = millis();
+        // receive into the fill buffer without blocking
+        size_t want = OTA_CHUNK_SIZE - pullFillLen;
+        if (want > pullTotal - pullReceived) {
+            want = pullTotal - pullReceived;
+        }
+        if (want) {
+            int avail = pStream->available();
+            if (avail > 0) {
+                int len = pStream->read(pullBuf[pullFill] + pullFillLen,
+                                        (size_t)avail < want ? (size_t)avail : want);
+                if (len > 0) {
+                    pullFillLen += len;
+                    pullReceived += len;
+                    pullLastData = now;
+                }
+            } else if (!pStream->connected() || now - pullLastData > pullTimeout) {
+                finishPull(false, "download interrupted");
+                return;
+            }
+        }
+        // hand over a full buffer or the rest of the image to the flash writer
+        if (pullFillLen && (pullFillLen == OTA_CHUNK_SIZE || pullReceived == pullTotal)) {
+            if (!writeChunk()) {
+                return;
+            }
+        }
+        if (pullWritten == pullTotal && !isWriting()) {
+            finishPull(true);
+            return;
+        }
+        if (now - pullLastProgress >= 1000) {
+            publishProgress();
+        }
     }
 
-    void subsMsg(String topic, String msg, String originator) {
-        JSONVar mqttJsonMsg = JSON.parse(msg);
+    bool isWriting() {
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        return writeBusy;
+#else
+        return false;
+#endif
+    }
+
+    bool writeChunk() {
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        if (writeBusy) {
+            // the writer is still busy with the other buffer
+            return true;
+        }
+        writeBuf = pullBuf[pullFill];
+        writeLen = pullFillLen;
+        writeBusy = true;
+        xTaskNotifyGive(writerTask);
+        pullFill ^= 1;
+#else
+        if (Update.write(pullBuf[0], pullFillLen) != pullFillLen) {
+            finishPull(false, "flash write failed " + String(Update.getError()));
+            return false;
+        }
+        pullWritten += pullFillLen;
+#endif
+        pullFillLen = 0;
+        return true;
+    }
+
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+    void writerLoop() {
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            if (!writeBuf) {
+                break;
+            }
+            if (Update.write(writeBuf, writeLen) != writeLen) {
+                writeError = true;
+            } else {
+                pullWritten += writeLen;
+            }
+            writeBusy = false;
+        }
+        writeBusy = false;
+        vTaskDelete(nullptr);
+    }
 
-        if (JSON.typeof(mqttJsonMsg) == "undefined") {
+    void stopWriter() {
+        if (!writerTask) {
             return;
         }
+        while (writeBusy) {
+            delay(1);
+        }
+        writeBusy = true;
+        writeBuf = nullptr;
+        xTaskNotifyGive(writerTask);
+        while (writeBusy) {
+            delay(1);
+        }
+        writerTask = nullptr;
+    }
+#endif
 
-        if (topic == "net/network") {
-            String state = (const char *)mqttJsonMsg["state"];  // root["state"];
-            if (state == "connected") {
-                if (!bNetUp) {
-                    bNetUp = true;
-                    OTAsetup();
-                    bCheckOTA = true;
+    void finishPull(bool success, String error = "") {
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+        stopWriter();
+#endif
+        if (pullState == PULL_RUNNING) {
+            if (success) {
+                publishProgress();
+                if (!Update.end()) {
+                    success = false;
+                    error = "update end failed " + String(Update.getError());
                 }
             } else {
-                bNetUp = false;
-                bCheckOTA = false;
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+                Update.abort();
+#else
+                Update.end(false);
+#endif
+            }
+            if (!success && pullType == "filesystem") {
+                fsBegin();
+            }
+        }
+        if (pPullHttp) {
+            pPullHttp->end();
+            delete pPullHttp;
+            pPullHttp = nullptr;
+        }
+        if (pPullClient) {
+            delete pPullClient;
+            pPullClient = nullptr;
+        }
+        for (unsigned int i = 0; i < 2; i++) {
+            if (pullBuf[i]) {
+                free(pullBuf[i]);
+                pullBuf[i] = nullptr;
+            }
+        }
+        pSched->reschedule(tID, taskPeriod);
+        if (success) {
+            publishState("end");
+            pullState = rebootOnSuccess ? PULL_REBOOT : PULL_IDLE;
+            pullLastProgress = millis();
+        } else {
+            publishState("error", error);
+            pullState = PULL_IDLE;
+        }
+    }
+
+    void setPowerProfile(PowerProfile::Profile profile) {
+        // an upload is only accepted by ArduinoOTA.handle(), the transfer itself blocks
+        taskPeriod = PowerProfile::select(profile, 25000L, 100000L, 500000L);
+        if (pullState != PULL_RUNNING) {
+            pSched->reschedule(tID, taskPeriod);
+        }
+    }
+
+    void onNetworkState(const NetState::T_STATE &state) {
+        if (!state.valid) {
+            return;
+        }
+        if (state.connected) {
+            if (!bNetUp) {
+                bNetUp = true;
+                OTAsetup();
+                bCheckOTA = true;
+            }
+        } else {
+            bNetUp = false;
+            bCheckOTA = false;
+            if (pullState == PULL_RUNNING) {
+                finishPull(false, "network lost");
             }
         }
     }
@@ -146,12 +512,17 @@ class Ota {
                 type = "filesystem";
 
             DBG("Start updating " + type);
+            pSched->publish("ota/state", "{\"state\":\"start\",\"type\":\"" + type + "\"}");
             bOTAUpdateActive = true;
             pSched->singleTaskMode(tID);
             fsEnd();
         });
         ArduinoOTA.onEnd([&]() {
             DBG("\nEnd of update");
+            pSched->publish("ota/state",
+                            ArduinoOTA.getCommand() == U_FLASH
+                                ? "{\"state\":\"end\",\"type\":\"sketch\"}"
+                                : "{\"state\":\"end\",\"type\":\"filesystem\"}");
             pSched->singleTaskMode(-1);
             bOTAUpdateActive = false;
         });
@@ -0,0 +1,453 @@
+// outbox.h
+#pragma once
+
+#include <functional>
+
+#include "ustd_platform.h"
+#include "ustd_array.h"
+#include "filesystem.h"
+
+namespace ustd {
+
+/*! \brief munet Outbox helper
+
+PubSubClient publishes with QoS 0 only: a message that is written to the network right before
+the connection drops is lost. The Outbox keeps the messages of selected topics until the MQTT
+server has confirmed them, and publishes them again after reconnecting (at-least-once delivery,
+duplicates are possible). Mqtt confirms the messages with a marker message that it publishes to
+its own client topic after a batch: as soon as the server echoes the marker, all messages that
+were published before it have been received by the server.
+
+New messages are held in RAM. They are written to an append-only log file only in batches, if
+`batchLength` unconfirmed messages have accumulated or after `flushInterval` ms. Messages that
+are confirmed before that never touch the flash. Confirmations are appended to the log as well,
+so that no data is ever rewritten in place. The log is removed as soon as all of its messages are
+confirmed. If an append would exceed `maxSize`, the log is compacted to its unconfirmed messages
+first; if these alone do not leave enough room, the new messages are dropped.
+
+After a restart, the unconfirmed messages of the log are published again. A record that was only
+partially written (e.g. power loss during a flush) ends the log and is discarded.
+
+Log records:
+* `M` <seq:4> <topic length:2> <message length:2> <topic> <message>
+* `A` <seq:4>: all messages up to and including `seq` are confirmed
+*/
+class Outbox {
+  public:
+    typedef std::function<bool(const String &topic, const String &msg)> T_PUBLISH;
+
+    // statistics
+    unsigned long statAppended = 0;
+    unsigned long statDropped = 0;
+    unsigned long statFlushes = 0;
+    unsigned long statCompactions = 0;
+    unsigned long statBytesWritten = 0;
+
+  private:
+    enum { HEADER_LENGTH = 9, ACK_LENGTH = 5 };
+    typedef struct t_entry {
+        uint32_t seq;
+        String topic;
+        String msg;
+    } T_ENTRY;
+
+    String filename;
+    unsigned long maxSize;
+    unsigned int batchLength;
+    unsigned long flushInterval;
+
+    ustd::array<T_ENTRY> ram;  // messages that are not yet in the log, in ascending order
+    uint32_t nextSeq = 1;
+    uint32_t acked = 0;      // all messages up to this number are confirmed
+    uint32_t sent = 0;       // all messages up to this number are published on this connection
+    uint32_t logged = 0;     // highest message number in the log
+    uint32_t loggedAck = 0;  // highest confirmation in the log
+    unsigned long fileSize = 0;
+    unsigned long readOffset = 0;  // replay position in the log
+    bool dirty = false;
+    unsigned long dirtySince = 0;
+
+  public:
+    Outbox(String filename, unsigned long maxSize = 16384, unsigned int batchLength = 8,
+           unsigned long flushInterval = 5000)
+        : filename(filename), maxSize(maxSize), batchLength(batchLength),
+          flushInterval(flushInterval) {
+        /*! Instantiate an outbox
+         *
+         * @param filename Name of the log file
+         * @param maxSize Maximum size of the log file in bytes
+         * @param batchLength Number of unconfirmed messages kept in RAM before they are written
+         * @param flushInterval Maximum time in ms unconfirmed messages are kept in RAM only
+         */
+    }
+
+    void begin() {
+        /*! Read the unconfirmed messages of an existing log */
+        getFS().begin();
+        scan();
+    }
+
+    bool append(const String &topic, const String &msg) {
+        /*! Add a message to the outbox
+         *
+         * @return `false` if the message is too large for the log
+         */
+        if (HEADER_LENGTH + topic.length() + msg.length() > maxSize) {
+            ++statDropped;
+            return false;
+        }
+        T_ENTRY entry = {nextSeq++, topic, msg};
+        if (ram.add(entry) == -1) {
+            ++statDropped;
+            return false;
+        }
+        ++statAppended;
+        setDirty();
+        if (ram.length() >= batchLength) {
+            flush();
+        }
+        return true;
+    }
+
+    unsigned int publish(T_PUBLISH pub, unsigned int maxMessages) {
+        /*! Publish unconfirmed messages that were not yet published on this connection
+         *
+         * @param pub Function that publishes a message. If it returns `false`, the message is
+         * tried again with the next call.
+         * @param maxMessages Maximum number of messages published by this call
+         * @return Number of published messages
+         */
+        unsigned int count = 0;
+        if (sent < logged) {
+            // older messages are replayed from the log
+            count = replay(pub, maxMessages);
+        }
+        for (unsigned int i = 0; i < ram.length() && count < maxMessages; i++) {
+            if (sent < logged) {
+                // the replay of the log is not finished
+                break;
+            }
+            if (ram[i].seq <= sent) {
+                continue;
+            }
+            if (!pub(ram[i].topic, ram[i].msg)) {
+                break;
+            }
+            sent = ram[i].seq;
+            ++count;
+        }
+        return count;
+    }
+
+    uint32_t getSent() {
+        /*! Number of the last published message, to be confirmed by confirm() */
+        return sent;
+    }
+
+    void confirm(uint32_t seq) {
+        /*! Confirm all messages up to and including `seq` */
+        if (seq >= nextSeq || seq <= acked) {
+            return;
+        }
+        acked = seq;
+        while (ram.length() && ram[0].seq <= acked) {
+            ram.erase(0);
+        }
+        if (logged > loggedAck) {
+            // the confirmation is logged with the next flush
+            setDirty();
+        }
+    }
+
+    void rewind() {
+        /*! Publish all unconfirmed messages again, e.g. after reconnecting */
+        sent = acked;
+        readOffset = 0;
+    }
+
+    void loop() {
+        /*! Write pending changes to the log after `flushInterval` */
+        if (dirty && timeDiff(dirtySince, millis()) >= flushInterval) {
+            flush();
+        }
+    }
+
+    unsigned int pending() {
+        /*! Number of unconfirmed messages, including messages dropped since the last
+         * confirmation */
+        return nextSeq - 1 - acked;
+    }
+
+    unsigned long getFileSize() {
+        return fileSize;
+    }
+
+    void flush() {
+        /*! Write the messages held in RAM and the confirmations to the log */
+        dirty = false;
+        if (ram.length() == 0 && logged <= acked) {
+            // everything is confirmed: the log is obsolete
+            if (fileSize) {
+                getFS().remove(filename);
+                fileSize = 0;
+            }
+            loggedAck = acked;
+            readOffset = 0;
+            return;
+        }
+        unsigned long batchSize = ACK_LENGTH;
+        for (unsigned int i = 0; i < ram.length(); i++) {
+            batchSize += HEADER_LENGTH + ram[i].topic.length() + ram[i].msg.length();
+        }
+        if (fileSize && fileSize + batchSize > maxSize) {
+            compact();
+        }
+        fs::File f = getFS().open(filename, "a");
+        if (!f) {
+            DBG("outbox: ERROR - failed to open " + filename);
+            return;
+        }
+        ++statFlushes;
+        if (acked > loggedAck && fileSize) {
+            writeAck(f, acked);
+        }
+        loggedAck = acked;
+        for (unsigned int i = 0; i < ram.length(); i++) {
+            T_ENTRY &entry = ram[i];
+            unsigned long len = HEADER_LENGTH + entry.topic.length() + entry.msg.length();
+            if (fileSize + len > maxSize) {
+                // the log is full of unconfirmed messages
+                ++statDropped;
+                continue;
+            }
+            uint8_t header[HEADER_LENGTH];
+            header[0] = 'M';
+            setUint32(header + 1, entry.seq);
+            setUint16(header + 5, entry.topic.length());
+            setUint16(header + 7, entry.msg.length());
+            f.write(header, HEADER_LENGTH);
+            f.write((const uint8_t *)entry.topic.c_str(), entry.topic.length());
+            f.write((const uint8_t *)entry.msg.c_str(), entry.msg.length());
+            fileSize += len;
+            statBytesWritten += len;
+            logged = entry.seq;
+        }
+        f.close();
+        ram.erase();
+    }
+
+  private:
+    fs::FS &getFS() {
+#ifdef __USE_SPIFFS_FS__
+        return SPIFFS;
+#else
+        return LittleFS;
+#endif
+    }
+
+    void setDirty() {
+        if (!dirty) {
+            dirty = true;
+            dirtySince = millis();
+        }
+    }
+
+    static void setUint16(uint8_t *p, uint16_t val) {
+        p[0] = val & 0xff;
+        p[1] = val >> 8;
+    }
+
+    static void setUint32(uint8_t *p, uint32_t val) {
+        for (int i = 0; i < 4; i++) {
+            p[i] = (val >> (8 * i)) & 0xff;
+        }
+    }
+
+    static uint16_t getUint16(const uint8_t *p) {
+        return p[0] | (p[1] << 8);
+    }
+
+    static uint32_t getUint32(const uint8_t *p) {
+        return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    void writeAck(fs::File &f, uint32_t seq) {
+        uint8_t record[ACK_LENGTH];
+        record[0] = 'A';
+        setUint32(record + 1, seq);
+        f.write(record, ACK_LENGTH);
+        fileSize += ACK_LENGTH;
+        statBytesWritten += ACK_LENGTH;
+    }
+
+    bool readHeader(fs::File &f, unsigned long size, uint8_t &type, uint32_t &seq,
+                    unsigned int &topicLength, unsigned int &msgLength) {
+        // reads the header of the next complete record
+        unsigned long pos = f.position();
+        uint8_t header[HEADER_LENGTH];
+        if (pos + ACK_LENGTH > size || f.read(header, ACK_LENGTH) != ACK_LENGTH) {
+            return false;
+        }
+        type = header[0];
+        seq = getUint32(header + 1);
+        topicLength = msgLength = 0;
+        if (type == 'A') {
+            return true;
+        }
+        if (type != 'M' || pos + HEADER_LENGTH > size ||
+            f.read(header + ACK_LENGTH, HEADER_LENGTH - ACK_LENGTH) !=
+                HEADER_LENGTH - ACK_LENGTH) {
+            return false;
+        }
+        topicLength = getUint16(header + 5);
+        msgLength = getUint16(header + 7);
+        return pos + HEADER_LENGTH + topicLength + msgLength <= size;
+    }
+
+    static bool readString(fs::File &f, unsigned int length, String &value) {
+        char *buf = (char *)malloc(length + 1);
+        if (buf == nullptr) {
+            return false;
+        }
+        bool ok = f.read((uint8_t *)buf, length) == length;
+        buf[length] = 0;
+        value = buf;
+        free(buf);
+        return ok;
+    }
+
+    void scan() {
+        fileSize = 0;
+        logged = 0;
+        loggedAck = 0;
+        fs::File f = getFS().open(filename, "r");
+        if (!f) {
+            return;
+        }
+        unsigned long size = f.size();
+        unsigned long valid = 0;
+        uint8_t type;
+        uint32_t seq;
+        unsigned int topicLength, msgLength;
+        while (readHeader(f, size, type, seq, topicLength, msgLength)) {
+            if (type == 'M') {
+                f.seek(f.position() + topicLength + msgLength);
+                if (seq > logged) {
+                    logged = seq;
+                }
+            } else if (seq > loggedAck) {
+                loggedAck = seq;
+            }
+            valid = f.position();
+        }
+        f.close();
+        nextSeq = logged + 1;
+        acked = sent = loggedAck;
+        fileSize = valid;
+        if (logged <= acked) {
+            getFS().remove(filename);
+            fileSize = 0;
+        } else if (valid < size) {
+            // partially written record: appending behind it would corrupt the log
+            compact();
+        }
+    }
+
+    unsigned int replay(T_PUBLISH pub, unsigned int maxMessages) {
+        fs::File f = getFS().open(filename, "r");
+        if (!f) {
+            DBG("outbox: ERROR - failed to open " + filename);
+            sent = logged;
+            return 0;
+        }
+        unsigned long size = fileSize;
+        unsigned int count = 0;
+        uint8_t type;
+        uint32_t seq;
+        unsigned int topicLength, msgLength;
+        f.seek(readOffset);
+        while (count < maxMessages && sent < logged) {
+            if (!readHeader(f, size, type, seq, topicLength, msgLength)) {
+                // end of the log
+                sent = logged;
+                break;
+            }
+            if (type == 'M' && seq > sent) {
+                String topic, msg;
+                if (!readString(f, topicLength, topic) || !readString(f, msgLength, msg)) {
+                    sent = logged;
+                    break;
+                }
+                if (!pub(topic, msg)) {
+                    // tried again with the next call
+                    break;
+                }
+                sent = seq;
+                ++count;
+            } else {
+                f.seek(f.position() + topicLength + msgLength);
+            }
+            readOffset = f.position();
+        }
+        f.close();
+        return count;
+    }
+
+    void compact() {
+        // rewrite the unconfirmed messages into a new log
+        String tmpName = filename + ".tmp";
+        fs::File in = getFS().open(filename, "r");
+        fs::File out = getFS().open(tmpName, "w");
+        if (!in || !out) {
+            DBG("outbox: ERROR - failed to compact " + filename);
+            return;
+        }
+        ++statCompactions;
+        unsigned long size = fileSize;
+        fileSize = 0;
+        writeAck(out, acked);
+        uint8_t type;
+        uint32_t seq;
+        unsigned int topicLength, msgLength;
+        uint8_t buf[64];
+        bool complete = true;
+        while (complete) {
+            unsigned long pos = in.position();
+            if (!readHeader(in, size, type, seq, topicLength, msgLength)) {
+                break;
+            }
+            if (type != 'M' || seq <= acked) {
+                in.seek(in.position() + topicLength + msgLength);
+                continue;
+            }
+            // copy the complete record
+            in.seek(pos);
+            for (unsigned long left = HEADER_LENGTH + topicLength + msgLength; left;) {
+                size_t n = left < sizeof(buf) ? left : sizeof(buf);
+                if (in.read(buf, n) != n) {
+                    complete = false;
+                    break;
+                }
+                out.write(buf, n);
+                left -= n;
+                fileSize += n;
+                statBytesWritten += n;
+            }
+        }
+        in.close();
+        out.close();
+        if (!complete) {
+            // read error within a record: the rest of the log cannot be parsed, keep it as it is
+            DBG("outbox: ERROR - failed to read " + filename + ", not compacted");
+            getFS().remove(tmpName);
+            fileSize = size;
+            return;
+        }
+        getFS().remove(filename);
+        getFS().rename(tmpName, filename);
+        loggedAck = acked;
+        readOffset = 0;
+    }
+};
+
+}  // namespace ustd
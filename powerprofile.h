@@ -0,0 +1,107 @@
+// powerprofile.h
+#pragma once
+
+#include "ustd_platform.h"
+
+namespace ustd {
+
+/*! \brief munet PowerProfile helpers
+
+The power profile coordinates the task periods of all munet tasks. It is selected by publishing
+`performance`, `balanced` or `lowpower` to `net/power/set`. Net applies the WiFi sleep mode and
+publishes the active profile on `net/power`:
+
+\code{json}
+{"profile": "balanced", "wakeups": 215}
+\endcode
+
+Mqtt, Ota, Web and MuSerial subscribe to `net/power` and adjust their task periods. `wakeups` is
+the number of munet task invocations per second, measured over the last 10 seconds.
+
+* `performance`: the default, all tasks run at full rate and WiFi sleep is disabled
+* `balanced`: tasks run every 10-100ms, WiFi modem sleep is enabled
+* `lowpower`: tasks run every 50-1000ms, WiFi light sleep is enabled on ESP8266
+
+The profile can be preset with the option `power` in `net.json`.
+*/
+class PowerProfile {
+  public:
+    enum Profile { PERFORMANCE, BALANCED, LOWPOWER };
+
+    static Profile fromString(String val, Profile defVal = PERFORMANCE) {
+        /*! Get a profile from its name
+         *
+         * @param val Name of the profile: `performance`, `balanced` or `lowpower`
+         * @param defVal (optional, default PERFORMANCE) Profile returned for unknown names
+         * @return The profile
+         */
+        val.toLowerCase();
+        if (val == "performance") {
+            return PERFORMANCE;
+        } else if (val == "balanced") {
+            return BALANCED;
+        } else if (val == "lowpower") {
+            return LOWPOWER;
+        }
+        return defVal;
+    }
+
+    static const char *toString(Profile val) {
+        /*! Get the name of a profile */
+        switch (val) {
+        default:
+        case PERFORMANCE:
+            return "performance";
+        case BALANCED:
+            return "balanced";
+        case LOWPOWER:
+            return "lowpower";
+        }
+    }
+
+    static Profile fromMessage(const String &msg) {
+        /*! Get the profile from a `net/power` message */
+        // no JSON parser required, the message is generated by Net and also used on small MCUs
+        int start = msg.indexOf("\"profile\":\"");
+        if (start == -1) {
+            return PERFORMANCE;
+        }
+        start += 11;
+        int end = msg.indexOf('"', start);
+        return fromString(end == -1 ? "" : msg.substring(start, end));
+    }
+
+    static unsigned long select(Profile val, unsigned long performance, unsigned long balanced,
+                                unsigned long lowpower) {
+        /*! Select the value that belongs to a profile, e.g. a task period */
+        switch (val) {
+        default:
+        case PERFORMANCE:
+            return performance;
+        case BALANCED:
+            return balanced;
+        case LOWPOWER:
+            return lowpower;
+        }
+    }
+
+    static void countWakeup() {
+        /*! Count an invocation of a munet task */
+        ++wakeupCounter();
+    }
+
+    static unsigned long getWakeups() {
+        /*! Get the number of munet task invocations since start */
+        return wakeupCounter();
+    }
+
+  private:
+    static unsigned long &wakeupCounter() {
+        // a function-local static instead of a static member: shared by all translation units of
+        // the header-only library without a definition in a .cpp file
+        static unsigned long counter = 0;
+        return counter;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,317 @@
+// topictree.h
+#pragma once
+
+#include "ustd_platform.h"
+#include "ustd_array.h"
+
+namespace ustd {
+
+/*! \brief munet TopicTree Class
+
+The TopicTree class holds a set of MQTT topic filters in a precompiled tree of topic levels.
+Filters may contain the MQTT wildcards `+` (exactly one topic level) and `#` (any number of
+remaining topic levels, must be the last level of a filter). Each filter carries an integer
+value that is returned when a topic matches the filter.
+
+Testing a topic against all filters of the tree requires a single walk over the levels of the
+topic instead of calling `Scheduler::mqttmatch()` for every filter. The tree is updated
+incrementally when filters are added or removed.
+
+If a topic matches more than one filter, the most specific filter wins: on every level a literal
+match is preferred over `+`, and `+` is preferred over `#`.
+
+\code{cpp}
+ustd::TopicTree blocks;
+
+blocks.add("sensor/+/temperature");
+blocks.add("debug/#");
+
+if (blocks.match("debug/mqtt/state")) {
+    // blocked...
+}
+\endcode
+*/
+class TopicTree {
+  private:
+    typedef struct t_node {
+        String level;  // name of the topic level (literal nodes only)
+        int child;     // first literal child node or -1
+        int next;      // next literal sibling node (or next free node) or -1
+        int plus;      // `+` child node or -1
+        int hash;      // `#` child node or -1
+        int parent;    // parent node or -1 for root
+        int value;     // value of the filter ending in this node or -1
+    } T_NODE;
+
+    ustd::array<T_NODE> nodes;
+    int freeList = -1;
+    unsigned int filters = 0;
+
+  public:
+    TopicTree() {
+        /*! Instantiate an empty topic filter tree */
+        newNode("", -1);
+    }
+
+    ~TopicTree() {
+    }
+
+    bool add(String filter, int value = 0) {
+        /*! Add a topic filter to the tree
+         *
+         * @param filter MQTT topic filter, may contain the wildcards `+` and `#`.
+         * @param value (optional, default 0) Positive value returned by `find()` if a topic
+         * matches this filter. Adding an already existing filter updates its value.
+         * @return `true` on success, `false` if the filter is invalid or no memory is left.
+         */
+        if (value < 0 || !isValidFilter(filter.c_str())) {
+            return false;
+        }
+        int node = 0;
+        const char *level = filter.c_str();
+        while (level) {
+            const char *sep = strchr(level, '/');
+            unsigned int len = sep ? (unsigned int)(sep - level) : strlen(level);
+            node = addLevel(node, level, len);
+            if (node == -1) {
+                return false;
+            }
+            level = sep ? sep + 1 : nullptr;
+        }
+        if (nodes[node].value == -1) {
+            ++filters;
+        }
+        nodes[node].value = value;
+        return true;
+    }
+
+    bool remove(String filter) {
+        /*! Remove a topic filter from the tree
+         *
+         * @param filter MQTT topic filter, must be identical to a filter added with `add()`.
+         * @return `true` on success, `false` if the filter is not part of the tree.
+         */
+        int node = 0;
+        const char *level = filter.c_str();
+        while (level && node != -1) {
+            const char *sep = strchr(level, '/');
+            unsigned int len = sep ? (unsigned int)(sep - level) : strlen(level);
+            node = findLevel(node, level, len);
+            level = sep ? sep + 1 : nullptr;
+        }
+        if (node == -1 || nodes[node].value == -1) {
+            return false;
+        }
+        nodes[node].value = -1;
+        --filters;
+        prune(node);
+        return true;
+    }
+
+    void clear() {
+        /*! Remove all topic filters from the tree */
+        nodes.erase();
+        freeList = -1;
+        filters = 0;
+        newNode("", -1);
+    }
+
+    unsigned int length() {
+        /*! Get the number of topic filters in the tree
+         *
+         * @return Number of topic filters.
+         */
+        return filters;
+    }
+
+    bool match(const char *topic) {
+        /*! Check if a topic is matched by any filter of the tree
+         *
+         * @param topic The topic (without wildcards) to check.
+         * @return `true` if at least one filter matches the topic.
+         */
+        return find(topic) != -1;
+    }
+
+    bool match(const String &topic) {
+        /*! Check if a topic is matched by any filter of the tree
+         *
+         * @param topic The topic (without wildcards) to check.
+         * @return `true` if at least one filter matches the topic.
+         */
+        return find(topic.c_str()) != -1;
+    }
+
+    int find(const char *topic) {
+        /*! Find the most specific filter matching a topic
+         *
+         * @param topic The topic (without wildcards) to check.
+         * @return The value of the best matching filter or -1 if no filter matches.
+         */
+        if (filters == 0 || topic == nullptr) {
+            return -1;
+        }
+        return findTopic(0, topic);
+    }
+
+  private:
+    static bool isValidFilter(const char *filter) {
+        if (*filter == 0) {
+            return false;
+        }
+        for (const char *p = filter; *p; p++) {
+            if (*p == '#') {
+                // `#` must occupy a whole level and must be the last level
+                if (p[1] != 0 || (p != filter && p[-1] != '/')) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    int newNode(const char *level, unsigned int len, int parent) {
+        T_NODE node;
+        int index;
+        if (freeList != -1) {
+            index = freeList;
+            freeList = nodes[index].next;
+        } else {
+            index = nodes.add(node);
+            if (index == -1) {
+                return -1;
+            }
+        }
+        T_NODE &n = nodes[index];
+        n.level = "";
+        n.level.concat(level, len);
+        n.child = -1;
+        n.next = -1;
+        n.plus = -1;
+        n.hash = -1;
+        n.parent = parent;
+        n.value = -1;
+        return index;
+    }
+
+    int newNode(const char *level, int parent) {
+        return newNode(level, strlen(level), parent);
+    }
+
+    static bool isLevel(const char *level, unsigned int len, char wildcard) {
+        return len == 1 && level[0] == wildcard;
+    }
+
+    bool isNamed(int node, const char *level, unsigned int len) {
+        const String &name = nodes[node].level;
+        return name.length() == len && strncmp(name.c_str(), level, len) == 0;
+    }
+
+    int findLevel(int parent, const char *level, unsigned int len) {
+        if (isLevel(level, len, '+')) {
+            return nodes[parent].plus;
+        }
+        if (isLevel(level, len, '#')) {
+            return nodes[parent].hash;
+        }
+        for (int c = nodes[parent].child; c != -1; c = nodes[c].next) {
+            if (isNamed(c, level, len)) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    int addLevel(int parent, const char *level, unsigned int len) {
+        int node = findLevel(parent, level, len);
+        if (node != -1) {
+            return node;
+        }
+        node = newNode(level, len, parent);
+        if (node == -1) {
+            return -1;
+        }
+        if (isLevel(level, len, '+')) {
+            nodes[parent].plus = node;
+        } else if (isLevel(level, len, '#')) {
+            nodes[parent].hash = node;
+        } else {
+            nodes[node].next = nodes[parent].child;
+            nodes[parent].child = node;
+        }
+        return node;
+    }
+
+    void prune(int node) {
+        while (node > 0) {
+            T_NODE &n = nodes[node];
+            if (n.value != -1 || n.child != -1 || n.plus != -1 || n.hash != -1) {
+                return;
+            }
+            int parent = n.parent;
+            T_NODE &p = nodes[parent];
+            if (p.plus == node) {
+                p.plus = -1;
+            } else if (p.hash == node) {
+                p.hash = -1;
+            } else if (p.child == node) {
+                p.child = n.next;
+            } else {
+                for (int c = p.child; c != -1; c = nodes[c].next) {
+                    if (nodes[c].next == node) {
+                        nodes[c].next = n.next;
+                        break;
+                    }
+                }
+            }
+            n.level = "";
+            n.parent = -1;
+            n.next = freeList;
+            freeList = node;
+            node = parent;
+        }
+    }
+
+    int findTopic(int parent, const char *level) {
+        // `level` points to the current topic level, `parent` holds the candidate filter levels
+        const char *sep = strchr(level, '/');
+        unsigned int len = sep ? (unsigned int)(sep - level) : strlen(level);
+        int value;
+        for (int c = nodes[parent].child; c != -1; c = nodes[c].next) {
+            if (isNamed(c, level, len)) {
+                value = findNext(c, sep);
+                if (value != -1) {
+                    return value;
+                }
+                break;
+            }
+        }
+        if (nodes[parent].plus != -1) {
+            value = findNext(nodes[parent].plus, sep);
+            if (value != -1) {
+                return value;
+            }
+        }
+        if (nodes[parent].hash != -1) {
+            return nodes[nodes[parent].hash].value;
+        }
+        return -1;
+    }
+
+    int findNext(int node, const char *sep) {
+        if (sep) {
+            return findTopic(node, sep + 1);
+        }
+        // end of topic: the filter must end here - or continue with `#` that also matches the
+        // parent level (e.g. `sensor/#` matches `sensor`)
+        if (nodes[node].value != -1) {
+            return nodes[node].value;
+        }
+        if (nodes[node].hash != -1) {
+            return nodes[nodes[node].hash].value;
+        }
+        return -1;
+    }
+};
+
+}  // namespace ustd
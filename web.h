@@ -5,7 +5,18 @@
 
 #include "ustd_platform.h"
 
+#if defined(__USE_ASYNC_WEBSERVER__)
+// asynchronous backend: several concurrent connections, files are streamed in chunks from the
+// TCP stack without blocking the scheduler
 #if defined(__ESP32__) || defined(__ESP32_RISC__)
+#include <AsyncTCP.h>
+#include <ESPmDNS.h>
+#else
+#include <ESPAsyncTCP.h>
+#include <ESP8266mDNS.h>
+#endif
+#include <ESPAsyncWebServer.h>
+#elif defined(__ESP32__) || defined(__ESP32_RISC__)
 #include <WiFiClient.h>
 #include <WebServer.h>
 #include <ESPmDNS.h>
@@ -17,17 +28,551 @@
 
 #include "ustd_array.h"
 #include "ustd_map.h"
+#include "timeout.h"
+#include "jsonfile.h"
 #include "scheduler.h"
+#include "powerprofile.h"
+#include "netstate.h"
+
+#ifndef WEB_CACHE_SIZE
+#if defined(__ESP32__) || defined(__ESP32_RISC__)
+#define WEB_CACHE_SIZE 32768  // default byte budget of the file cache
+#else
+#define WEB_CACHE_SIZE 8192
+#endif
+#endif
+
+#ifndef WEB_EVENT_BUFFER
+#define WEB_EVENT_BUFFER 2048  // max. bytes of events waiting for a browser (async backend)
+#endif
+
+#ifndef WEB_MAX_REPLY_TOPICS
+#define WEB_MAX_REPLY_TOPICS 8  // max. number of reply topics of a /pubsub request
+#endif
+static_assert(WEB_MAX_REPLY_TOPICS <= 16, "WEB_MAX_REPLY_TOPICS exceeds the reply bit mask");
 
 namespace ustd {
 class Web {
+  private:
+    typedef struct t_mime_type {
+        const char *ext;
+        const char *type;
+        long maxAge;  // Cache-Control max-age in seconds, 0: always revalidate (ETag)
+    } T_MIME_TYPE;
+
+    const T_MIME_TYPE *getMimeType(const String &fileName) {
+        static const T_MIME_TYPE mimeTypes[] = {
+            {".html", "text/html", 0},
+            {".htm", "text/html", 0},
+            {".css", "text/css", 86400},
+            {".js", "application/javascript", 86400},
+            {".json", "application/json", 0},
+            {".png", "image/png", 604800},
+            {".jpg", "image/jpeg", 604800},
+            {".gif", "image/gif", 604800},
+            {".svg", "image/svg+xml", 604800},
+            {".ico", "image/x-icon", 604800},
+            {".woff", "font/woff", 604800},
+            {".woff2", "font/woff2", 604800},
+            {".txt", "text/plain", 0},
+        };
+        static const T_MIME_TYPE defaultType = {"", "text/plain", 0};
+        int dot = fileName.lastIndexOf('.');
+        if (dot != -1) {
+            const char *ext = fileName.c_str() + dot;
+            for (unsigned int i = 0; i < sizeof(mimeTypes) / sizeof(mimeTypes[0]); i++) {
+                if (!strcmp(ext, mimeTypes[i].ext)) {
+                    return &mimeTypes[i];
+                }
+            }
+        }
+        return &defaultType;
+    }
+
+    fs::FS &getFS() {
+#ifdef __USE_SPIFFS_FS__
+        return SPIFFS;
+#else
+        return LittleFS;
+#endif
+    }
+
+    static String getHttpDate(time_t t) {
+        char buf[32];
+        struct tm *ptm = gmtime(&t);
+        if (ptm == nullptr) {
+            return "";
+        }
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", ptm);
+        return buf;
+    }
+
+    static String getETag(size_t size, time_t lastWrite, bool gzip) {
+        return "\"" + String((unsigned long)size, 16) + "-" + String((unsigned long)lastWrite, 16) +
+               (gzip ? "-gz\"" : "\"");
+    }
+
+    // file cache: results of file system lookups (including missing files) and the contents of
+    // small files, least recently used entries are dropped first
+    typedef struct t_cache_entry {
+        String path;
+        bool exists;
+        size_t size;
+        time_t lastWrite;
+        uint8_t *data;  // file contents or nullptr if not cached
+        unsigned long lastUse;
+    } T_CACHE_ENTRY;
+    ustd::array<T_CACHE_ENTRY> fileCache;
+    unsigned long cacheUsed = 0;
+    unsigned long cacheTick = 0;
+
+    static unsigned long getCacheCost(const T_CACHE_ENTRY &entry) {
+        return sizeof(T_CACHE_ENTRY) + entry.path.length() + (entry.data ? entry.size : 0);
+    }
+
+    void dropCacheEntry(unsigned int i) {
+        cacheUsed -= getCacheCost(fileCache[i]);
+        if (fileCache[i].data) {
+            free(fileCache[i].data);
+        }
+        fileCache.erase(i);
+    }
+
+    unsigned int trimCache(unsigned int keep) {
+        // drop least recently used entries until the budget fits, entry `keep` stays
+        while (cacheUsed > cacheBudget && fileCache.length() > 1) {
+            unsigned int oldest = keep == 0 ? 1 : 0;
+            for (unsigned int i = 0; i < fileCache.length(); i++) {
+                if (i != keep && fileCache[i].lastUse < fileCache[oldest].lastUse) {
+                    oldest = i;
+                }
+            }
+            dropCacheEntry(oldest);
+            if (oldest < keep) {
+                --keep;
+            }
+        }
+        return keep;
+    }
+
+    int getCacheEntry(const String &path) {
+        // the returned entry stays valid until the next call
+        for (unsigned int i = 0; i < fileCache.length(); i++) {
+            if (fileCache[i].path == path) {
+                fileCache[i].lastUse = ++cacheTick;
+                return i;
+            }
+        }
+        T_CACHE_ENTRY entry = {path, false, 0, 0, nullptr, ++cacheTick};
+        entry.exists = getFS().exists(path);
+        if (entry.exists) {
+            fs::File f = getFS().open(path, "r");
+            if (!f) {
+                return -1;
+            }
+            entry.size = f.size();
+            entry.lastWrite = f.getLastWrite();
+            if (entry.size <= cacheBudget / 4) {
+                entry.data = (uint8_t *)malloc(entry.size ? entry.size : 1);
+                if (entry.data && f.read(entry.data, entry.size) != entry.size) {
+                    free(entry.data);
+                    entry.data = nullptr;
+                }
+            }
+            f.close();
+        }
+        int i = fileCache.add(entry);
+        if (i == -1) {
+            if (entry.data) {
+                free(entry.data);
+            }
+            return -1;
+        }
+        cacheUsed += getCacheCost(entry);
+        return trimCache(i);
+    }
+
+    bool fileExists(const String &path) {
+        int i = getCacheEntry(path);
+        return i != -1 && fileCache[i].exists;
+    }
+
+    static bool isNotModified(const String &etag, const String &lastModified,
+                              const String *pIfNoneMatch, const String *pIfModifiedSince) {
+        // If-None-Match takes precedence over If-Modified-Since
+        if (pIfNoneMatch) {
+            return *pIfNoneMatch == etag;
+        }
+        return pIfModifiedSince && lastModified.length() && *pIfModifiedSince == lastModified;
+    }
+
+    static String getCacheControl(const T_MIME_TYPE *pMime) {
+        return pMime->maxAge ? "max-age=" + String(pMime->maxAge) : "no-cache";
+    }
+
+    // server-sent events: messages of the event subscriptions are pushed to the browsers
+#if defined(__USE_ASYNC_WEBSERVER__)
+    // the web task only appends to the buffers, they are written from the TCP stack
+    typedef struct t_event_client {
+        int id;
+        String pending;
+    } T_EVENT_CLIENT;
+    ustd::array<T_EVENT_CLIENT> eventClients;
+    int eventClientId = 0;
+#else
+    ustd::array<WiFiClient> eventClients;
+#endif
+    ustd::timeout eventKeepAlive = 15000L;
+
+    static String getMessageJson(const String &topic, const String &msg) {
+        // a single line JSON object, newlines within the message are escaped
+        JSONVar event;
+        event["topic"] = topic;
+        event["msg"] = msg;
+        return JSON.stringify(event);
+    }
+
+    void sendEvent(String topic, String msg) {
+        if (!webUp) {
+            return;
+        }
+        String data = "data: " + getMessageJson(topic, msg) + "\n\n";
+        writeEventClients(data);
+    }
+
+#if defined(__USE_ASYNC_WEBSERVER__)
+    void writeEventClients(const String &data) {
+        lockDeferred();
+        for (unsigned int i = 0; i < eventClients.length(); i++) {
+            // a slow browser loses events instead of filling the heap
+            String &pending = eventClients[i].pending;
+            if (pending.length() + data.length() <= WEB_EVENT_BUFFER) {
+                pending += data;
+            }
+        }
+        unlockDeferred();
+    }
+
+    int findEventClient(int id) {
+        for (unsigned int i = 0; i < eventClients.length(); i++) {
+            if (eventClients[i].id == id) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void handleEventConnect(AsyncWebServerRequest *request) {
+        lockDeferred();
+        int id = -1;
+        if (eventClients.length() < maxEventClients) {
+            T_EVENT_CLIENT client = {++eventClientId, ":\n\n"};
+            if (eventClients.add(client) != -1) {
+                id = client.id;
+            }
+        }
+        unlockDeferred();
+        if (id == -1) {
+            request->send(503, "text/plain", "Too many event clients");
+            return;
+        }
+        // the stream is filled by the TCP stack whenever it can send, from the buffer of the
+        // client
+        AsyncWebServerResponse *response = request->beginChunkedResponse(
+            "text/event-stream", [this, id](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+                lockDeferred();
+                size_t len = RESPONSE_TRY_AGAIN;
+                int i = findEventClient(id);
+                if (i == -1) {
+                    len = 0;
+                } else if (eventClients[i].pending.length()) {
+                    String &pending = eventClients[i].pending;
+                    len = pending.length() < maxLen ? pending.length() : maxLen;
+                    memcpy(buf, pending.c_str(), len);
+                    pending.remove(0, len);
+                }
+                unlockDeferred();
+                return len;
+            });
+        response->addHeader("Cache-Control", "no-cache");
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        request->onDisconnect([this, id]() {
+            lockDeferred();
+            int i = findEventClient(id);
+            if (i != -1) {
+                eventClients.erase(i);
+            }
+            unlockDeferred();
+        });
+        request->send(response);
+    }
+#endif
+
+#if !defined(__USE_ASYNC_WEBSERVER__)
+    void writeEventClients(const String &data) {
+        for (unsigned int i = 0; i < eventClients.length();) {
+            WiFiClient &client = eventClients[i];
+            if (!client.connected()) {
+                client.stop();
+                eventClients.erase(i);
+                continue;
+            }
+            // a slow browser loses events instead of blocking the scheduler
+            if ((unsigned int)client.availableForWrite() >= data.length()) {
+                client.write(data.c_str(), data.length());
+            }
+            ++i;
+        }
+    }
+
+    void handleEventConnect() {
+        if (eventClients.length() >= maxEventClients) {
+            pWebServer->send(503, "text/plain", "Too many event clients");
+            return;
+        }
+        // the connection is kept open after the handler returns, the response is written
+        // directly to the client
+        WiFiClient client = pWebServer->client();
+        client.setNoDelay(true);
+        client.print("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                     "Cache-Control: no-cache\r\nConnection: keep-alive\r\n"
+                     "Access-Control-Allow-Origin: *\r\n\r\n");
+        eventClients.add(client);
+    }
+#endif
+
+    void handleEventPublish(String topic, String msg) {
+        // messages posted by a browser are published to the scheduler
+        if (topic.length()) {
+            publish(topic, msg);
+        }
+    }
+
+#if defined(__USE_ASYNC_WEBSERVER__) && (defined(__ESP32__) || defined(__ESP32_RISC__))
+    // protects the state shared between the async handlers and the web task
+    SemaphoreHandle_t deferredMutex = nullptr;
+#endif
+
+    void lockDeferred() {
+#if defined(__USE_ASYNC_WEBSERVER__) && (defined(__ESP32__) || defined(__ESP32_RISC__))
+        xSemaphoreTake(deferredMutex, portMAX_DELAY);
+#endif
+    }
+
+    void unlockDeferred() {
+#if defined(__USE_ASYNC_WEBSERVER__) && (defined(__ESP32__) || defined(__ESP32_RISC__))
+        xSemaphoreGive(deferredMutex);
+#endif
+    }
+
+    // POST /pubsub requests that wait for replies
+    typedef struct t_pubsub {
+        int id;
+        bool started;    // reply topics subscribed and messages published
+        bool cancelled;  // connection closed by the client
+        unsigned long start;
+        unsigned long timeout;
+        JSONVar messages;
+        unsigned int topicCount;
+        String topics[WEB_MAX_REPLY_TOPICS];
+        int subs[WEB_MAX_REPLY_TOPICS];
+        uint16_t received;  // bit mask of the reply topics that received a message
+        String replies;
+#if defined(__USE_ASYNC_WEBSERVER__)
+        bool done;  // replies is the complete body, written from the TCP stack
+#else
+        WiFiClient client;
+#endif
+    } T_PUBSUB;
+    ustd::array<T_PUBSUB> pubsubRequests;
+    int pubsubId = 0;
+
+    bool parsePubsub(const String &body, const String &replyTopics, const String &timeout,
+                     T_PUBSUB &entry) {
+        // POST /pubsub?replies=<topic>[,<topic>...]&timeout=<ms> publishes all messages of the
+        // body [{"topic":"<topic>","msg":"<msg>"},...] and answers with the messages received on
+        // the reply topics [{"topic":"<topic>","msg":"<msg>"},...] when every reply topic got a
+        // message or the timeout (default 1000ms) expired
+        entry.messages = JSON.parse(body);
+        if (JSON.typeof(entry.messages) != "array") {
+            return false;
+        }
+        for (int i = 0; i < entry.messages.length(); i++) {
+            if (JSON.typeof(entry.messages[i]["topic"]) != "string") {
+                return false;
+            }
+        }
+        entry.started = false;
+        entry.cancelled = false;
+#if defined(__USE_ASYNC_WEBSERVER__)
+        entry.done = false;
+#endif
+        entry.start = millis();
+        entry.timeout = timeout.length() ? timeout.toInt() : 1000;
+        if (entry.timeout > 10000) {
+            entry.timeout = 10000;
+        }
+        entry.topicCount = 0;
+        entry.received = 0;
+        entry.replies = "";
+        int pos = 0;
+        while (pos < (int)replyTopics.length() && entry.topicCount < WEB_MAX_REPLY_TOPICS) {
+            int sep = replyTopics.indexOf(',', pos);
+            if (sep == -1) {
+                sep = replyTopics.length();
+            }
+            if (sep > pos) {
+                entry.topics[entry.topicCount++] = replyTopics.substring(pos, sep);
+            }
+            pos = sep + 1;
+        }
+        return true;
+    }
+
+    static String getMessageValue(JSONVar value) {
+        // messages can be given as string or as any JSON value
+        if (JSON.typeof(value) == "string") {
+            return (const char *)value;
+        }
+        if (JSON.typeof(value) == "undefined") {
+            return "";
+        }
+        return JSON.stringify(value);
+    }
+
+    void publishMessages(JSONVar &messages) {
+        for (int i = 0; i < messages.length(); i++) {
+            pSched->publish((const char *)messages[i]["topic"],
+                            getMessageValue(messages[i]["msg"]), "web");
+        }
+    }
+
+    int findPubsub(int id) {
+        for (unsigned int i = 0; i < pubsubRequests.length(); i++) {
+            if (pubsubRequests[i].id == id) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void startPubsub(T_PUBSUB &entry) {
+        // subscribe before publishing, the scheduler delivers published messages later
+        for (unsigned int t = 0; t < entry.topicCount; t++) {
+            int id = entry.id;
+            entry.subs[t] = pSched->subscribe(
+                tID, entry.topics[t], [this, id, t](String topic, String msg, String originator) {
+                    this->onPubsubReply(id, t, topic, msg);
+                });
+        }
+        publishMessages(entry.messages);
+        entry.started = true;
+    }
+
+    void onPubsubReply(int id, unsigned int t, String &topic, String &msg) {
+        lockDeferred();
+        int i = findPubsub(id);
+        if (i != -1 && pubsubRequests[i].replies.length() < 4096) {
+            T_PUBSUB &entry = pubsubRequests[i];
+            if (entry.replies.length()) {
+                entry.replies += ",";
+            }
+            entry.replies += getMessageJson(topic, msg);
+            entry.received |= (uint16_t)(1 << t);
+        }
+        unlockDeferred();
+    }
+
+    void finishPubsub(unsigned int i) {
+        T_PUBSUB &entry = pubsubRequests[i];
+        for (unsigned int t = 0; t < entry.topicCount; t++) {
+            pSched->unsubscribe(entry.subs[t]);
+        }
+#if defined(__USE_ASYNC_WEBSERVER__)
+        if (!entry.cancelled) {
+            // the response is written by the TCP stack, which removes the entry
+            entry.replies = "[" + entry.replies + "]";
+            entry.done = true;
+            return;
+        }
+#else
+        if (!entry.cancelled) {
+            String body = "[" + entry.replies + "]";
+            // the deferred response is written directly to the client
+            entry.client.print("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                               "Connection: close\r\nContent-Length: " +
+                               String(body.length()) + "\r\n\r\n");
+            entry.client.print(body);
+            entry.client.stop();
+        }
+#endif
+        pubsubRequests.erase(i);
+    }
+
+    void processPubsub() {
+        lockDeferred();
+        for (unsigned int i = 0; i < pubsubRequests.length();) {
+            T_PUBSUB &entry = pubsubRequests[i];
+#if defined(__USE_ASYNC_WEBSERVER__)
+            if (entry.done) {
+                if (entry.cancelled) {
+                    pubsubRequests.erase(i);
+                    continue;
+                }
+                ++i;
+                continue;
+            }
+#endif
+            if (!entry.started) {
+                startPubsub(entry);
+            }
+#if !defined(__USE_ASYNC_WEBSERVER__)
+            if (!entry.client.connected()) {
+                entry.cancelled = true;
+            }
+#endif
+            if (entry.cancelled || entry.received == (1 << entry.topicCount) - 1 ||
+                millis() - entry.start > entry.timeout) {
+                finishPubsub(i);
+                continue;
+            }
+            ++i;
+        }
+        unlockDeferred();
+    }
+
+#if defined(__USE_ASYNC_WEBSERVER__)
+    // async handlers run outside of the scheduler task: messages are published from loop()
+    typedef struct t_deferred {
+        String topic;
+        String msg;
+    } T_DEFERRED;
+    ustd::array<T_DEFERRED> deferred;
+
+    void publishDeferred() {
+        while (deferred.length()) {
+            lockDeferred();
+            T_DEFERRED msg = deferred[0];
+            deferred.erase(0);
+            unlockDeferred();
+            pSched->publish(msg.topic, msg.msg, "web");
+        }
+    }
+#endif
+
   public:
     Scheduler *pSched;
     int tID;
     bool netUp = false;
     bool webUp = false;
     String webServer;
-#if defined(__ESP32__) || defined(__ESP32_RISC__)
+    unsigned int maxEventClients = 4;  // max. number of concurrent event stream connections
+    unsigned int maxPubsubRequests = 4;  // max. number of /pubsub requests waiting for replies
+    unsigned long cacheBudget = WEB_CACHE_SIZE;  // bytes of RAM used by the file cache
+    bool allowPublish = false;  // browsers may publish via POST /events and /pubsub (web.json)
+#if defined(__USE_ASYNC_WEBSERVER__)
+    AsyncWebServer *pWebServer;
+#elif defined(__ESP32__) || defined(__ESP32_RISC__)
     WebServer *pWebServer;
 #else
     ESP8266WebServer *pWebServer;
@@ -48,7 +593,12 @@ class Web {
         LittleFS.begin();
 #endif
 
+#if defined(__USE_ASYNC_WEBSERVER__)
+        pWebServer = new AsyncWebServer(80);
 #if defined(__ESP32__) || defined(__ESP32_RISC__)
+        deferredMutex = xSemaphoreCreateMutex();
+#endif
+#elif defined(__ESP32__) || defined(__ESP32_RISC__)
         pWebServer = new WebServer(80);
 #else
         pWebServer = new ESP8266WebServer(80);
@@ -58,50 +608,343 @@ class Web {
         auto ft = [=]() { this->loop(); };
         tID = pSched->add(ft, "web");
 
-        auto fnall = [=](String topic, String msg, String originator) {
-            this->subsMsg(topic, msg, originator);
-        };
-        pSched->subscribe(tID, "net/network", fnall);
+        // the web server accepts messages from any browser in the network: publishing has to be
+        // enabled explicitly
+        ustd::jsonfile conf;
+        allowPublish = conf.readBool("web/allowPublish", false);
+        ustd::array<String> eventTopics;
+        conf.readStringArray("web/events", eventTopics);
+        for (unsigned int i = 0; i < eventTopics.length(); i++) {
+            addEventSubscription(eventTopics[i]);
+        }
+
+        pSched->subscribe(tID, "net/network", [=](String topic, String msg, String originator) {
+            this->onNetworkState(NetState::fromMessage(msg));
+        });
+        pSched->subscribe(tID, "ota/state", [=](String topic, String msg, String originator) {
+            this->onOtaState(msg);
+        });
+        pSched->subscribe(tID, "net/power", [=](String topic, String msg, String originator) {
+            pSched->reschedule(tID, PowerProfile::select(PowerProfile::fromMessage(msg), 0,
+                                                         10000L, 50000L));
+        });
 
         pSched->publish("net/network/get");
+        pSched->publish("net/power/get");
         // pSched->publish("net/services/webserver/get");
     }
 
-    void handleRoot() {
-        handleFileSystem();
+    void clearCache() {
+        /*! Drop all cached files and file system lookups
+         *
+         * The cache is cleared automatically on a file system update by OTA. Call this after
+         * changing files of the web server at runtime.
+         */
+        lockDeferred();
+        while (fileCache.length()) {
+            dropCacheEntry(fileCache.length() - 1);
+        }
+        unlockDeferred();
     }
+
     String getContentType(String fileName) {
-        if (fileName.endsWith(".html"))
-            return "text/html";
-        if (fileName.endsWith(".css"))
-            return "text/css";
-        if (fileName.endsWith(".png"))
-            return "image/png";
-        if (fileName.endsWith(".js"))
-            return "application/javascript";
-        if (fileName.endsWith(".ico"))
-            return "image/x-icon";
-        return "text/plain";
+        return getMimeType(fileName)->type;
+    }
+
+    void publish(String topic, String msg) {
+        /*! Publish a message from a request handler. With the async backend the message is
+         * published from the web task. */
+#if defined(__USE_ASYNC_WEBSERVER__)
+        T_DEFERRED entry = {topic, msg};
+        lockDeferred();
+        deferred.add(entry);
+        unlockDeferred();
+#else
+        pSched->publish(topic, msg);
+#endif
+    }
+
+    int addEventSubscription(String topic) {
+        /*! Push messages of a topic to the browsers connected to the event stream
+         *
+         * Messages of the scheduler that match the topic are sent as server-sent events to
+         * all browsers connected to `/events`. The event data is a JSON object
+         * `{"topic":"<topic>","msg":"<msg>"}`. The topics listed in `web/events` of `web.json`
+         * are subscribed by `begin()`. If `web/allowPublish` is `true`, browsers publish messages
+         * to the scheduler by posting the arguments `topic` and `msg` to `/events`.
+         *
+         * @param topic MQTT-style topic to be subscribed, can contain MQTT wildcards '#' and '+'.
+         * @return subscriptionHandle on success (needed for unsubscribe), or -1 on error.
+         */
+        return pSched->subscribe(tID, topic, [this](String topic, String msg, String originator) {
+            this->sendEvent(topic, msg);
+        });
+    }
+
+    bool removeEventSubscription(int subscriptionHandle) {
+        /*! Stop pushing the messages of an event subscription
+         *
+         * @param subscriptionHandle Handle as returned by `addEventSubscription()`.
+         * @return true on success.
+         */
+        return pSched->unsubscribe(subscriptionHandle);
+    }
+
+#if defined(__USE_ASYNC_WEBSERVER__)
+    void handleFileSystem(AsyncWebServerRequest *request) {
+        // the file cache is shared with the web task
+        lockDeferred();
+        serveFile(request);
+        unlockDeferred();
+    }
+
+    void serveFile(AsyncWebServerRequest *request) {
+        String fileName = request->url();
+        if (fileName == "/")
+            fileName = "/index.html";
+        const T_MIME_TYPE *pMime = getMimeType(fileName);
+        // serve a precompressed <file>.gz if available and accepted by the client
+        bool hasGzip = fileExists(fileName + ".gz");
+        bool gzip = hasGzip && request->hasHeader("Accept-Encoding") &&
+                    request->getHeader("Accept-Encoding")->value().indexOf("gzip") != -1;
+        if (!gzip && !fileExists(fileName)) {
+            handleNotFound(request);
+            return;
+        }
+        String path = gzip ? fileName + ".gz" : fileName;
+        int i = getCacheEntry(path);
+        if (i == -1) {
+            handleNotFound(request);
+            return;
+        }
+        const T_CACHE_ENTRY &entry = fileCache[i];
+        String etag = getETag(entry.size, entry.lastWrite, gzip);
+        String lastModified = entry.lastWrite ? getHttpDate(entry.lastWrite) : "";
+        const String *pIfNoneMatch = nullptr;
+        const String *pIfModifiedSince = nullptr;
+        if (request->hasHeader("If-None-Match")) {
+            pIfNoneMatch = &request->getHeader("If-None-Match")->value();
+        }
+        if (request->hasHeader("If-Modified-Since")) {
+            pIfModifiedSince = &request->getHeader("If-Modified-Since")->value();
+        }
+        AsyncWebServerResponse *response;
+        if (isNotModified(etag, lastModified, pIfNoneMatch, pIfModifiedSince)) {
+            // the client has a valid copy
+            response = request->beginResponse(304);
+        } else if (entry.data) {
+            // served from the cache, the response keeps its own copy of the data
+            AsyncResponseStream *stream = request->beginResponseStream(pMime->type);
+            stream->write(entry.data, entry.size);
+            if (gzip) {
+                stream->addHeader("Content-Encoding", "gzip");
+            }
+            response = stream;
+        } else {
+            fs::File f = getFS().open(path, "r");
+            if (!f) {
+                handleNotFound(request);
+                return;
+            }
+            // the file is streamed in chunks by the async server and closed when done, a .gz
+            // file with the original path gets Content-Encoding: gzip
+            response = request->beginResponse(f, fileName, pMime->type);
+        }
+        response->addHeader("ETag", etag);
+        if (lastModified.length()) {
+            response->addHeader("Last-Modified", lastModified);
+        }
+        response->addHeader("Cache-Control", getCacheControl(pMime));
+        if (hasGzip) {
+            response->addHeader("Vary", "Accept-Encoding");
+        }
+        request->send(response);
+    }
+
+    void handleNotFound(AsyncWebServerRequest *request) {
+        String message = "File Not Found\n\n";
+        message += "URI: ";
+        message += request->url();
+        message += "\nMethod: ";
+        message += (request->method() == HTTP_GET) ? "GET" : "POST";
+        message += "\nArguments: ";
+        message += request->args();
+        message += "\n";
+        for (uint8_t i = 0; i < request->args(); i++) {
+            message += " " + request->argName(i) + ": " + request->arg(i) + "\n";
+        }
+        request->send(404, "text/plain", message);
+    }
+
+    void initHandles() {
+        auto frt = [=](AsyncWebServerRequest *request) { this->handleFileSystem(request); };
+        pWebServer->on("/", HTTP_GET, frt);
+
+        pWebServer->on("/inline", HTTP_GET, [](AsyncWebServerRequest *request) {
+            request->send(200, "text/plain", "this works as well");
+        });
+
+        pWebServer->on("/result", HTTP_ANY, [=](AsyncWebServerRequest *request) {
+            JSONVar result;
+            result["ssid"] = request->arg("ssid");
+            result["hostname"] = request->arg("hostname");
+            String response = JSON.stringify(result);
+            request->send(200, "text/plain", response);
+            this->publish("webserver/data", response);
+        });
+
+        pWebServer->on("/events", HTTP_GET,
+                       [=](AsyncWebServerRequest *request) { this->handleEventConnect(request); });
+        pWebServer->on("/events", HTTP_POST, [=](AsyncWebServerRequest *request) {
+            if (!this->allowPublish) {
+                request->send(403, "text/plain", "Publishing is disabled");
+                return;
+            }
+            this->handleEventPublish(request->arg("topic"), request->arg("msg"));
+            request->send(200, "text/plain", "ok");
+        });
+
+        pWebServer->on(
+            "/pubsub", HTTP_POST, [=](AsyncWebServerRequest *request) { this->handlePubsub(request); },
+            nullptr,
+            [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index,
+               size_t total) {
+                // collect the body, the buffer is freed by the server with the request
+                if (index == 0) {
+                    request->_tempObject = malloc(total + 1);
+                }
+                if (request->_tempObject) {
+                    memcpy((char *)request->_tempObject + index, data, len);
+                    if (index + len == total) {
+                        ((char *)request->_tempObject)[total] = 0;
+                    }
+                }
+            });
+
+        pWebServer->onNotFound(frt);
+    }
+
+    void handlePubsub(AsyncWebServerRequest *request) {
+        if (!allowPublish) {
+            request->send(403, "text/plain", "Publishing is disabled");
+            return;
+        }
+        T_PUBSUB entry;
+        String body = request->_tempObject ? (const char *)request->_tempObject : "";
+        if (!parsePubsub(body, request->arg("replies"), request->arg("timeout"), entry)) {
+            request->send(400, "text/plain", "Expected [{\"topic\":...,\"msg\":...},...]");
+            return;
+        }
+        if (!entry.topicCount) {
+            for (int i = 0; i < entry.messages.length(); i++) {
+                publish((const char *)entry.messages[i]["topic"],
+                        getMessageValue(entry.messages[i]["msg"]));
+            }
+            request->send(200, "application/json", "[]");
+            return;
+        }
+        lockDeferred();
+        // the id is also read by the web task
+        entry.id = ++pubsubId;
+        bool queued = pubsubRequests.length() < maxPubsubRequests && pubsubRequests.add(entry) != -1;
+        unlockDeferred();
+        if (!queued) {
+            request->send(503, "text/plain", "Too many pending requests");
+            return;
+        }
+        // the replies are collected by the web task, the TCP stack writes them when complete
+        int id = entry.id;
+        request->onDisconnect([this, id]() {
+            lockDeferred();
+            int i = findPubsub(id);
+            if (i != -1) {
+                pubsubRequests[i].cancelled = true;
+            }
+            unlockDeferred();
+        });
+        request->send(request->beginChunkedResponse(
+            "application/json", [this, id](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+                return this->fillPubsubReply(id, buf, maxLen, index);
+            }));
+    }
+
+    size_t fillPubsubReply(int id, uint8_t *buf, size_t maxLen, size_t index) {
+        lockDeferred();
+        size_t len = RESPONSE_TRY_AGAIN;
+        int i = findPubsub(id);
+        if (i == -1) {
+            len = 0;
+        } else if (pubsubRequests[i].done) {
+            const String &body = pubsubRequests[i].replies;
+            len = index < body.length() ? body.length() - index : 0;
+            if (len > maxLen) {
+                len = maxLen;
+            }
+            memcpy(buf, body.c_str() + index, len);
+            if (index + len >= body.length()) {
+                pubsubRequests.erase(i);
+            }
+        }
+        unlockDeferred();
+        return len;
+    }
+#else
+    void handleRoot() {
+        handleFileSystem();
     }
 
     void handleFileSystem() {
         String fileName = pWebServer->uri();
         if (fileName == "/")
             fileName = "/index.html";
-        String contentType = getContentType(fileName);
-#ifdef __USE_SPIFFS_FS__
-        if (SPIFFS.exists(fileName)) {                // If the file exists
-            fs::File f = SPIFFS.open(fileName, "r");  // Open it
-#else
-        if (LittleFS.exists(fileName)) {                // If the file exists
-            fs::File f = LittleFS.open(fileName, "r");  // Open it
-#endif
-            /*size_t sent = */ pWebServer->streamFile(f, contentType);  // And send it to the client
-            f.close();                                                  // Then close the file again
+        const T_MIME_TYPE *pMime = getMimeType(fileName);
+        // serve a precompressed <file>.gz if available and accepted by the client
+        bool hasGzip = fileExists(fileName + ".gz");
+        bool gzip = hasGzip && pWebServer->header("Accept-Encoding").indexOf("gzip") != -1;
+        if (!gzip && !fileExists(fileName)) {
+            handleNotFound();
             return;
-        } else {
+        }
+        String path = gzip ? fileName + ".gz" : fileName;
+        int i = getCacheEntry(path);
+        if (i == -1) {
+            handleNotFound();
+            return;
+        }
+        const T_CACHE_ENTRY &entry = fileCache[i];
+        String etag = getETag(entry.size, entry.lastWrite, gzip);
+        String lastModified = entry.lastWrite ? getHttpDate(entry.lastWrite) : "";
+        pWebServer->sendHeader("ETag", etag);
+        if (lastModified.length()) {
+            pWebServer->sendHeader("Last-Modified", lastModified);
+        }
+        pWebServer->sendHeader("Cache-Control", getCacheControl(pMime));
+        if (hasGzip) {
+            pWebServer->sendHeader("Vary", "Accept-Encoding");
+        }
+        if (pWebServer->header("If-None-Match") == etag ||
+            (!pWebServer->hasHeader("If-None-Match") && lastModified.length() &&
+             pWebServer->header("If-Modified-Since") == lastModified)) {
+            // the client has a valid copy
+            pWebServer->send(304);
+            return;
+        }
+        if (entry.data) {
+            // served from the cache
+            if (gzip) {
+                pWebServer->sendHeader("Content-Encoding", "gzip");
+            }
+            pWebServer->send_P(200, pMime->type, (PGM_P)entry.data, entry.size);
+            return;
+        }
+        fs::File f = getFS().open(path, "r");  // Open it
+        if (!f) {
             handleNotFound();
+            return;
         }
+        // streamFile adds Content-Encoding: gzip for .gz files
+        /*size_t sent = */ pWebServer->streamFile(f, pMime->type);  // And send it to the client
+        f.close();                                                 // Then close the file again
     }
 
     void handleNotFound() {
@@ -119,7 +962,36 @@ class Web {
         pWebServer->send(404, "text/plain", message);
     }
 
+    void handlePubsub() {
+        if (!allowPublish) {
+            pWebServer->send(403, "text/plain", "Publishing is disabled");
+            return;
+        }
+        T_PUBSUB entry;
+        if (!parsePubsub(pWebServer->arg("plain"), pWebServer->arg("replies"),
+                         pWebServer->arg("timeout"), entry)) {
+            pWebServer->send(400, "text/plain", "Expected [{\"topic\":...,\"msg\":...},...]");
+            return;
+        }
+        if (!entry.topicCount) {
+            publishMessages(entry.messages);
+            pWebServer->send(200, "application/json", "[]");
+            return;
+        }
+        if (pubsubRequests.length() >= maxPubsubRequests) {
+            pWebServer->send(503, "text/plain", "Too many pending requests");
+            return;
+        }
+        // the connection is kept open, the reply is sent when all replies arrived or on timeout
+        entry.client = pWebServer->client();
+        entry.id = ++pubsubId;
+        pubsubRequests.add(entry);
+    }
+
     void initHandles() {
+        static const char *headerKeys[] = {"Accept-Encoding", "If-None-Match", "If-Modified-Since"};
+        pWebServer->collectHeaders(headerKeys, sizeof(headerKeys) / sizeof(headerKeys[0]));
+
         auto frt = [=]() { this->handleRoot(); };
         pWebServer->on("/", frt);
 
@@ -127,42 +999,71 @@ class Web {
                        [&]() { pWebServer->send(200, "text/plain", "this works as well"); });
 
         pWebServer->on("/result", [&]() {
-            String ssid = pWebServer->arg("ssid");
-            String hostname = pWebServer->arg("hostname");
-            String response = "{\"ssid\": \"" + ssid + "\", \"hostname\": \"" + hostname + "\"}";
+            JSONVar result;
+            result["ssid"] = pWebServer->arg("ssid");
+            result["hostname"] = pWebServer->arg("hostname");
+            String response = JSON.stringify(result);
             pWebServer->send(200, "text/plain", response.c_str());
-            pSched->publish("webserver/data", response);
+            this->publish("webserver/data", response);
         });
 
+        pWebServer->on("/events", HTTP_GET, [=]() { this->handleEventConnect(); });
+        pWebServer->on("/events", HTTP_POST, [=]() {
+            if (!this->allowPublish) {
+                pWebServer->send(403, "text/plain", "Publishing is disabled");
+                return;
+            }
+            this->handleEventPublish(pWebServer->arg("topic"), pWebServer->arg("msg"));
+            pWebServer->send(200, "text/plain", "ok");
+        });
+
+        pWebServer->on("/pubsub", HTTP_POST, [=]() { this->handlePubsub(); });
+
         auto fnf = [=]() { this->handleFileSystem(); };
         pWebServer->onNotFound(fnf);
     }
+#endif
 
     void loop() {
+        PowerProfile::countWakeup();
+#if defined(__USE_ASYNC_WEBSERVER__)
+        // requests are served by the TCP stack
+        publishDeferred();
+#endif
+        processPubsub();
         if (netUp) {
+#if !defined(__USE_ASYNC_WEBSERVER__)
             pWebServer->handleClient();
+#endif
+            if (eventKeepAlive.test()) {
+                // comment lines keep idle event streams open and detect lost browsers
+                eventKeepAlive.reset();
+                writeEventClients(":\n\n");
+            }
 #if !defined(__ESP32__) && !defined(__ESP32_RISC__)
             MDNS.update();
 #endif
         }
     }
 
-    void subsMsg(String topic, String msg, String originator) {
+    void onOtaState(const String &msg) {
+        JSONVar jsonMsg = JSON.parse(msg);
+        if (String((const char *)jsonMsg["type"]) == "filesystem") {
+            clearCache();
+        }
+    }
 
-        if (topic == "net/network") {
-            JSONVar jsonMsg = JSON.parse(msg);
-            String state = (const char *)jsonMsg["state"];  // root["state"];
-            if (state == "connected") {
-                if (!webUp) {
-                    netUp = true;
-                    MDNS.begin("esp8266");
-                    pWebServer->begin();
-                    initHandles();
-                    webUp = true;
-                }
-            } else {
-                netUp = false;
+    void onNetworkState(const NetState::T_STATE &state) {
+        if (state.connected) {
+            if (!webUp) {
+                netUp = true;
+                MDNS.begin("esp8266");
+                pWebServer->begin();
+                initHandles();
+                webUp = true;
             }
+        } else {
+            netUp = false;
         }
     }
 };  // Web